@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2026 the neverbleed authors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to
+ * deal in the Software without restriction, including without limitation the
+ * rights to use, copy, modify, merge, publish, distribute, sublicense, and/or
+ * sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
+ * IN THE SOFTWARE.
+ */
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/opensslconf.h>
+#include <openssl/opensslv.h>
+
+#if OPENSSL_VERSION_NUMBER >= 0x1010000fL && !defined(OPENSSL_NO_EC) \
+    && (!defined(LIBRESSL_VERSION_NUMBER) || LIBRESSL_VERSION_NUMBER >= 0x2090100fL)
+#define NEVERBLEED_BENCH_ECDSA
+#endif
+
+#ifdef NEVERBLEED_BENCH_ECDSA
+#include <openssl/ec.h>
+#endif
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <openssl/ssl.h>
+
+#include "neverbleed.h"
+
+enum bench_op { BENCH_OP_RSA_SIGN, BENCH_OP_RSA_DECRYPT, BENCH_OP_ECDSA_SIGN };
+
+struct bench_key_t {
+    const char *name;
+    /**
+     * the key as generated, and the same key loaded into the daemon
+     */
+    EVP_PKEY *inproc;
+    EVP_PKEY *privsep;
+};
+
+struct bench_thread_t {
+    pthread_t tid;
+    EVP_PKEY *pkey;
+    enum bench_op op;
+    /**
+     * latency of each operation, in nanoseconds
+     */
+    uint64_t *samples;
+    size_t num_samples;
+    size_t capacity;
+};
+
+static neverbleed_t nb;
+static volatile int bench_running;
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static EVP_PKEY *load_privsep(EVP_PKEY *pkey)
+{
+    char fn[] = "/tmp/neverbleed-bench.XXXXXX", errbuf[NEVERBLEED_ERRBUF_SIZE];
+    SSL_CTX *ctx;
+    EVP_PKEY *ret;
+    FILE *fp;
+    int fd;
+
+    if ((fd = mkstemp(fn)) == -1 || (fp = fdopen(fd, "w")) == NULL) {
+        fprintf(stderr, "failed to create temporary file:%s\n", strerror(errno));
+        exit(111);
+    }
+    if (!PEM_write_PrivateKey(fp, pkey, NULL, NULL, 0, NULL, NULL)) {
+        fprintf(stderr, "failed to write private key\n");
+        exit(111);
+    }
+    fclose(fp);
+
+    ctx = SSL_CTX_new(SSLv23_server_method());
+    if (neverbleed_load_private_key_file(&nb, ctx, fn, errbuf) != 1) {
+        fprintf(stderr, "failed to load private key from file:%s:%s\n", fn, errbuf);
+        exit(111);
+    }
+    unlink(fn);
+    ret = SSL_CTX_get0_privatekey(ctx);
+    EVP_PKEY_up_ref(ret);
+    SSL_CTX_free(ctx);
+
+    return ret;
+}
+
+static void setup_rsa_key(struct bench_key_t *key, const char *name, int bits)
+{
+    RSA *rsa = RSA_new();
+    BIGNUM *e = BN_new();
+
+    BN_set_word(e, RSA_F4);
+    if (!RSA_generate_key_ex(rsa, bits, e, NULL)) {
+        fprintf(stderr, "failed to generate RSA key\n");
+        exit(111);
+    }
+    BN_free(e);
+    key->name = name;
+    key->inproc = EVP_PKEY_new();
+    EVP_PKEY_assign_RSA(key->inproc, rsa);
+    key->privsep = load_privsep(key->inproc);
+}
+
+#ifdef NEVERBLEED_BENCH_ECDSA
+static void setup_ecdsa_key(struct bench_key_t *key, const char *name, int nid)
+{
+    EC_KEY *ec_key = EC_KEY_new_by_curve_name(nid);
+
+    if (ec_key == NULL || !EC_KEY_generate_key(ec_key)) {
+        fprintf(stderr, "failed to generate key on curve \"%s\"\n", OBJ_nid2sn(nid));
+        exit(111);
+    }
+    EC_KEY_set_asn1_flag(ec_key, OPENSSL_EC_NAMED_CURVE);
+    key->name = name;
+    key->inproc = EVP_PKEY_new();
+    EVP_PKEY_assign_EC_KEY(key->inproc, ec_key);
+    key->privsep = load_privsep(key->inproc);
+}
+#endif
+
+static void *bench_thread(void *_thread)
+{
+    struct bench_thread_t *thread = _thread;
+    unsigned char digest[32], sig[1024], ciphertext[1024], plaintext[1024];
+    unsigned siglen;
+    int ciphertext_len = 0, ok;
+    RSA *rsa = NULL;
+#ifdef NEVERBLEED_BENCH_ECDSA
+    EC_KEY *ec_key = NULL;
+#endif
+
+    memset(digest, 0x55, sizeof(digest));
+    switch (thread->op) {
+    case BENCH_OP_RSA_SIGN:
+        rsa = EVP_PKEY_get1_RSA(thread->pkey);
+        break;
+    case BENCH_OP_RSA_DECRYPT:
+        rsa = EVP_PKEY_get1_RSA(thread->pkey);
+        ciphertext_len = RSA_public_encrypt(sizeof(digest), digest, ciphertext, rsa, RSA_PKCS1_PADDING);
+        break;
+    case BENCH_OP_ECDSA_SIGN:
+#ifdef NEVERBLEED_BENCH_ECDSA
+        ec_key = EVP_PKEY_get1_EC_KEY(thread->pkey);
+#endif
+        break;
+    }
+
+    while (bench_running) {
+        uint64_t start = now_nsec();
+        switch (thread->op) {
+        case BENCH_OP_RSA_SIGN:
+            ok = RSA_sign(NID_sha256, digest, sizeof(digest), sig, &siglen, rsa) == 1;
+            break;
+        case BENCH_OP_RSA_DECRYPT:
+            ok = RSA_private_decrypt(ciphertext_len, ciphertext, plaintext, rsa, RSA_PKCS1_PADDING) == sizeof(digest);
+            break;
+        default:
+#ifdef NEVERBLEED_BENCH_ECDSA
+            ok = ECDSA_sign(0, digest, sizeof(digest), sig, &siglen, ec_key) == 1;
+#else
+            ok = 0;
+#endif
+            break;
+        }
+        if (!ok) {
+            fprintf(stderr, "operation failed\n");
+            exit(1);
+        }
+        if (thread->num_samples == thread->capacity) {
+            thread->capacity = thread->capacity == 0 ? 1024 : thread->capacity * 2;
+            if ((thread->samples = realloc(thread->samples, thread->capacity * sizeof(thread->samples[0]))) == NULL) {
+                fprintf(stderr, "no memory\n");
+                exit(111);
+            }
+        }
+        thread->samples[thread->num_samples++] = now_nsec() - start;
+    }
+
+    RSA_free(rsa);
+#ifdef NEVERBLEED_BENCH_ECDSA
+    EC_KEY_free(ec_key);
+#endif
+    return NULL;
+}
+
+static int cmp_samples(const void *_x, const void *_y)
+{
+    uint64_t x = *(const uint64_t *)_x, y = *(const uint64_t *)_y;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_usec(const uint64_t *samples, size_t num_samples, double p)
+{
+    size_t i = (size_t)(num_samples * p);
+    if (i >= num_samples)
+        i = num_samples - 1;
+    return samples[i] / 1000.;
+}
+
+static void run(const char *key_name, const char *op_name, const char *mode, EVP_PKEY *pkey, enum bench_op op, size_t num_threads,
+                double duration)
+{
+    struct bench_thread_t *threads = calloc(num_threads, sizeof(*threads));
+    uint64_t *samples, started;
+    size_t i, num_samples = 0;
+    double elapsed;
+
+    bench_running = 1;
+    started = now_nsec();
+    for (i = 0; i != num_threads; ++i) {
+        threads[i].pkey = pkey;
+        threads[i].op = op;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread, threads + i) != 0) {
+            fprintf(stderr, "pthread_create failed\n");
+            exit(111);
+        }
+    }
+    {
+        struct timespec ts = {(time_t)duration, (long)((duration - (time_t)duration) * 1e9)};
+        while (nanosleep(&ts, &ts) != 0 && errno == EINTR)
+            ;
+    }
+    bench_running = 0;
+    for (i = 0; i != num_threads; ++i) {
+        pthread_join(threads[i].tid, NULL);
+        num_samples += threads[i].num_samples;
+    }
+    elapsed = (now_nsec() - started) / 1e9;
+
+    /* merge the samples */
+    if ((samples = malloc((num_samples + 1) * sizeof(*samples))) == NULL) {
+        fprintf(stderr, "no memory\n");
+        exit(111);
+    }
+    num_samples = 0;
+    for (i = 0; i != num_threads; ++i) {
+        memcpy(samples + num_samples, threads[i].samples, threads[i].num_samples * sizeof(*samples));
+        num_samples += threads[i].num_samples;
+        free(threads[i].samples);
+    }
+    free(threads);
+    qsort(samples, num_samples, sizeof(*samples), cmp_samples);
+
+    if (num_samples == 0) {
+        printf("%-8s %-8s %-8s %7zu %10s\n", key_name, op_name, mode, num_threads, "-");
+    } else {
+        printf("%-8s %-8s %-8s %7zu %10.1f %9.1f %9.1f %9.1f\n", key_name, op_name, mode, num_threads, num_samples / elapsed,
+               percentile_usec(samples, num_samples, 0.5), percentile_usec(samples, num_samples, 0.99),
+               percentile_usec(samples, num_samples, 0.999));
+    }
+    fflush(stdout);
+    free(samples);
+}
+
+int main(int argc, char **argv)
+{
+    struct bench_key_t keys[4];
+    size_t num_keys = 0, max_threads = 0, num_threads, i;
+    double duration = 2;
+    char errbuf[NEVERBLEED_ERRBUF_SIZE], *end;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "t:d:h")) != -1) {
+        switch (ch) {
+        case 't':
+            if (sscanf(optarg, "%zu", &max_threads) != 1 || max_threads == 0) {
+                fprintf(stderr, "invalid number of threads:%s\n", optarg);
+                return 111;
+            }
+            break;
+        case 'd':
+            errno = 0;
+            duration = strtod(optarg, &end);
+            if (errno != 0 || end == optarg || *end != '\0' || !(duration > 0 && duration < 86400)) {
+                fprintf(stderr, "invalid duration:%s\n", optarg);
+                return 111;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-t max-threads] [-d seconds-per-run]\n", argv[0]);
+            return 111;
+        }
+    }
+    if (max_threads == 0) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        max_threads = n > 0 ? n : 1;
+    }
+
+    /* initialization */
+    SSL_load_error_strings();
+    SSL_library_init();
+    OpenSSL_add_all_algorithms();
+    if (neverbleed_init(&nb, errbuf) != 0) {
+        fprintf(stderr, "openssl_privsep_init: %s\n", errbuf);
+        return 111;
+    }
+    setup_rsa_key(keys + num_keys++, "rsa2048", 2048);
+    setup_rsa_key(keys + num_keys++, "rsa4096", 4096);
+#ifdef NEVERBLEED_BENCH_ECDSA
+    setup_ecdsa_key(keys + num_keys++, "p256", NID_X9_62_prime256v1);
+    setup_ecdsa_key(keys + num_keys++, "p384", NID_secp384r1);
+#endif
+
+    printf("%-8s %-8s %-8s %7s %10s %9s %9s %9s\n", "key", "op", "mode", "threads", "ops/sec", "p50(us)", "p99(us)", "p999(us)");
+    for (i = 0; i != num_keys; ++i) {
+        static const struct {
+            const char *name;
+            enum bench_op op;
+        } rsa_ops[] = {{"sign", BENCH_OP_RSA_SIGN}, {"decrypt", BENCH_OP_RSA_DECRYPT}},
+          ecdsa_ops[] = {{"sign", BENCH_OP_ECDSA_SIGN}};
+        int is_rsa = EVP_PKEY_base_id(keys[i].inproc) == EVP_PKEY_RSA;
+        size_t num_ops = is_rsa ? 2 : 1, j;
+        for (j = 0; j != num_ops; ++j) {
+            const char *op_name = is_rsa ? rsa_ops[j].name : ecdsa_ops[j].name;
+            enum bench_op op = is_rsa ? rsa_ops[j].op : ecdsa_ops[j].op;
+            /* 1, 2, 4, ..., and `max_threads` */
+            for (num_threads = 1;; num_threads = num_threads * 2 < max_threads ? num_threads * 2 : max_threads) {
+                run(keys[i].name, op_name, "inproc", keys[i].inproc, op, num_threads, duration);
+                run(keys[i].name, op_name, "privsep", keys[i].privsep, op, num_threads, duration);
+                if (num_threads == max_threads)
+                    break;
+            }
+        }
+    }
+
+    return 0;
+}
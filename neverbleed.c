@@ -19,15 +19,21 @@
  * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS
  * IN THE SOFTWARE.
  */
+#ifdef __linux__
+#define _GNU_SOURCE /* memfd_create, F_ADD_SEALS */
+#endif
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <grp.h>
 #include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <pwd.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -38,8 +44,19 @@
 #include <unistd.h>
 #include <signal.h>
 #if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/prctl.h>
+#include <time.h>
+/* the daemon multiplexes the connections using epoll */
+#define NEVERBLEED_EPOLL
+#if defined(MFD_ALLOW_SEALING) && defined(F_SEAL_SHRINK)
+/* memfd and eventfd are available, so requests can be exchanged through shared memory. */
+#define NEVERBLEED_SHM_RING
+#endif
 #elif defined(__APPLE__)
 #include <sys/ptrace.h>
 #elif defined(__FreeBSD__)
@@ -62,12 +79,26 @@
 #define NEVERBLEED_ECDSA
 #endif
 
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L && !defined(OPENSSL_NO_EC) && !defined(LIBRESSL_VERSION_NUMBER)
+/* EVP_PKEY has ex_data, through which the Ed25519 and Ed448 keys built by the engine refer to the keys in the daemon. */
+#define NEVERBLEED_EDDSA
+#endif
+
+#if OPENSSL_VERSION_NUMBER >= 0x1010000fL && !defined(OPENSSL_NO_ASYNC) && !defined(LIBRESSL_VERSION_NUMBER)
+/* ASYNC_JOB is available, so the key operations can pause the job instead of blocking the thread. */
+#define NEVERBLEED_ASYNC
+#endif
+
+#ifdef NEVERBLEED_ASYNC
+#include <openssl/async.h>
+#endif
 #include <openssl/bn.h>
 #ifdef NEVERBLEED_ECDSA
 #include <openssl/ec.h>
 #endif
 #include <openssl/rand.h>
 #include <openssl/rsa.h>
+#include <openssl/sha.h>
 #include <openssl/ssl.h>
 
 #if OPENSSL_VERSION_NUMBER < 0x1010000fL \
@@ -113,7 +144,68 @@ static void RSA_set_flags(RSA *r, int flags)
 
 #include "neverbleed.h"
 
-enum neverbleed_type { NEVERBLEED_TYPE_ERROR, NEVERBLEED_TYPE_RSA, NEVERBLEED_TYPE_ECDSA };
+enum neverbleed_type { NEVERBLEED_TYPE_ERROR, NEVERBLEED_TYPE_RSA, NEVERBLEED_TYPE_ECDSA, NEVERBLEED_TYPE_EDDSA };
+
+/**
+ * the order must be kept in sync with NEVERBLEED_STATS_OP_*
+ */
+enum neverbleed_opcode {
+    NEVERBLEED_OP_PRIV_ENC,
+    NEVERBLEED_OP_PRIV_DEC,
+    NEVERBLEED_OP_SIGN,
+    NEVERBLEED_OP_ECDSA_SIGN,
+    NEVERBLEED_OP_LOAD_KEY,
+    NEVERBLEED_OP_DEL_RSA_KEY,
+    NEVERBLEED_OP_DEL_ECDSA_KEY,
+    NEVERBLEED_OP_SETUIDGID,
+    NEVERBLEED_OP_SIGN_BATCH,
+    NEVERBLEED_OP_STATS,
+    NEVERBLEED_OP_LOAD_KEYS,
+    NEVERBLEED_OP_REGISTER_KEY,
+    NEVERBLEED_OP_REPLACE_KEY,
+    NEVERBLEED_OP_EDDSA_SIGN,
+    NEVERBLEED_OP_DEL_EDDSA_KEY,
+    NEVERBLEED_OP_NUM
+};
+
+typedef char neverbleed_opcode_matches_stats[(int)NEVERBLEED_OP_NUM == (int)NEVERBLEED_STATS_NUM_OPS ? 1 : -1];
+
+/**
+ * fixed-size header of a request, followed by the payload
+ */
+struct st_neverbleed_cmd_t {
+    uint8_t opcode;
+    uint8_t _reserved[3];
+    uint32_t key_index;
+    /**
+     * argument specific to the operation (e.g., padding mode, NID of the digest algorithm)
+     */
+    int32_t arg;
+    uint32_t payload_len;
+};
+
+/**
+ * buffers that are retained for reuse (by the threads of the application and of the daemon) are released if they grow beyond this
+ * size, e.g. by a batch of operations
+ */
+#define NEVERBLEED_RETAINED_BUF_MAX_SIZE 16384
+
+/**
+ * maximum number of files sent in one request by `neverbleed_load_private_key_files`
+ */
+#define NEVERBLEED_LOAD_KEYS_CHUNK_SIZE 1024
+
+/**
+ * maximum number of operations, and the size of the payload beyond which no more operations are added, of one request sent by
+ * `neverbleed_sign_batch`
+ */
+#define NEVERBLEED_SIGN_BATCH_CHUNK_SIZE 1024
+#define NEVERBLEED_SIGN_BATCH_CHUNK_BYTES (1024 * 1024)
+
+/**
+ * number of pre-connected channels requested from the daemon at once (see `neverbleed_use_socketpairs`)
+ */
+#define NEVERBLEED_CHANNEL_BATCH 8
 
 struct expbuf_t {
     char *buf;
@@ -122,22 +214,224 @@ struct expbuf_t {
     size_t capacity;
 };
 
+/**
+ * a daemon process spawned by `neverbleed_init`
+ */
+struct st_neverbleed_daemon_t {
+    pid_t pid;
+    struct sockaddr_un sun_;
+    /**
+     * connections shared by the threads for sending the operations that block (or NULL if each thread uses its own; see
+     * `neverbleed_num_shared_conns`)
+     */
+    struct st_neverbleed_shared_conn_t *shared_conns;
+    size_t num_shared_conns;
+    /**
+     * number of keys held by the daemon that are not replicated to the others, used for choosing the daemon to load a key into
+     */
+    size_t num_keys;
+    /**
+     * number of requests in flight, used for choosing among the daemons holding replicas of a key
+     */
+    size_t num_inflight;
+    /**
+     * socket through which the daemon hands out pre-connected channels (or -1 if the connections are established by connecting to
+     * `sun_`; see `neverbleed_use_socketpairs`), along with the channels that have been received but not yet used
+     */
+    struct {
+        int control_fd;
+        pthread_mutex_t lock;
+        int spares[NEVERBLEED_CHANNEL_BATCH];
+        size_t num_spares;
+    } channels;
+};
+
 struct st_neverbleed_rsa_exdata_t {
     neverbleed_t *nb;
+    /**
+     * the daemon holding the key and the index of the key within the daemon, or SIZE_MAX if the key has been loaded into all the
+     * daemons, in which case the index of the key within each daemon is stored in `replica_indices` (SIZE_MAX if not loaded)
+     */
+    size_t daemon;
     size_t key_index;
+    size_t *replica_indices;
 };
 
-struct st_neverbleed_thread_data_t {
-    pid_t self_pid;
+struct st_neverbleed_conn_t {
     int fd;
+    /**
+     * counter of the requests in flight of the daemon being connected
+     */
+    size_t *num_inflight;
+    /**
+     * link used for retaining the connection in the idle list (see `keyop_transaction`)
+     */
+    struct st_neverbleed_conn_t *next;
+    /**
+     * bytes received from the daemon that have not yet been dispatched
+     */
+    struct expbuf_t rbuf;
+    /**
+     * requests waiting for their responses; the daemon might respond in an order different from that of the requests
+     */
+    struct {
+        neverbleed_req_t *first;
+        neverbleed_req_t **tail;
+    } pending;
+    /**
+     * id to be assigned to the next request
+     */
+    size_t next_id;
+    /**
+     * rings in shared memory used for exchanging the messages (or NULL if the connection uses only the socket), along with the
+     * eventfds used for waking up the daemon (sq_efd) and the client (cq_efd)
+     */
+    struct st_neverbleed_shm_t *shm;
+    int sq_efd;
+    int cq_efd;
+};
+
+/**
+ * a connection shared by the threads. A thread waiting for its response becomes the reader of the socket unless another thread is
+ * reading, in which case it sleeps until the reader dispatches the responses that have arrived.
+ */
+struct st_neverbleed_shared_conn_t {
+    /**
+     * serializes the access to the connection, except for the writes and for the receive buffer that is touched only by the reader
+     */
+    pthread_mutex_t mutex;
+    /**
+     * serializes the writes, so that the requests being sent by the threads do not interleave
+     */
+    pthread_mutex_t write_mutex;
+    /**
+     * signalled when the reader has dispatched the responses
+     */
+    pthread_cond_t cond;
+    /**
+     * if a thread is reading the socket
+     */
+    int reading;
+    struct st_neverbleed_conn_t conn;
+};
+
+struct st_neverbleed_thread_data_t {
+    neverbleed_t *nb;
+    /**
+     * value of `client_vars.fork_generation` when the data was set up; the process has forked if they differ
+     */
+    size_t fork_generation;
+    /**
+     * links of `client_vars.threads`
+     */
+    struct st_neverbleed_thread_data_t *next, **prev;
+    /**
+     * the daemon preferred among those holding replicas of a key when they are equally loaded, so that the threads are spread
+     * across the daemons
+     */
+    size_t home_daemon;
+    /**
+     * selects the connection to use among the shared connections of each daemon
+     */
+    size_t shared_conn_index;
+    /**
+     * operations started by `neverbleed_start_*` that have completed but have not yet been returned by `neverbleed_get_completed`
+     */
+    struct {
+        neverbleed_req_t *first;
+        neverbleed_req_t **tail;
+    } completed;
+    /**
+     * buffer retained for building the requests and receiving the responses, so that the operations can be run without allocating
+     * memory (see `thread_data_take_buf`)
+     */
+    struct expbuf_t buf;
+    /**
+     * connections to each daemon
+     */
+    struct {
+        /**
+         * connection used by the operations that block until completion; opened on first use
+         */
+        struct st_neverbleed_conn_t conn;
+        /**
+         * connection used by the operations started by `neverbleed_start_*`; opened on first use
+         */
+        struct st_neverbleed_conn_t async_conn;
+        /**
+         * connections that have been used by ASYNC jobs and are now idle
+         */
+        struct st_neverbleed_conn_t *idle_job_conns;
+    } daemons[1];
+};
+
+enum neverbleed_req_kind {
+    NEVERBLEED_REQ_BLOCKING,
+    NEVERBLEED_REQ_RSA_SIGN,
+    NEVERBLEED_REQ_ECDSA_SIGN,
+    NEVERBLEED_REQ_EDDSA_SIGN,
+    NEVERBLEED_REQ_DECRYPT
+};
+
+struct st_neverbleed_req_t {
+    neverbleed_req_t *next;
+    size_t id;
+    struct st_neverbleed_thread_data_t *thdata;
+    enum neverbleed_req_kind kind;
+    void *data;
+    int completed;
+    int cancelled;
+    /**
+     * value of `client_vars.fork_generation` when the request was started; requests started before fork() cannot be completed by
+     * the child process
+     */
+    size_t fork_generation;
+    /**
+     * the response
+     */
+    struct expbuf_t buf;
 };
 
+/**
+ * state of the client shared by the instances of neverbleed, used for dealing with fork(2) (see `client_on_fork_child`)
+ */
+static struct {
+    /**
+     * incremented in the child process every time the process forks, so that the threads can tell cheaply whether the data that
+     * they retain was set up by the parent
+     */
+    size_t fork_generation;
+    /**
+     * protects `instances` and `threads`; held while forking, so that the lists are consistent in the child process
+     */
+    pthread_mutex_t lock;
+    neverbleed_t **instances;
+    size_t num_instances;
+    struct st_neverbleed_thread_data_t *threads;
+} client_vars = {0, PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * stores the description of `err` to `buf`, using either variant of strerror_r
+ */
+static void strerror_buf(int err, char *buf, size_t bufsize)
+{
+#if defined(__GLIBC__) && defined(_GNU_SOURCE)
+    /* the GNU variant might return a static string instead of filling the buffer */
+    const char *s = strerror_r(err, buf, bufsize);
+    if (s != buf)
+        snprintf(buf, bufsize, "%s", s);
+#else
+    if (strerror_r(err, buf, bufsize) != 0)
+        snprintf(buf, bufsize, "error %d", err);
+#endif
+}
+
 static void warnvf(const char *fmt, va_list args)
 {
     char errbuf[256];
 
     if (errno != 0) {
-        strerror_r(errno, errbuf, sizeof(errbuf));
+        strerror_buf(errno, errbuf, sizeof(errbuf));
     } else {
         errbuf[0] = '\0';
     }
@@ -191,22 +485,64 @@ static void set_cloexec(int fd)
         dief("failed to set O_CLOEXEC to fd %d", fd);
 }
 
-static int read_nbytes(int fd, void *p, size_t sz)
+static void set_signal_handler(int signo, void (*cb)(int signo))
 {
-    while (sz != 0) {
-        ssize_t r;
-        while ((r = read(fd, p, sz)) == -1 && errno == EINTR)
-            ;
-        if (r == -1) {
-            return -1;
-        } else if (r == 0) {
-            errno = 0;
-            return -1;
-        }
-        p = (char *)p + r;
-        sz -= r;
-    }
-    return 0;
+    struct sigaction action;
+
+    memset(&action, 0, sizeof(action));
+    sigemptyset(&action.sa_mask);
+    action.sa_handler = cb;
+    sigaction(signo, &action, NULL);
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static size_t histogram_index(uint64_t v)
+{
+    size_t shift, index;
+
+    if (v < (1 << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS))
+        return (size_t)v;
+    shift = 63 - __builtin_clzll(v) - NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS;
+    index = ((shift + 1) << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS) +
+            (size_t)((v >> shift) & ((1 << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS) - 1));
+    return index < NEVERBLEED_HISTOGRAM_NUM_BUCKETS ? index : NEVERBLEED_HISTOGRAM_NUM_BUCKETS - 1;
+}
+
+/**
+ * returns the largest value that maps to the bucket
+ */
+static uint64_t histogram_bucket_max(size_t index)
+{
+    size_t shift;
+    uint64_t sub_bucket;
+
+    if (index < (1 << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS))
+        return index;
+    shift = (index >> NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS) - 1;
+    sub_bucket = index & ((1 << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS) - 1);
+    return ((sub_bucket + (1 << NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS) + 1) << shift) - 1;
+}
+
+uint64_t neverbleed_histogram_percentile(const neverbleed_histogram_t *hist, double percentile)
+{
+    uint64_t total = 0, threshold, sum = 0;
+    size_t i;
+
+    for (i = 0; i != NEVERBLEED_HISTOGRAM_NUM_BUCKETS; ++i)
+        total += hist->buckets[i];
+    if (total == 0)
+        return 0;
+    threshold = (uint64_t)(total * percentile / 100);
+    for (i = 0; i != NEVERBLEED_HISTOGRAM_NUM_BUCKETS - 1; ++i)
+        if ((sum += hist->buckets[i]) > threshold)
+            break;
+    return histogram_bucket_max(i);
 }
 
 static size_t expbuf_size(struct expbuf_t *buf)
@@ -214,10 +550,20 @@ static size_t expbuf_size(struct expbuf_t *buf)
     return buf->end - buf->start;
 }
 
+/**
+ * empties the buffer, retaining the memory for reuse. Only the bytes that have been used are cleansed; code that shrinks `end`
+ * should cleanse the bytes it discards.
+ */
+static void expbuf_clear(struct expbuf_t *buf)
+{
+    if (buf->end != buf->buf)
+        OPENSSL_cleanse(buf->buf, buf->end - buf->buf);
+    buf->start = buf->end = buf->buf;
+}
+
 static void expbuf_dispose(struct expbuf_t *buf)
 {
-    if (buf->capacity != 0)
-        OPENSSL_cleanse(buf->buf, buf->capacity);
+    expbuf_clear(buf);
     free(buf->buf);
     memset(buf, 0, sizeof(*buf));
 }
@@ -294,17 +640,62 @@ static void *expbuf_shift_bytes(struct expbuf_t *buf, size_t *l)
     return ret;
 }
 
-static int expbuf_write(struct expbuf_t *buf, int fd)
+/**
+ * builds a request. `payload` of strings should include the terminating NUL.
+ */
+static void expbuf_push_cmd(struct expbuf_t *buf, enum neverbleed_opcode opcode, size_t key_index, int arg, const void *payload,
+                            size_t payload_len)
+{
+    struct st_neverbleed_cmd_t cmd = {opcode};
+
+    /* the widths of the fields are fixed; truncating the values would desynchronize the stream */
+    if (key_index > UINT32_MAX || payload_len > UINT32_MAX) {
+        errno = 0;
+        dief("request too large (key index:%zu, payload:%zu bytes)", key_index, payload_len);
+    }
+    cmd.key_index = (uint32_t)key_index;
+    cmd.arg = arg;
+    cmd.payload_len = (uint32_t)payload_len;
+    expbuf_reserve(buf, sizeof(cmd) + payload_len);
+    memcpy(buf->end, &cmd, sizeof(cmd));
+    buf->end += sizeof(cmd);
+    if (payload_len != 0) {
+        memcpy(buf->end, payload, payload_len);
+        buf->end += payload_len;
+    }
+}
+
+/**
+ * returns the payload of a request as a string, or NULL if it is not NUL-terminated
+ */
+static char *expbuf_shift_cmd_str(struct expbuf_t *buf)
+{
+    char *ret = buf->start;
+
+    if (expbuf_size(buf) == 0 || buf->end[-1] != '\0')
+        return NULL;
+    buf->start = buf->end;
+    return ret;
+}
+
+#ifndef NEVERBLEED_EPOLL
+
+/**
+ * writes a response, blocking until all of it has been written (see `daemon_conn_send` for the epoll variant)
+ */
+static int expbuf_write(struct expbuf_t *buf, size_t id, int fd)
 {
-    struct iovec vecs[2] = {{NULL}};
-    size_t bufsz = expbuf_size(buf);
+    struct iovec vecs[3] = {{NULL}};
+    size_t bufsz = sizeof(id) + expbuf_size(buf);
     int vecindex;
     ssize_t r;
 
     vecs[0].iov_base = &bufsz;
     vecs[0].iov_len = sizeof(bufsz);
-    vecs[1].iov_base = buf->start;
-    vecs[1].iov_len = bufsz;
+    vecs[1].iov_base = &id;
+    vecs[1].iov_len = sizeof(id);
+    vecs[2].iov_base = buf->start;
+    vecs[2].iov_len = expbuf_size(buf);
 
     for (vecindex = 0; vecindex != sizeof(vecs) / sizeof(vecs[0]);) {
         while ((r = writev(fd, vecs + vecindex, sizeof(vecs) / sizeof(vecs[0]) - vecindex)) == -1 && errno == EINTR)
@@ -312,7 +703,7 @@ static int expbuf_write(struct expbuf_t *buf, int fd)
         if (r == -1)
             return -1;
         assert(r != 0);
-        while (r != 0 && r >= vecs[vecindex].iov_len) {
+        while (vecindex != sizeof(vecs) / sizeof(vecs[0]) && r >= vecs[vecindex].iov_len) {
             r -= vecs[vecindex].iov_len;
             ++vecindex;
         }
@@ -325,19 +716,170 @@ static int expbuf_write(struct expbuf_t *buf, int fd)
     return 0;
 }
 
-static int expbuf_read(struct expbuf_t *buf, int fd)
+#endif
+
+#ifdef NEVERBLEED_EPOLL
+
+static void efd_notify(int efd)
 {
-    size_t sz;
+    uint64_t one = 1;
+    while (write(efd, &one, sizeof(one)) == -1 && errno == EINTR)
+        ;
+}
+
+static void efd_clear(int efd)
+{
+    uint64_t cnt;
+    while (read(efd, &cnt, sizeof(cnt)) == -1 && errno == EINTR)
+        ;
+}
+
+#endif
+
+#ifdef NEVERBLEED_SHM_RING
+
+#define NEVERBLEED_RING_DEPTH 16
+#define NEVERBLEED_RING_SLOT_SIZE 2048
+/**
+ * duration (in microseconds) for which the consumer polls the ring for new entries before going to sleep
+ */
+#define NEVERBLEED_RING_SPIN_USEC 50
+
+/**
+ * spinning is pointless on uniprocessor systems, as the peer cannot make progress while we spin; set up by `neverbleed_init`
+ */
+static uint64_t ring_spin_usec;
+
+/**
+ * single-producer single-consumer queue of messages, placed in memory shared by a client thread and the daemon. As the client is
+ * not trusted by the daemon, indexes and lengths are validated by the reader, and messages are copied out before being parsed.
+ */
+struct st_neverbleed_ring_t {
+    /**
+     * index of the next message to be consumed; updated by the consumer
+     */
+    uint32_t head __attribute__((aligned(64)));
+    /**
+     * set by the consumer when it is about to sleep, in which case the producer should write to the eventfd
+     */
+    uint32_t need_wakeup;
+    /**
+     * index of the next message to be produced; updated by the producer
+     */
+    uint32_t tail __attribute__((aligned(64)));
+    struct {
+        uint32_t len;
+        unsigned char bytes[NEVERBLEED_RING_SLOT_SIZE];
+    } slots[NEVERBLEED_RING_DEPTH] __attribute__((aligned(64)));
+};
+
+struct st_neverbleed_shm_t {
+    /**
+     * requests, produced by the client
+     */
+    struct st_neverbleed_ring_t sq;
+    /**
+     * responses, produced by the daemon
+     */
+    struct st_neverbleed_ring_t cq;
+};
+
+static uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * pushes a message consisting of `id` and the content of `buf`. Returns -1 if the ring is full or if the message is too large.
+ */
+static int ring_push(struct st_neverbleed_ring_t *ring, size_t id, struct expbuf_t *buf)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED), head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    size_t len = sizeof(id) + expbuf_size(buf);
+
+    if (tail - head >= NEVERBLEED_RING_DEPTH || len > NEVERBLEED_RING_SLOT_SIZE)
+        return -1;
+    memcpy(ring->slots[tail % NEVERBLEED_RING_DEPTH].bytes, &id, sizeof(id));
+    memcpy(ring->slots[tail % NEVERBLEED_RING_DEPTH].bytes + sizeof(id), buf->start, expbuf_size(buf));
+    ring->slots[tail % NEVERBLEED_RING_DEPTH].len = (uint32_t)len;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+static int ring_is_empty(struct st_neverbleed_ring_t *ring)
+{
+    return __atomic_load_n(&ring->head, __ATOMIC_RELAXED) == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+}
 
-    if (read_nbytes(fd, &sz, sizeof(sz)) != 0)
+/**
+ * copies the oldest message to `buf` and removes it from the ring, clearing the slot. Returns 1 if a message has been shifted, 0 if
+ * the ring is empty, or -1 if the ring is corrupt.
+ */
+static int ring_shift(struct st_neverbleed_ring_t *ring, struct expbuf_t *buf)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED), tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE), len;
+
+    if (head == tail)
+        return 0;
+    if (tail - head > NEVERBLEED_RING_DEPTH)
         return -1;
-    expbuf_reserve(buf, sz);
-    if (read_nbytes(fd, buf->end, sz) != 0)
+    if ((len = __atomic_load_n(&ring->slots[head % NEVERBLEED_RING_DEPTH].len, __ATOMIC_RELAXED)) > NEVERBLEED_RING_SLOT_SIZE)
         return -1;
-    buf->end += sz;
+    expbuf_reserve(buf, len);
+    memcpy(buf->end, ring->slots[head % NEVERBLEED_RING_DEPTH].bytes, len);
+    buf->end += len;
+    OPENSSL_cleanse(ring->slots[head % NEVERBLEED_RING_DEPTH].bytes, len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+/**
+ * called by the producer after pushing messages; returns if the consumer needs to be woken up
+ */
+static int ring_need_wakeup(struct st_neverbleed_ring_t *ring)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ring->need_wakeup, __ATOMIC_RELAXED) != 0;
+}
+
+/**
+ * called by the consumer before going to sleep. Returns 0 if it is safe to sleep, or -1 if a message arrived in the meantime.
+ */
+static int ring_prepare_sleep(struct st_neverbleed_ring_t *ring)
+{
+    __atomic_store_n(&ring->need_wakeup, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!ring_is_empty(ring)) {
+        __atomic_store_n(&ring->need_wakeup, 0, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * polls the ring for new messages until the spin duration elapses; returns if a message is available
+ */
+static int ring_spin(struct st_neverbleed_ring_t *ring)
+{
+    uint64_t deadline;
+
+    if (ring_spin_usec == 0)
+        return !ring_is_empty(ring);
+
+    deadline = now_usec() + ring_spin_usec;
+    do {
+        if (!ring_is_empty(ring))
+            return 1;
+    } while (now_usec() < deadline);
     return 0;
 }
 
+#endif
+
 #if !defined(NAME_MAX) || defined(__linux__)
 /* readdir(3) is known to be thread-safe on Linux and should be thread-safe on a platform that does not have a predefined value for
    NAME_MAX */
@@ -374,1007 +916,5329 @@ static void unlink_dir(const char *path)
     rmdir(path);
 }
 
-void dispose_thread_data(void *_thdata)
+static void req_dispose(neverbleed_req_t *req)
 {
-    struct st_neverbleed_thread_data_t *thdata = _thdata;
-    assert(thdata->fd >= 0);
-    close(thdata->fd);
-    thdata->fd = -1;
+    expbuf_dispose(&req->buf);
+    if (req->kind != NEVERBLEED_REQ_BLOCKING)
+        free(req);
 }
 
-struct st_neverbleed_thread_data_t *get_thread_data(neverbleed_t *nb)
+static void conn_init(struct st_neverbleed_conn_t *conn)
 {
-    struct st_neverbleed_thread_data_t *thdata;
-    pid_t self_pid = getpid();
+    conn->fd = -1;
+    conn->num_inflight = NULL;
+    conn->next = NULL;
+    memset(&conn->rbuf, 0, sizeof(conn->rbuf));
+    conn->pending.first = NULL;
+    conn->pending.tail = &conn->pending.first;
+    conn->next_id = 0;
+    conn->shm = NULL;
+    conn->sq_efd = -1;
+    conn->cq_efd = -1;
+}
+
+#ifdef NEVERBLEED_SHM_RING
+
+/**
+ * creates the rings and the eventfds, and sends them to the daemon. Returns -1 if the kernel does not provide the necessary
+ * facilities, in which case the connection continues to use the socket only.
+ */
+static int conn_setup_shm(struct st_neverbleed_conn_t *conn)
+{
+    int fds[3] = {-1, -1, -1};
+    char mode = 1, cbuf[CMSG_SPACE(sizeof(fds))] = {0};
+    struct iovec vec = {&mode, 1};
+    struct msghdr msg = {NULL};
+    struct cmsghdr *cmsg;
+    void *shm = MAP_FAILED;
     ssize_t r;
 
-    if ((thdata = pthread_getspecific(nb->thread_key)) != NULL) {
-        if (thdata->self_pid == self_pid)
-            return thdata;
-        /* we have been forked! */
-        close(thdata->fd);
-    } else {
-        if ((thdata = malloc(sizeof(*thdata))) == NULL)
-            dief("malloc failed");
+    if ((fds[0] = memfd_create("neverbleed", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1 ||
+        ftruncate(fds[0], sizeof(*conn->shm)) != 0 ||
+        fcntl(fds[0], F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0 ||
+        (shm = mmap(NULL, sizeof(*conn->shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED ||
+        (fds[1] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1 || (fds[2] = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1) {
+        if (shm != MAP_FAILED)
+            munmap(shm, sizeof(*conn->shm));
+        for (r = 0; r != 3; ++r)
+            if (fds[r] != -1)
+                close(fds[r]);
+        return -1;
+    }
+
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    while ((r = sendmsg(conn->fd, &msg, 0)) == -1 && errno == EINTR)
+        ;
+    if (r != 1)
+        dief("failed to send the transport mode");
+    close(fds[0]);
+
+    conn->shm = shm;
+    conn->sq_efd = fds[1];
+    conn->cq_efd = fds[2];
+    /* the daemon starts by sleeping on the eventfd */
+    conn->shm->sq.need_wakeup = 1;
+    return 0;
+}
+
+#endif
+
+/**
+ * returns a pre-connected channel to the daemon, requesting a batch of them from the daemon if none is left
+ */
+static int channel_take(struct st_neverbleed_daemon_t *d)
+{
+    unsigned char num = NEVERBLEED_CHANNEL_BATCH;
+    char cbuf[CMSG_SPACE(sizeof(d->channels.spares))];
+    struct iovec vec = {&num, 1};
+    struct msghdr msg = {NULL};
+    struct cmsghdr *cmsg;
+    ssize_t r;
+    int fd;
+
+    pthread_mutex_lock(&d->channels.lock);
+
+    if (d->channels.num_spares == 0) {
+        while ((r = send(d->channels.control_fd, &num, 1, 0)) == -1 && errno == EINTR)
+            ;
+        if (r != 1)
+            dief("failed to request channels from privsep daemon");
+        /* each request is answered by exactly one datagram, regardless of which process (or thread) reads it */
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+#ifdef MSG_CMSG_CLOEXEC
+        while ((r = recvmsg(d->channels.control_fd, &msg, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR)
+            ;
+#else
+        while ((r = recvmsg(d->channels.control_fd, &msg, 0)) == -1 && errno == EINTR)
+            ;
+#endif
+        if (r != 1 || (msg.msg_flags & MSG_CTRUNC) != 0 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET ||
+            cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len <= CMSG_LEN(0)) {
+            errno = 0;
+            dief("failed to receive channels from privsep daemon");
+        }
+        d->channels.num_spares = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        memcpy(d->channels.spares, CMSG_DATA(cmsg), d->channels.num_spares * sizeof(int));
+#ifndef MSG_CMSG_CLOEXEC
+        for (size_t i = 0; i != d->channels.num_spares; ++i)
+            set_cloexec(d->channels.spares[i]);
+#endif
     }
+    fd = d->channels.spares[--d->channels.num_spares];
+
+    pthread_mutex_unlock(&d->channels.lock);
+
+    return fd;
+}
+
+/**
+ * connects to the daemon. If `use_shm` is non-zero, the messages are exchanged through the rings in shared memory when possible.
+ */
+static void conn_open(neverbleed_t *nb, size_t daemon, struct st_neverbleed_conn_t *conn, int use_shm)
+{
+    struct sockaddr_un *sun_ = &nb->daemons[daemon].sun_;
+    char mode = 0;
+    ssize_t r;
 
-    thdata->self_pid = self_pid;
+    if (nb->daemons[daemon].channels.control_fd != -1) {
+        conn->fd = channel_take(&nb->daemons[daemon]);
+    } else {
 #ifdef SOCK_CLOEXEC
-    if ((thdata->fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
-        dief("socket(2) failed");
+        if ((conn->fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
+            dief("socket(2) failed");
 #else
-    if ((thdata->fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1)
-        dief("socket(2) failed");
-    set_cloexec(thdata->fd);
-#endif
-    while (connect(thdata->fd, (void *)&nb->sun_, sizeof(nb->sun_)) != 0)
-        if (errno != EINTR)
-            dief("failed to connect to privsep daemon");
-    while ((r = write(thdata->fd, nb->auth_token, sizeof(nb->auth_token))) == -1 && errno == EINTR)
+        if ((conn->fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1)
+            dief("socket(2) failed");
+        set_cloexec(conn->fd);
+#endif
+        while (connect(conn->fd, (void *)sun_, sizeof(*sun_)) != 0)
+            if (errno != EINTR)
+                dief("failed to connect to privsep daemon");
+    }
+    conn->num_inflight = &nb->daemons[daemon].num_inflight;
+    while ((r = write(conn->fd, nb->auth_token, sizeof(nb->auth_token))) == -1 && errno == EINTR)
         ;
     if (r != sizeof(nb->auth_token))
         dief("failed to send authentication token");
-    pthread_setspecific(nb->thread_key, thdata);
 
-    return thdata;
+    /* the byte following the token indicates if the rings are being used */
+#ifdef NEVERBLEED_SHM_RING
+    if (use_shm && conn_setup_shm(conn) == 0)
+        return;
+#endif
+    while ((r = write(conn->fd, &mode, 1)) == -1 && errno == EINTR)
+        ;
+    if (r != 1)
+        dief("failed to send the transport mode");
 }
 
-static void get_privsep_data(const RSA *rsa, struct st_neverbleed_rsa_exdata_t **exdata,
-                             struct st_neverbleed_thread_data_t **thdata)
+static void conn_close(struct st_neverbleed_conn_t *conn)
 {
-    *exdata = RSA_get_ex_data(rsa, 0);
-    if (*exdata == NULL) {
-        errno = 0;
-        dief("invalid internal ref");
+    neverbleed_req_t *req;
+
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
     }
-    *thdata = get_thread_data((*exdata)->nb);
+#ifdef NEVERBLEED_SHM_RING
+    if (conn->shm != NULL) {
+        munmap(conn->shm, sizeof(*conn->shm));
+        conn->shm = NULL;
+        close(conn->sq_efd);
+        close(conn->cq_efd);
+        conn->sq_efd = -1;
+        conn->cq_efd = -1;
+    }
+#endif
+    /* blocking requests are never left pending, so the ones remaining here are all owned by the connection */
+    while ((req = conn->pending.first) != NULL) {
+        conn->pending.first = req->next;
+        __atomic_sub_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+        req_dispose(req);
+    }
+    conn->pending.tail = &conn->pending.first;
+    expbuf_dispose(&conn->rbuf);
 }
 
-static const size_t default_reserved_size = 8192;
-
-struct key_slots {
-    size_t size;
-    size_t reserved_size;
-    /* bit array slots:
-     *   1-bit slot available
-     *   0-bit slot unavailable
-     */
-    uint8_t *bita_avail;
-};
-
-static struct {
-    struct {
-        pthread_mutex_t lock;
-        RSA **keys;
-        struct key_slots rsa_slots;
-        EC_KEY **ecdsa_keys;
-        struct key_slots ecdsa_slots;
-    } keys;
-    neverbleed_t *nb;
-} daemon_vars = {{PTHREAD_MUTEX_INITIALIZER}};
-
-static RSA *daemon_get_rsa(size_t key_index)
+static void init_thread_data(struct st_neverbleed_thread_data_t *thdata, neverbleed_t *nb)
 {
-    RSA *rsa;
-
-    pthread_mutex_lock(&daemon_vars.keys.lock);
-    rsa = daemon_vars.keys.keys[key_index];
-    if (rsa)
-        RSA_up_ref(rsa);
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    static size_t num_threads;
+    size_t thread_index = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED), i;
+
+    thdata->nb = nb;
+    thdata->home_daemon = thread_index % nb->num_daemons;
+    thdata->shared_conn_index = thread_index / nb->num_daemons;
+    thdata->completed.first = NULL;
+    thdata->completed.tail = &thdata->completed.first;
+    memset(&thdata->buf, 0, sizeof(thdata->buf));
+    for (i = 0; i != nb->num_daemons; ++i) {
+        conn_init(&thdata->daemons[i].conn);
+        conn_init(&thdata->daemons[i].async_conn);
+        thdata->daemons[i].idle_job_conns = NULL;
+    }
+}
 
-    return rsa;
+static void clear_thread_data(struct st_neverbleed_thread_data_t *thdata)
+{
+    struct st_neverbleed_conn_t *conn;
+    neverbleed_req_t *req;
+    size_t i;
+
+    for (i = 0; i != thdata->nb->num_daemons; ++i) {
+        conn_close(&thdata->daemons[i].conn);
+        conn_close(&thdata->daemons[i].async_conn);
+        while ((conn = thdata->daemons[i].idle_job_conns) != NULL) {
+            thdata->daemons[i].idle_job_conns = conn->next;
+            conn_close(conn);
+            free(conn);
+        }
+    }
+    while ((req = thdata->completed.first) != NULL) {
+        thdata->completed.first = req->next;
+        req_dispose(req);
+    }
+    thdata->completed.tail = &thdata->completed.first;
+    expbuf_dispose(&thdata->buf);
 }
 
-/*
- *  Returns an available slot in bit array B
- *  or if not found, returns SIZE_MAX
+/**
+ * invoked in the child process before the data of the thread is set up again. The operations started by `neverbleed_start_*` are
+ * detached from the connections and left to the application, which releases them by passing them to `neverbleed_finish_*` or
+ * `neverbleed_cancel` (see `discard_stale_request`).
  */
-static size_t bita_ffirst(const uint8_t *b, const size_t tot, size_t bits)
+static void detach_requests(struct st_neverbleed_thread_data_t *thdata)
 {
-    if (bits >= tot)
-        return SIZE_MAX;
-
-    uint64_t w = *((uint64_t *) b);
-    /* __builtin_ffsll returns one plus the index of the least significant 1-bit, or zero if not found */
-    uint32_t r = __builtin_ffsll(w);
-    if (r)
-        return bits + r - 1; /* adjust result */
+    struct st_neverbleed_conn_t *conn;
+    neverbleed_req_t *req;
+    size_t i;
+
+    for (i = 0; i != thdata->nb->num_daemons; ++i) {
+        conn = &thdata->daemons[i].async_conn;
+        for (req = conn->pending.first; req != NULL; req = req->next)
+            __atomic_sub_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+        conn->pending.first = NULL;
+        conn->pending.tail = &conn->pending.first;
+    }
+    thdata->completed.first = NULL;
+    thdata->completed.tail = &thdata->completed.first;
+}
 
-    return bita_ffirst(&b[8], tot, bits + 64);
+/**
+ * moves the buffer retained by the thread to `buf`. The buffer being empty while it is in use (e.g., by an ASYNC job that has been
+ * paused), `buf` might be given no memory.
+ */
+static void thread_data_take_buf(struct st_neverbleed_thread_data_t *thdata, struct expbuf_t *buf)
+{
+    *buf = thdata->buf;
+    memset(&thdata->buf, 0, sizeof(thdata->buf));
 }
 
-/*
- * bit operation helpers for the bit-array in key_slots
- */
-#define BITMASK(b) (1 << ((b) % CHAR_BIT))
-#define BITBYTE(b) ((b) / CHAR_BIT)
-#define BITSET(a, b) ((a)[BITBYTE(b)] |= BITMASK(b))
-#define BITUNSET(a, b) ((a)[BITBYTE(b)] &= ~BITMASK(b))
-#define BITBYTES(nb) ((nb + CHAR_BIT - 1) / CHAR_BIT)
-#define BITCHECK(a, b) ((a)[BITBYTE(b)] & BITMASK(b))
-
-static void adjust_slots_reserved_size(int type, struct key_slots *slots)
-{
-#define ROUND2WORD(n) (n + 64 - 1 - (n + 64 - 1) % 64)
-    if (!slots->reserved_size || (slots->size >= slots->reserved_size)) {
-        size_t size = slots->reserved_size ? ROUND2WORD((size_t)(slots->reserved_size * 0.50) + slots->reserved_size)
-                : default_reserved_size;
-#undef ROUND2WORD
-
-        switch (type) {
-        case NEVERBLEED_TYPE_RSA:
-            if ((daemon_vars.keys.keys = realloc(daemon_vars.keys.keys, sizeof(*daemon_vars.keys.keys) * size)) == NULL)
-                dief("no memory");
-            break;
-        case NEVERBLEED_TYPE_ECDSA:
-            if ((daemon_vars.keys.ecdsa_keys = realloc(daemon_vars.keys.ecdsa_keys, sizeof(*daemon_vars.keys.ecdsa_keys) * size)) == NULL)
-                dief("no memory");
-            break;
-        default:
-            dief("invalid type adjusting reserved");
-        }
+/**
+ * clears `buf` and retains it for later use, unless the thread already retains one or the buffer has grown large
+ */
+static void thread_data_release_buf(struct st_neverbleed_thread_data_t *thdata, struct expbuf_t *buf)
+{
+    if (thdata->buf.capacity == 0 && buf->capacity <= NEVERBLEED_RETAINED_BUF_MAX_SIZE) {
+        expbuf_clear(buf);
+        thdata->buf = *buf;
+        memset(buf, 0, sizeof(*buf));
+    } else {
+        expbuf_dispose(buf);
+    }
+}
 
-        uint8_t *b;
-        if ((b = realloc(slots->bita_avail, BITBYTES(size))) == NULL)
-            dief("no memory");
+void dispose_thread_data(void *_thdata)
+{
+    struct st_neverbleed_thread_data_t *thdata = _thdata;
 
-        /* set all bits to 1 making all slots available */
-        memset(&b[BITBYTES(slots->reserved_size)], 0xff, BITBYTES(size - slots->reserved_size));
+    pthread_mutex_lock(&client_vars.lock);
+    if ((*thdata->prev = thdata->next) != NULL)
+        thdata->next->prev = thdata->prev;
+    pthread_mutex_unlock(&client_vars.lock);
 
-        slots->bita_avail = b;
-        slots->reserved_size = size;
-    }
+    clear_thread_data(thdata);
+    free(thdata);
 }
 
-static size_t daemon_set_rsa(RSA *rsa)
+struct st_neverbleed_thread_data_t *get_thread_data(neverbleed_t *nb)
 {
-    pthread_mutex_lock(&daemon_vars.keys.lock);
+    struct st_neverbleed_thread_data_t *thdata;
 
-    adjust_slots_reserved_size(NEVERBLEED_TYPE_RSA, &daemon_vars.keys.rsa_slots);
+    if ((thdata = pthread_getspecific(nb->thread_key)) != NULL) {
+        if (thdata->fork_generation == client_vars.fork_generation)
+            return thdata;
+        /* we have been forked! */
+        detach_requests(thdata);
+        clear_thread_data(thdata);
+    } else {
+        size_t size = offsetof(struct st_neverbleed_thread_data_t, daemons) + sizeof(thdata->daemons[0]) * nb->num_daemons;
+        if ((thdata = malloc(size)) == NULL)
+            dief("malloc failed");
+        init_thread_data(thdata, nb);
+        pthread_mutex_lock(&client_vars.lock);
+        if ((thdata->next = client_vars.threads) != NULL)
+            thdata->next->prev = &thdata->next;
+        thdata->prev = &client_vars.threads;
+        client_vars.threads = thdata;
+        pthread_mutex_unlock(&client_vars.lock);
+        pthread_setspecific(nb->thread_key, thdata);
+    }
 
-    size_t index = bita_ffirst(daemon_vars.keys.rsa_slots.bita_avail, daemon_vars.keys.rsa_slots.reserved_size, 0);
+    thdata->fork_generation = client_vars.fork_generation;
 
-    if (index == SIZE_MAX)
-        dief("no available slot for key");
+    return thdata;
+}
 
-    /* set slot as unavailable */
-    BITUNSET(daemon_vars.keys.rsa_slots.bita_avail, index);
+/**
+ * closes the descriptors of a connection inherited from the parent process, leaving the rest to `conn_close`
+ */
+static void conn_close_inherited(struct st_neverbleed_conn_t *conn)
+{
+    if (conn->fd != -1) {
+        close(conn->fd);
+        conn->fd = -1;
+    }
+#ifdef NEVERBLEED_SHM_RING
+    if (conn->shm != NULL) {
+        close(conn->sq_efd);
+        close(conn->cq_efd);
+        conn->sq_efd = -1;
+        conn->cq_efd = -1;
+    }
+#endif
+}
 
-    daemon_vars.keys.rsa_slots.size++;
-    daemon_vars.keys.keys[index] = rsa;
-    RSA_up_ref(rsa);
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
+static void client_on_fork_prepare(void)
+{
+    pthread_mutex_lock(&client_vars.lock);
+}
 
-    return index;
+static void client_on_fork_parent(void)
+{
+    pthread_mutex_unlock(&client_vars.lock);
 }
 
-static int priv_encdec_proxy(const char *cmd, int flen, const unsigned char *from, unsigned char *_to, RSA *rsa, int padding)
+/**
+ * invoked in the child process. The connections inherited from the parent are closed right away, as the child must not read the
+ * responses destined to the parent. The threads that have forked notice the change of the generation and set up their data again,
+ * whereas the data of the other threads (which do not exist in the child) is left as is. The shared connections are reset
+ * including their locks, which might have been held by the threads of the parent.
+ */
+static void client_on_fork_child(void)
 {
-    struct st_neverbleed_rsa_exdata_t *exdata;
     struct st_neverbleed_thread_data_t *thdata;
-    struct expbuf_t buf = {NULL};
-    size_t ret;
-    unsigned char *to;
-    size_t tolen;
+    struct st_neverbleed_conn_t *conn;
+    size_t i, daemon, j;
 
-    get_privsep_data(rsa, &exdata, &thdata);
+    ++client_vars.fork_generation;
 
-    expbuf_push_str(&buf, cmd);
-    expbuf_push_bytes(&buf, from, flen);
-    expbuf_push_num(&buf, exdata->key_index);
-    expbuf_push_num(&buf, padding);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+    for (thdata = client_vars.threads; thdata != NULL; thdata = thdata->next) {
+        for (daemon = 0; daemon != thdata->nb->num_daemons; ++daemon) {
+            conn_close_inherited(&thdata->daemons[daemon].conn);
+            conn_close_inherited(&thdata->daemons[daemon].async_conn);
+            for (conn = thdata->daemons[daemon].idle_job_conns; conn != NULL; conn = conn->next)
+                conn_close_inherited(conn);
+        }
+    }
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0 || (to = expbuf_shift_bytes(&buf, &tolen)) == NULL) {
-        errno = 0;
-        dief("failed to parse response");
+    for (i = 0; i != client_vars.num_instances; ++i) {
+        neverbleed_t *nb = client_vars.instances[i];
+        for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+            for (j = 0; j != nb->daemons[daemon].num_shared_conns; ++j) {
+                struct st_neverbleed_shared_conn_t *shared = &nb->daemons[daemon].shared_conns[j];
+                conn_close_inherited(&shared->conn);
+                /* the requests and the receive buffer belong to the threads of the parent */
+                conn_init(&shared->conn);
+                pthread_mutex_init(&shared->mutex, NULL);
+                pthread_mutex_init(&shared->write_mutex, NULL);
+                pthread_cond_init(&shared->cond, NULL);
+                shared->reading = 0;
+            }
+            /* the spare channels are the parent's; the child requests channels of its own */
+            pthread_mutex_init(&nb->daemons[daemon].channels.lock, NULL);
+            while (nb->daemons[daemon].channels.num_spares != 0)
+                close(nb->daemons[daemon].channels.spares[--nb->daemons[daemon].channels.num_spares]);
+        }
     }
-    memcpy(_to, to, tolen);
-    expbuf_dispose(&buf);
 
-    return (int)ret;
+    pthread_mutex_unlock(&client_vars.lock);
 }
 
-static int priv_encdec_stub(const char *name,
-                            int (*func)(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding),
-                            struct expbuf_t *buf)
+static void client_register_fork_handlers(void)
 {
-    unsigned char *from, to[4096];
-    size_t flen;
-    size_t key_index, padding;
-    RSA *rsa;
-    int ret;
+    pthread_atfork(client_on_fork_prepare, client_on_fork_parent, client_on_fork_child);
+}
+
+/**
+ * hands a response to the pending request identified by `id`
+ */
+static void conn_dispatch_response(struct st_neverbleed_conn_t *conn, size_t id, const unsigned char *bytes, size_t sz)
+{
+    neverbleed_req_t *req, **ref;
 
-    if ((from = expbuf_shift_bytes(buf, &flen)) == NULL || expbuf_shift_num(buf, &key_index) != 0 ||
-        expbuf_shift_num(buf, &padding) != 0) {
+    /* lookup the request; usually the first one, as most of the requests are processed in order */
+    for (ref = &conn->pending.first; *ref != NULL && (*ref)->id != id; ref = &(*ref)->next)
+        ;
+    if ((req = *ref) == NULL) {
         errno = 0;
-        warnf("%s: failed to parse request", name);
-        return -1;
+        dief("unexpected response from daemon");
     }
-    if ((rsa = daemon_get_rsa(key_index)) == NULL) {
-        errno = 0;
-        warnf("%s: invalid key index:%zu\n", name, key_index);
-        return -1;
+    if ((*ref = req->next) == NULL)
+        conn->pending.tail = ref;
+    __atomic_sub_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+    if (req->cancelled) {
+        req_dispose(req);
+    } else {
+        expbuf_reserve(&req->buf, sz);
+        memcpy(req->buf.end, bytes, sz);
+        req->buf.end += sz;
+        req->completed = 1;
+        if (req->kind != NEVERBLEED_REQ_BLOCKING) {
+            req->next = NULL;
+            *req->thdata->completed.tail = req;
+            req->thdata->completed.tail = &req->next;
+        }
     }
-    ret = func((int)flen, from, to, rsa, (int)padding);
-    expbuf_dispose(buf);
-    RSA_free(rsa);
+}
 
-    expbuf_push_num(buf, ret);
-    expbuf_push_bytes(buf, to, ret > 0 ? ret : 0);
+/**
+ * hands the complete responses found in the receive buffer to the pending requests
+ */
+static void conn_dispatch(struct st_neverbleed_conn_t *conn)
+{
+    struct expbuf_t *rbuf = &conn->rbuf;
+    size_t sz, id, remaining;
 
-    return 0;
+    while (expbuf_size(rbuf) >= sizeof(sz)) {
+        memcpy(&sz, rbuf->start, sizeof(sz));
+        if (expbuf_size(rbuf) - sizeof(sz) < sz)
+            break;
+        rbuf->start += sizeof(sz);
+        if (sz < sizeof(id)) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        memcpy(&id, rbuf->start, sizeof(id));
+        rbuf->start += sizeof(id);
+        sz -= sizeof(id);
+        conn_dispatch_response(conn, id, (unsigned char *)rbuf->start, sz);
+        rbuf->start += sz;
+    }
+
+    /* move the partial response (if any) to the head of the buffer, clearing the bytes that have been consumed */
+    if (rbuf->start != rbuf->buf) {
+        remaining = expbuf_size(rbuf);
+        memmove(rbuf->buf, rbuf->start, remaining);
+        OPENSSL_cleanse(rbuf->buf + remaining, rbuf->end - rbuf->buf - remaining);
+        rbuf->start = rbuf->buf;
+        rbuf->end = rbuf->buf + remaining;
+    }
 }
 
-static int priv_enc_proxy(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+/**
+ * appends the bytes arriving from the daemon to the receive buffer, without dispatching the responses
+ */
+static int conn_recv(struct st_neverbleed_conn_t *conn, int blocking)
 {
-    return priv_encdec_proxy("priv_enc", flen, from, to, rsa, padding);
+    int flags = blocking ? 0 : MSG_DONTWAIT;
+    ssize_t r;
+
+    expbuf_reserve(&conn->rbuf, 4096);
+    while ((r = recv(conn->fd, conn->rbuf.end, conn->rbuf.buf + conn->rbuf.capacity - conn->rbuf.end, flags)) == -1 &&
+           errno == EINTR)
+        ;
+    if (r == -1 && !blocking && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r <= 0) {
+        if (r == 0)
+            errno = 0;
+        dief(errno != 0 ? "read error" : "connection closed by daemon");
+    }
+    conn->rbuf.end += r;
+
+    return 1;
 }
 
-static int priv_enc_stub(struct expbuf_t *buf)
+static int conn_read_socket(struct st_neverbleed_conn_t *conn, int blocking)
 {
-    return priv_encdec_stub(__FUNCTION__, RSA_private_encrypt, buf);
+    if (!conn_recv(conn, blocking))
+        return 0;
+    conn_dispatch(conn);
+    return 1;
 }
 
-static int priv_dec_proxy(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+#ifdef NEVERBLEED_SHM_RING
+
+/**
+ * dispatches the responses found in the completion ring; returns if any were found
+ */
+static int conn_drain_ring(struct st_neverbleed_conn_t *conn)
 {
-    return priv_encdec_proxy("priv_dec", flen, from, to, rsa, padding);
+    /* messages in the ring are small enough to be copied onto the stack, which `expbuf_reserve` never needs to grow */
+    char bytes[NEVERBLEED_RING_SLOT_SIZE];
+    struct expbuf_t buf = {bytes, bytes, bytes, sizeof(bytes)};
+    size_t id;
+    int r, found = 0;
+
+    while ((r = ring_shift(&conn->shm->cq, &buf)) > 0) {
+        if (expbuf_shift_num(&buf, &id) != 0) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        conn_dispatch_response(conn, id, (unsigned char *)buf.start, expbuf_size(&buf));
+        expbuf_clear(&buf);
+        found = 1;
+    }
+    if (r < 0) {
+        errno = 0;
+        dief("broken completion ring");
+    }
+
+    return found;
 }
 
-static int priv_dec_stub(struct expbuf_t *buf)
+/**
+ * reads the responses arriving through the ring and the socket. When blocking, the ring is polled for a short while before falling
+ * asleep, as the response of a private key operation usually arrives soon.
+ */
+static int conn_read_shm(struct st_neverbleed_conn_t *conn, int blocking)
 {
-    return priv_encdec_stub(__FUNCTION__, RSA_private_decrypt, buf);
+    struct pollfd pfds[2] = {{conn->cq_efd, POLLIN}, {conn->fd, POLLIN}};
+
+    /* reset the eventfd first, as the descriptor being polled by the application is the eventfd */
+    if (!blocking)
+        efd_clear(conn->cq_efd);
+
+    while (1) {
+        if (conn_drain_ring(conn) | conn_read_socket(conn, 0))
+            return 1;
+        if (!blocking)
+            return 0;
+        if (ring_spin(&conn->shm->cq))
+            continue;
+        if (ring_prepare_sleep(&conn->shm->cq) == 0) {
+            while (poll(pfds, 2, -1) == -1 && errno == EINTR)
+                ;
+            __atomic_store_n(&conn->shm->cq.need_wakeup, 0, __ATOMIC_RELAXED);
+        }
+        efd_clear(conn->cq_efd);
+    }
 }
 
-static int sign_proxy(int type, const unsigned char *m, unsigned int m_len, unsigned char *_sigret, unsigned *_siglen,
-                      const RSA *rsa)
+#endif
+
+/**
+ * reads and dispatches the responses sent by the daemon. If `blocking` is zero and nothing can be read, returns zero without
+ * waiting.
+ */
+static int conn_read(struct st_neverbleed_conn_t *conn, int blocking)
 {
-    struct st_neverbleed_rsa_exdata_t *exdata;
-    struct st_neverbleed_thread_data_t *thdata;
-    struct expbuf_t buf = {NULL};
-    size_t ret, siglen;
-    unsigned char *sigret;
+#ifdef NEVERBLEED_SHM_RING
+    if (conn->shm != NULL)
+        return conn_read_shm(conn, blocking);
+#endif
+    return conn_read_socket(conn, blocking);
+}
 
-    get_privsep_data(rsa, &exdata, &thdata);
+/**
+ * sends a request. If `dispatch_while_blocked` is set, the responses that arrive while the socket is not writable are dispatched,
+ * so that the daemon never gets blocked writing to us while we are blocked writing to it. Otherwise, some other thread must be
+ * reading the responses.
+ */
+static void conn_write(struct st_neverbleed_conn_t *conn, size_t id, struct expbuf_t *buf, int dispatch_while_blocked)
+{
+    size_t bufsz = sizeof(id) + expbuf_size(buf);
+    struct iovec vecs[3] = {{&bufsz, sizeof(bufsz)}, {&id, sizeof(id)}, {buf->start, expbuf_size(buf)}};
+    struct msghdr msg = {NULL};
+    struct pollfd pfd = {conn->fd, dispatch_while_blocked ? POLLIN | POLLOUT : POLLOUT};
+    ssize_t r;
 
-    expbuf_push_str(&buf, "sign");
-    expbuf_push_num(&buf, type);
-    expbuf_push_bytes(&buf, m, m_len);
-    expbuf_push_num(&buf, exdata->key_index);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+    msg.msg_iov = vecs;
+    msg.msg_iovlen = sizeof(vecs) / sizeof(vecs[0]);
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0 || (sigret = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
-        errno = 0;
-        dief("failed to parse response");
+    while (msg.msg_iovlen != 0) {
+        if ((r = sendmsg(conn->fd, &msg, MSG_DONTWAIT)) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (!(errno == EAGAIN || errno == EWOULDBLOCK))
+                dief("write error");
+            while (poll(&pfd, 1, -1) == -1 && errno == EINTR)
+                ;
+            if (dispatch_while_blocked && (pfd.revents & (POLLIN | POLLHUP)) != 0)
+                conn_read(conn, 0);
+            continue;
+        }
+        while (msg.msg_iovlen != 0 && r >= msg.msg_iov->iov_len) {
+            r -= msg.msg_iov->iov_len;
+            ++msg.msg_iov;
+            --msg.msg_iovlen;
+        }
+        if (r != 0) {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + r;
+            msg.msg_iov->iov_len -= r;
+        }
     }
-    memcpy(_sigret, sigret, siglen);
-    *_siglen = (unsigned)siglen;
-    expbuf_dispose(&buf);
-
-    return (int)ret;
 }
 
-static int sign_stub(struct expbuf_t *buf)
+/**
+ * sends the request stored in `buf`, registering `req` as the receiver of the response. The memory of `buf` is moved to `req` so
+ * that the response can be received without allocating memory.
+ */
+static void conn_submit(struct st_neverbleed_conn_t *conn, neverbleed_req_t *req, struct expbuf_t *buf)
 {
-    unsigned char *m, sigret[4096];
-    size_t type, m_len, key_index;
-    RSA *rsa;
-    unsigned siglen = 0;
-    int ret;
+    req->next = NULL;
+    req->id = conn->next_id++;
+    req->completed = 0;
+    req->cancelled = 0;
+    __atomic_add_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+
+#ifdef NEVERBLEED_SHM_RING
+    /* messages that do not fit in the ring are sent through the socket */
+    if (conn->shm != NULL && ring_push(&conn->shm->sq, req->id, buf) == 0) {
+        if (ring_need_wakeup(&conn->shm->sq))
+            efd_notify(conn->sq_efd);
+    } else
+#endif
+        conn_write(conn, req->id, buf, 1);
+    expbuf_clear(buf);
+    req->buf = *buf;
+    memset(buf, 0, sizeof(*buf));
+    *conn->pending.tail = req;
+    conn->pending.tail = &req->next;
+}
 
-    if (expbuf_shift_num(buf, &type) != 0 || (m = expbuf_shift_bytes(buf, &m_len)) == NULL ||
-        expbuf_shift_num(buf, &key_index) != 0) {
-        errno = 0;
-        warnf("%s: failed to parse request", __FUNCTION__);
-        return -1;
+/**
+ * sends the request stored in `buf` through one of the shared connections of the daemon and waits for the response, which is
+ * stored in `buf`
+ */
+static void shared_conn_transaction(struct st_neverbleed_thread_data_t *thdata, size_t daemon, struct expbuf_t *buf)
+{
+    struct st_neverbleed_daemon_t *d = &thdata->nb->daemons[daemon];
+    struct st_neverbleed_shared_conn_t *shared = &d->shared_conns[thdata->shared_conn_index % d->num_shared_conns];
+    struct st_neverbleed_conn_t *conn = &shared->conn;
+    neverbleed_req_t req;
+
+    pthread_mutex_lock(&shared->mutex);
+
+    if (conn->fd == -1)
+        conn_open(thdata->nb, daemon, conn, 0);
+
+    /* register the request before sending it, as the response might be dispatched by the reader as soon as it is sent */
+    req.next = NULL;
+    req.id = conn->next_id++;
+    req.thdata = thdata;
+    req.kind = NEVERBLEED_REQ_BLOCKING;
+    req.completed = 0;
+    req.cancelled = 0;
+    memset(&req.buf, 0, sizeof(req.buf));
+    __atomic_add_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+    *conn->pending.tail = &req;
+    conn->pending.tail = &req.next;
+    pthread_mutex_unlock(&shared->mutex);
+
+    pthread_mutex_lock(&shared->write_mutex);
+    conn_write(conn, req.id, buf, 0);
+    pthread_mutex_unlock(&shared->write_mutex);
+    expbuf_clear(buf);
+
+    pthread_mutex_lock(&shared->mutex);
+    if (!req.completed) {
+        req.buf = *buf;
+        memset(buf, 0, sizeof(*buf));
     }
-    if ((rsa = daemon_get_rsa(key_index)) == NULL) {
-        errno = 0;
-        warnf("%s: invalid key index:%zu", __FUNCTION__, key_index);
-        return -1;
+    while (!req.completed) {
+        if (shared->reading) {
+            pthread_cond_wait(&shared->cond, &shared->mutex);
+            continue;
+        }
+        shared->reading = 1;
+        pthread_mutex_unlock(&shared->mutex);
+        conn_recv(conn, 1);
+        pthread_mutex_lock(&shared->mutex);
+        conn_dispatch(conn);
+        shared->reading = 0;
+        pthread_cond_broadcast(&shared->cond);
     }
-    ret = RSA_sign((int)type, m, (unsigned)m_len, sigret, &siglen, rsa);
-    expbuf_dispose(buf);
-    RSA_free(rsa);
-
-    expbuf_push_num(buf, ret);
-    expbuf_push_bytes(buf, sigret, ret == 1 ? siglen : 0);
+    pthread_mutex_unlock(&shared->mutex);
 
-    return 0;
+    expbuf_dispose(buf);
+    *buf = req.buf;
 }
 
-static EVP_PKEY *create_pkey(neverbleed_t *nb, size_t key_index, const char *ebuf, const char *nbuf)
+/**
+ * sends the request stored in `buf` to the daemon and waits for the response, which is stored in `buf`
+ */
+static void neverbleed_transaction(struct st_neverbleed_thread_data_t *thdata, size_t daemon, struct expbuf_t *buf)
 {
-    struct st_neverbleed_rsa_exdata_t *exdata;
-    RSA *rsa;
-    EVP_PKEY *pkey;
-    BIGNUM *e = NULL, *n = NULL;
+    struct st_neverbleed_conn_t *conn = &thdata->daemons[daemon].conn;
+    neverbleed_req_t req;
 
-    if ((exdata = malloc(sizeof(*exdata))) == NULL) {
-        fprintf(stderr, "no memory\n");
-        abort();
+    if (thdata->nb->daemons[daemon].shared_conns != NULL) {
+        shared_conn_transaction(thdata, daemon, buf);
+        return;
     }
-    exdata->nb = nb;
-    exdata->key_index = key_index;
 
-    rsa = RSA_new_method(nb->engine);
-    RSA_set_ex_data(rsa, 0, exdata);
-    if (BN_hex2bn(&e, ebuf) == 0) {
-        fprintf(stderr, "failed to parse e:%s\n", ebuf);
-        abort();
-    }
-    if (BN_hex2bn(&n, nbuf) == 0) {
-        fprintf(stderr, "failed to parse n:%s\n", nbuf);
-        abort();
-    }
-    RSA_set0_key(rsa, n, e, NULL);
-    RSA_set_flags(rsa, RSA_FLAG_EXT_PKEY);
+    if (conn->fd == -1)
+        conn_open(thdata->nb, daemon, conn, neverbleed_use_shm_ring);
 
-    pkey = EVP_PKEY_new();
-    EVP_PKEY_set1_RSA(pkey, rsa);
-    RSA_free(rsa);
+    req.thdata = thdata;
+    req.kind = NEVERBLEED_REQ_BLOCKING;
+    conn_submit(conn, &req, buf);
 
-    return pkey;
+    while (!req.completed)
+        conn_read(conn, 1);
+    *buf = req.buf;
 }
 
-#ifdef NEVERBLEED_ECDSA
+#ifdef NEVERBLEED_ASYNC
 
-static EC_KEY *daemon_get_ecdsa(size_t key_index)
+/**
+ * invoked when the ASYNC_WAIT_CTX is freed while the job is paused in `keyop_transaction`, in which case the job is never going to
+ * be resumed. The connection is closed, except that the request pending on it is not disposed, as it is on the stack of the job.
+ */
+static void job_conn_cleanup(ASYNC_WAIT_CTX *waitctx, const void *key, OSSL_ASYNC_FD fd, void *_conn)
 {
-    EC_KEY *ec_key;
-
-    pthread_mutex_lock(&daemon_vars.keys.lock);
-    ec_key = daemon_vars.keys.ecdsa_keys[key_index];
-    if (ec_key)
-        EC_KEY_up_ref(ec_key);
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
-
-    return ec_key;
+    struct st_neverbleed_conn_t *conn = _conn;
+
+    assert(conn->pending.first != NULL && conn->pending.first->next == NULL);
+    __atomic_sub_fetch(conn->num_inflight, 1, __ATOMIC_RELAXED);
+    conn->pending.first = NULL;
+    conn->pending.tail = &conn->pending.first;
+    conn_close(conn);
+    free(conn);
 }
 
-static size_t daemon_set_ecdsa(EC_KEY *ec_key)
-{
-    pthread_mutex_lock(&daemon_vars.keys.lock);
-
-    adjust_slots_reserved_size(NEVERBLEED_TYPE_ECDSA, &daemon_vars.keys.ecdsa_slots);
+#endif
 
-    size_t index = bita_ffirst(daemon_vars.keys.ecdsa_slots.bita_avail, daemon_vars.keys.ecdsa_slots.reserved_size, 0);
+/**
+ * sends the request of a private key operation stored in `buf`, and waits for the response, which is stored in `buf`. When called
+ * from an ASYNC_JOB, the request is sent using a connection dedicated to the job, and the job is paused until the response arrives,
+ * with the connection being exposed as the wait fd. The job must be resumed by the thread that started it.
+ */
+static void keyop_transaction(struct st_neverbleed_thread_data_t *thdata, size_t daemon, struct expbuf_t *buf)
+{
+#ifdef NEVERBLEED_ASYNC
+    static const char wait_key; /* the address identifies our wait fd within ASYNC_WAIT_CTX */
+    ASYNC_JOB *job;
+    ASYNC_WAIT_CTX *waitctx;
+    struct st_neverbleed_conn_t *conn;
+    neverbleed_req_t req;
+
+    if ((job = ASYNC_get_current_job()) == NULL || (waitctx = ASYNC_get_wait_ctx(job)) == NULL) {
+        neverbleed_transaction(thdata, daemon, buf);
+        return;
+    }
 
-    if (index == SIZE_MAX)
-        dief("no available slot for key");
+    if ((conn = thdata->daemons[daemon].idle_job_conns) != NULL) {
+        thdata->daemons[daemon].idle_job_conns = conn->next;
+    } else {
+        if ((conn = malloc(sizeof(*conn))) == NULL)
+            dief("no memory");
+        conn_init(conn);
+        conn_open(thdata->nb, daemon, conn, 0);
+    }
 
-    /* set slot as unavailable */
-    BITUNSET(daemon_vars.keys.ecdsa_slots.bita_avail, index);
+    req.thdata = thdata;
+    req.kind = NEVERBLEED_REQ_BLOCKING;
+    conn_submit(conn, &req, buf);
 
-    daemon_vars.keys.ecdsa_slots.size++;
-    daemon_vars.keys.ecdsa_keys[index] = ec_key;
-    EC_KEY_up_ref(ec_key);
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    /* the connection is released by `job_conn_cleanup` if the job is never resumed; once cleared, the callback is not invoked */
+    if (!ASYNC_WAIT_CTX_set_wait_fd(waitctx, &wait_key, conn->fd, conn, job_conn_cleanup))
+        dief("ASYNC_WAIT_CTX_set_wait_fd failed");
+    while (!req.completed) {
+        if (ASYNC_pause_job()) {
+            conn_read(conn, 0);
+        } else {
+            conn_read(conn, 1);
+        }
+    }
+    ASYNC_WAIT_CTX_clear_fd(waitctx, &wait_key);
 
-    return index;
+    conn->next = thdata->daemons[daemon].idle_job_conns;
+    thdata->daemons[daemon].idle_job_conns = conn;
+    *buf = req.buf;
+#else
+    neverbleed_transaction(thdata, daemon, buf);
+#endif
 }
 
-static int ecdsa_sign_stub(struct expbuf_t *buf)
+/**
+ * returns the daemon to which an operation using the key is to be sent, storing the index of the key within the daemon to
+ * `key_index`. Among the daemons holding replicas of the key, the one with the fewest requests in flight is chosen.
+ */
+static size_t select_daemon(struct st_neverbleed_thread_data_t *thdata, struct st_neverbleed_rsa_exdata_t *exdata,
+                            size_t *key_index)
 {
-    unsigned char *m, sigret[4096];
-    size_t type, m_len, key_index;
+    size_t num_daemons = exdata->nb->num_daemons, best = SIZE_MAX, best_index = SIZE_MAX, best_inflight = SIZE_MAX, i;
+
+    /* the indices are loaded atomically, as they might be updated by `neverbleed_replace_private_key` */
+    if (exdata->replica_indices == NULL) {
+        *key_index = __atomic_load_n(&exdata->key_index, __ATOMIC_RELAXED);
+        return exdata->daemon;
+    }
+
+    for (i = 0; i != num_daemons; ++i) {
+        size_t daemon = (thdata->home_daemon + i) % num_daemons, index, inflight;
+        if ((index = __atomic_load_n(exdata->replica_indices + daemon, __ATOMIC_RELAXED)) == SIZE_MAX)
+            continue;
+        if ((inflight = __atomic_load_n(&exdata->nb->daemons[daemon].num_inflight, __ATOMIC_RELAXED)) < best_inflight) {
+            best = daemon;
+            best_index = index;
+            best_inflight = inflight;
+        }
+    }
+    assert(best != SIZE_MAX);
+    *key_index = best_index;
+    return best;
+}
+
+/**
+ * returns the daemon to load a key into, that is the one holding the fewest keys
+ */
+static size_t select_daemon_for_load(neverbleed_t *nb)
+{
+    size_t best = 0, i;
+
+    for (i = 1; i != nb->num_daemons; ++i)
+        if (__atomic_load_n(&nb->daemons[i].num_keys, __ATOMIC_RELAXED) <
+            __atomic_load_n(&nb->daemons[best].num_keys, __ATOMIC_RELAXED))
+            best = i;
+    return best;
+}
+
+/**
+ * records that the key is also held by `daemon`, converting `exdata` to refer to the replicas of the key
+ */
+static void add_replica(struct st_neverbleed_rsa_exdata_t *exdata, size_t daemon, size_t key_index)
+{
+    size_t i;
+
+    if (exdata->replica_indices == NULL) {
+        if ((exdata->replica_indices = malloc(sizeof(exdata->replica_indices[0]) * exdata->nb->num_daemons)) == NULL)
+            dief("no memory");
+        for (i = 0; i != exdata->nb->num_daemons; ++i)
+            exdata->replica_indices[i] = SIZE_MAX;
+        exdata->replica_indices[exdata->daemon] = exdata->key_index;
+        __atomic_sub_fetch(&exdata->nb->daemons[exdata->daemon].num_keys, 1, __ATOMIC_RELAXED);
+        exdata->daemon = SIZE_MAX;
+        exdata->key_index = SIZE_MAX;
+    }
+    exdata->replica_indices[daemon] = key_index;
+}
+
+static struct st_neverbleed_rsa_exdata_t *new_exdata(neverbleed_t *nb, size_t daemon, size_t key_index)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+
+    if ((exdata = malloc(sizeof(*exdata))) == NULL)
+        dief("no memory");
+    exdata->nb = nb;
+    exdata->daemon = daemon;
+    exdata->key_index = key_index;
+    exdata->replica_indices = NULL;
+    __atomic_add_fetch(&nb->daemons[daemon].num_keys, 1, __ATOMIC_RELAXED);
+
+    return exdata;
+}
+
+/**
+ * removes the key from the daemons holding it, using the operation `del_op`, and frees `exdata`. Returns 1 if successful.
+ */
+static int release_exdata(struct st_neverbleed_thread_data_t *thdata, struct st_neverbleed_rsa_exdata_t *exdata,
+                          enum neverbleed_opcode del_op)
+{
+    size_t daemon, ret;
+    int ok = 1;
+
+    for (daemon = 0; daemon != exdata->nb->num_daemons; ++daemon) {
+        size_t key_index = exdata->replica_indices != NULL ? exdata->replica_indices[daemon]
+                                                           : daemon == exdata->daemon ? exdata->key_index : SIZE_MAX;
+        struct expbuf_t buf = {NULL};
+        if (key_index == SIZE_MAX)
+            continue;
+        expbuf_push_cmd(&buf, del_op, key_index, 0, NULL, 0);
+        neverbleed_transaction(thdata, daemon, &buf);
+        if (expbuf_shift_num(&buf, &ret) != 0) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        expbuf_dispose(&buf);
+        if (ret != 1)
+            ok = 0;
+    }
+
+    if (exdata->replica_indices == NULL)
+        __atomic_sub_fetch(&exdata->nb->daemons[exdata->daemon].num_keys, 1, __ATOMIC_RELAXED);
+    free(exdata->replica_indices);
+    free(exdata);
+
+    return ok;
+}
+
+static void get_privsep_data(const RSA *rsa, struct st_neverbleed_rsa_exdata_t **exdata,
+                             struct st_neverbleed_thread_data_t **thdata)
+{
+    *exdata = RSA_get_ex_data(rsa, 0);
+    if (*exdata == NULL) {
+        errno = 0;
+        dief("invalid internal ref");
+    }
+    *thdata = get_thread_data((*exdata)->nb);
+}
+
+/**
+ * number of slots in each chunk of the key table (must be a multiple of 64)
+ */
+#define NEVERBLEED_KEY_CHUNK_SIZE 1024
+
+static const size_t default_reserved_size = 8192;
+
+struct key_slots {
+    /**
+     * number of slots in use
+     */
+    size_t size;
+    /**
+     * number of slots, a multiple of NEVERBLEED_KEY_CHUNK_SIZE
+     */
+    size_t reserved_size;
+    /**
+     * bit array of the slots; a 1-bit indicates that the slot is available
+     */
+    uint64_t *avail;
+    /**
+     * bit array of the words of `avail`; a 1-bit indicates that the word contains an available slot. Together with `summary_hint`,
+     * the first available slot is found by looking at a few words even when there are tens of thousands of keys.
+     */
+    uint64_t *avail_summary;
+    /**
+     * index of the first word of `avail_summary` that might contain a 1-bit
+     */
+    size_t summary_hint;
+    /**
+     * number of slots in use, for each chunk of the table; chunks are freed when they become empty
+     */
+    size_t *chunk_used;
+};
+
+/**
+ * directory of the chunks that hold the pointers to the keys. Chunks never move once allocated, and the directory is replaced only
+ * when the number of chunks changes, so that readers can look up the keys without taking a lock (see `daemon_keys_read_lock`).
+ * Chunks that are empty are freed and set to NULL.
+ */
+struct daemon_key_dir_t {
+    size_t num_chunks;
+    void **chunks[1];
+};
+
+/**
+ * reference count of a slot of the key table, shared by the requests that have loaded the same key
+ */
+struct daemon_key_ref_t {
+    struct daemon_key_ref_t *next;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    size_t key_index;
+    size_t refcnt;
+};
+
+/**
+ * per-thread record used for determining when the objects removed from the key table can be freed. `epoch` is non-zero while the
+ * thread is accessing the keys.
+ */
+struct daemon_keys_reader_t {
+    struct daemon_keys_reader_t *next;
+    uint64_t epoch;
+    int in_use;
+};
+
+/**
+ * an object that asks `daemon_refill_thread` to precompute values off the critical path (e.g., the pool of ECDSA nonces attached to
+ * a key). The owner sets `queued` under its own lock and keeps the object alive while it is queued.
+ */
+struct daemon_refill_t {
+    struct daemon_refill_t *next;
+    int queued;
+    void (*cb)(struct daemon_refill_t *refill);
+};
+
+#ifdef NEVERBLEED_EPOLL
+/**
+ * a descriptor registered to the epoll instance shared by the workers. The registrations are one-shot; the callback is invoked by
+ * the worker that receives the event, and is responsible for re-arming the descriptor.
+ */
+struct daemon_event_t {
+    int fd;
+    void (*cb)(struct daemon_event_t *ev);
+};
+#endif
+
+struct daemon_conn_t {
+    int fd;
+    /**
+     * serializes the writes of the responses, as well as the updates to `refcnt` and `closed`
+     */
+    pthread_mutex_t mutex;
+    /**
+     * number of references held by the readers of the socket and the ring, and by the requests being processed
+     */
+    size_t refcnt;
+    /**
+     * bytes read from the socket; only touched by the reader of the socket
+     */
+    struct expbuf_t rbuf;
+    /**
+     * set once the authentication token and the transport mode have been received
+     */
+    int established;
+    /**
+     * rings shared with the client (or NULL), and the eventfds used for waking up the reader of the ring and the client
+     */
+    struct st_neverbleed_shm_t *shm;
+    int sq_efd;
+    int cq_efd;
+#ifdef NEVERBLEED_EPOLL
+    struct daemon_event_t sock_ev;
+    struct daemon_event_t ring_ev;
+    /**
+     * set when the socket is closed, so that the reader of the ring stops re-arming the eventfd
+     */
+    int closed;
+    /**
+     * bytes of the responses that could not be written without blocking; flushed by `daemon_conn_on_writable`
+     */
+    struct expbuf_t wbuf;
+    /**
+     * registered for EPOLLOUT while `wbuf` is non-empty. A duplicate of the socket is used, as the socket itself is registered as
+     * `sock_ev`; opened on first use.
+     */
+    struct daemon_event_t write_ev;
+    /**
+     * set when the reader has stopped re-arming `sock_ev`, as `wbuf` has grown beyond `NEVERBLEED_DAEMON_WBUF_MAX_SIZE`
+     */
+    int read_paused;
+#endif
+};
+
+/**
+ * counters updated by a thread of the daemon. Each thread has a slot of its own, so that the counters can be updated without
+ * atomic operations or cache line bouncing; `daemon_stats_collect` sums them up.
+ */
+struct daemon_stats_slot_t {
+    struct daemon_stats_slot_t *next;
+    int in_use;
+    neverbleed_stats_t stats;
+} __attribute__((aligned(64)));
+
+struct daemon_job_t {
+    struct daemon_job_t *next;
+    /**
+     * if non-NULL, the job helps processing the items of a batch instead of handling a request (see `daemon_batch_run`)
+     */
+    struct daemon_batch_t *batch;
+    struct daemon_conn_t *conn;
+    size_t id;
+    /**
+     * if the request arrived through the ring, in which case the response is sent through the ring as well
+     */
+    int via_ring;
+    /**
+     * when the request has been read
+     */
+    uint64_t received_at;
+    struct expbuf_t buf;
+};
+
+/**
+ * number of entries of the table mapping the keys to their home workers; keys sharing an entry take turns
+ */
+#define NEVERBLEED_AFFINITY_TABLE_SIZE 16384
+/**
+ * maximum number of jobs queued to a worker for the keys it is home to; the jobs that follow are processed by any worker
+ */
+#define NEVERBLEED_AFFINITY_MAX_QUEUED 4
+/**
+ * a worker running a job for longer than this is considered stalled (e.g., writing to a client that is not reading the responses);
+ * jobs are not queued to it, and the ones already queued are taken over by other workers. The value is an order of magnitude
+ * longer than an RSA-2048 signature.
+ */
+#define NEVERBLEED_AFFINITY_STALL_NSEC 5000000
+
+#ifdef NEVERBLEED_EPOLL
+/**
+ * signal used for waking up a worker sleeping in epoll_pwait when a job is queued to it
+ */
+#define NEVERBLEED_WAKEUP_SIGNAL SIGUSR2
+/**
+ * the requests arriving on a connection are not read while more than this many bytes of the responses are waiting to be written
+ */
+#define NEVERBLEED_DAEMON_WBUF_MAX_SIZE (1024 * 1024)
+#endif
+
+/**
+ * a worker thread, when key affinity is enabled (see `neverbleed_key_affinity`)
+ */
+struct daemon_worker_t {
+    size_t index;
+    pthread_t tid;
+    /**
+     * jobs using the keys for which the worker is home; protected by `daemon_vars.jobs.lock`, as is `sleeping`
+     */
+    struct daemon_job_t *first;
+    struct daemon_job_t **tail;
+    size_t num_queued;
+    /**
+     * set while the worker waits for events without having jobs queued
+     */
+    int sleeping;
+    /**
+     * when the worker started running the current job, or zero
+     */
+    uint64_t busy_since;
+    /**
+     * number of operations using the keys for which the worker is home, halved every second
+     */
+    uint64_t load;
+} __attribute__((aligned(64)));
+
+static struct {
+    struct {
+        /**
+         * serializes the updates; readers do not take the lock
+         */
+        pthread_mutex_t lock;
+        struct daemon_key_dir_t *rsa_dir;
+        struct key_slots rsa_slots;
+        struct daemon_key_dir_t *ecdsa_dir;
+        struct key_slots ecdsa_slots;
+        struct daemon_key_dir_t *eddsa_dir;
+        struct key_slots eddsa_slots;
+        /**
+         * hash table of the keys indexed by the digests of their public keys, so that a key being loaded more than once shares the
+         * slot (see `daemon_set_key`)
+         */
+        struct {
+            struct daemon_key_ref_t **buckets;
+            size_t capacity;
+            size_t size;
+        } refs;
+        /**
+         * incremented every time the writer waits for the readers
+         */
+        uint64_t epoch;
+        /**
+         * list of the readers; elements are added but never removed
+         */
+        struct daemon_keys_reader_t *readers;
+    } keys;
+    /**
+     * requests waiting to be processed by the worker threads
+     */
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct daemon_job_t *first;
+        struct daemon_job_t **tail;
+#ifdef NEVERBLEED_EPOLL
+        /**
+         * eventfd that is readable while jobs are queued
+         */
+        struct daemon_event_t ev;
+#endif
+    } jobs;
+    /**
+     * objects waiting for `daemon_refill_thread` to precompute their values
+     */
+    struct {
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        struct daemon_refill_t *first;
+    } refills;
+    /**
+     * ex_data indexes of the precomputed values attached to the keys
+     */
+    int rsa_blinding_index;
+#ifdef NEVERBLEED_ECDSA
+    int ecdsa_pool_index;
+#endif
+    struct {
+        pthread_mutex_t lock;
+        /**
+         * list of the slots; elements are added but never removed
+         */
+        struct daemon_stats_slot_t *slots;
+    } stats;
+    /**
+     * key affinity (see `neverbleed_key_affinity`)
+     */
+    struct {
+        /**
+         * the workers, or NULL if key affinity is disabled
+         */
+        struct daemon_worker_t *workers;
+        /**
+         * total number of jobs queued to the workers; protected by `daemon_vars.jobs.lock`
+         */
+        size_t num_queued;
+        /**
+         * maps the keys to their home workers, indexed by the key index and the type. Each entry contains the key index in the
+         * upper 32 bits and the index of the home worker plus one in the lower, and is updated without taking locks.
+         */
+        uint64_t homes[NEVERBLEED_AFFINITY_TABLE_SIZE];
+        /**
+         * when the loads of the workers were last halved, in seconds
+         */
+        uint64_t decayed_at;
+    } affinity;
+    neverbleed_t *nb;
+    size_t num_workers;
+#ifdef NEVERBLEED_EPOLL
+    int epoll_fd;
+#endif
+} daemon_vars = {{PTHREAD_MUTEX_INITIALIZER}, {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, &daemon_vars.jobs.first}};
+
+static __thread struct daemon_keys_reader_t *daemon_keys_reader;
+static __thread struct daemon_stats_slot_t *daemon_stats_slot;
+/**
+ * the worker being run by the thread (if key affinity is enabled)
+ */
+static __thread struct daemon_worker_t *daemon_worker;
+/**
+ * jobs retained by the thread for reuse along with their buffers, so that the requests can be handled without allocating memory
+ */
+static __thread struct {
+    struct daemon_job_t *first;
+    size_t count;
+} daemon_job_cache;
+
+#define NEVERBLEED_JOB_CACHE_SIZE 16
+
+static struct daemon_job_t *daemon_job_new(void)
+{
+    struct daemon_job_t *job;
+
+    if ((job = daemon_job_cache.first) != NULL) {
+        daemon_job_cache.first = job->next;
+        --daemon_job_cache.count;
+    } else {
+        if ((job = malloc(sizeof(*job))) == NULL)
+            dief("no memory");
+        memset(&job->buf, 0, sizeof(job->buf));
+    }
+    job->next = NULL;
+    job->batch = NULL;
+    job->conn = NULL;
+
+    return job;
+}
+
+static void daemon_job_free(struct daemon_job_t *job)
+{
+    if (daemon_job_cache.count < NEVERBLEED_JOB_CACHE_SIZE && job->buf.capacity <= NEVERBLEED_RETAINED_BUF_MAX_SIZE) {
+        expbuf_clear(&job->buf);
+        job->next = daemon_job_cache.first;
+        daemon_job_cache.first = job;
+        ++daemon_job_cache.count;
+    } else {
+        expbuf_dispose(&job->buf);
+        free(job);
+    }
+}
+
+/**
+ * returns the counters of the calling thread
+ */
+static neverbleed_stats_t *daemon_stats(void)
+{
+    struct daemon_stats_slot_t *slot;
+
+    if ((slot = daemon_stats_slot) == NULL) {
+        pthread_mutex_lock(&daemon_vars.stats.lock);
+        /* slots of the threads that have exited are reused, retaining the counters */
+        for (slot = daemon_vars.stats.slots; slot != NULL && slot->in_use; slot = slot->next)
+            ;
+        if (slot == NULL) {
+            if (posix_memalign((void **)&slot, 64, sizeof(*slot)) != 0)
+                dief("no memory");
+            memset(slot, 0, sizeof(*slot));
+            slot->next = daemon_vars.stats.slots;
+            daemon_vars.stats.slots = slot;
+        }
+        slot->in_use = 1;
+        pthread_mutex_unlock(&daemon_vars.stats.lock);
+        daemon_stats_slot = slot;
+    }
+
+    return &slot->stats;
+}
+
+static void daemon_stats_count_key_op(enum neverbleed_type type, int ok)
+{
+    neverbleed_stats_t *stats = daemon_stats();
+    size_t index = type == NEVERBLEED_TYPE_RSA     ? NEVERBLEED_STATS_KEY_RSA
+                   : type == NEVERBLEED_TYPE_ECDSA ? NEVERBLEED_STATS_KEY_ECDSA
+                                                   : NEVERBLEED_STATS_KEY_EDDSA;
+
+    ++stats->key_types[index].operations;
+    if (!ok)
+        ++stats->key_types[index].failures;
+}
+
+/**
+ * sums up the counters of all the threads. The counters are read while being updated; each of them is naturally aligned and hence
+ * is read atomically on the supported platforms.
+ */
+static void daemon_stats_collect(neverbleed_stats_t *out)
+{
+    struct daemon_stats_slot_t *slot;
+    size_t i;
+
+    memset(out, 0, sizeof(*out));
+    pthread_mutex_lock(&daemon_vars.stats.lock);
+    for (slot = daemon_vars.stats.slots; slot != NULL; slot = slot->next) {
+        const uint64_t *src = (const uint64_t *)&slot->stats;
+        uint64_t *dst = (uint64_t *)out;
+        for (i = 0; i != sizeof(*out) / sizeof(uint64_t); ++i)
+            dst[i] += __atomic_load_n(src + i, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&daemon_vars.stats.lock);
+}
+
+#ifndef NEVERBLEED_EPOLL
+
+/**
+ * releases the slot of the calling thread, which is about to exit
+ */
+static void daemon_stats_dispose(void)
+{
+    if (daemon_stats_slot != NULL) {
+        pthread_mutex_lock(&daemon_vars.stats.lock);
+        daemon_stats_slot->in_use = 0;
+        pthread_mutex_unlock(&daemon_vars.stats.lock);
+        daemon_stats_slot = NULL;
+    }
+}
+
+#endif
+
+/**
+ * marks the calling thread as accessing the keys. Until `daemon_keys_read_unlock` is called, the keys obtained by `daemon_get_rsa`
+ * and `daemon_get_ecdsa` remain valid even if they are removed from the table concurrently. The keys are neither locked nor
+ * reference-counted, so that threads using the same key do not contend.
+ */
+static void daemon_keys_read_lock(void)
+{
+    struct daemon_keys_reader_t *reader;
+
+    if ((reader = daemon_keys_reader) == NULL) {
+        pthread_mutex_lock(&daemon_vars.keys.lock);
+        for (reader = daemon_vars.keys.readers; reader != NULL && reader->in_use; reader = reader->next)
+            ;
+        if (reader == NULL) {
+            if ((reader = malloc(sizeof(*reader))) == NULL)
+                dief("no memory");
+            reader->epoch = 0;
+            reader->next = daemon_vars.keys.readers;
+            __atomic_store_n(&daemon_vars.keys.readers, reader, __ATOMIC_RELEASE);
+        }
+        reader->in_use = 1;
+        pthread_mutex_unlock(&daemon_vars.keys.lock);
+        daemon_keys_reader = reader;
+    }
+
+    /* announce the epoch before reading the table; see `daemon_keys_synchronize` */
+    __atomic_store_n(&reader->epoch, __atomic_load_n(&daemon_vars.keys.epoch, __ATOMIC_RELAXED) + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void daemon_keys_read_unlock(void)
+{
+    __atomic_store_n(&daemon_keys_reader->epoch, 0, __ATOMIC_RELEASE);
+}
+
+#ifndef NEVERBLEED_EPOLL
+
+/**
+ * releases the record of the calling thread, which is about to exit
+ */
+static void daemon_keys_reader_dispose(void)
+{
+    if (daemon_keys_reader != NULL) {
+        pthread_mutex_lock(&daemon_vars.keys.lock);
+        daemon_keys_reader->in_use = 0;
+        pthread_mutex_unlock(&daemon_vars.keys.lock);
+        daemon_keys_reader = NULL;
+    }
+}
+
+#endif
+
+/**
+ * waits until all the readers that might have obtained the objects that have been removed from the key table stop using them
+ */
+static void daemon_keys_synchronize(void)
+{
+    struct daemon_keys_reader_t *reader;
+    uint64_t target, epoch;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    target = __atomic_add_fetch(&daemon_vars.keys.epoch, 1, __ATOMIC_SEQ_CST) + 1;
+    for (reader = __atomic_load_n(&daemon_vars.keys.readers, __ATOMIC_ACQUIRE); reader != NULL; reader = reader->next)
+        while ((epoch = __atomic_load_n(&reader->epoch, __ATOMIC_ACQUIRE)) != 0 && epoch < target)
+            sched_yield();
+}
+
+static void *daemon_key_dir_get(struct daemon_key_dir_t **_dir, size_t index)
+{
+    struct daemon_key_dir_t *dir = __atomic_load_n(_dir, __ATOMIC_ACQUIRE);
+    void **chunk;
+
+    if (dir == NULL || index / NEVERBLEED_KEY_CHUNK_SIZE >= dir->num_chunks ||
+        (chunk = __atomic_load_n(&dir->chunks[index / NEVERBLEED_KEY_CHUNK_SIZE], __ATOMIC_ACQUIRE)) == NULL)
+        return NULL;
+    return __atomic_load_n(&chunk[index % NEVERBLEED_KEY_CHUNK_SIZE], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * replaces the pointer stored at `index`, returning the previous one. Must be called while holding the lock.
+ */
+static void *daemon_key_dir_set(struct daemon_key_dir_t *dir, size_t index, void *key)
+{
+    return __atomic_exchange_n(&dir->chunks[index / NEVERBLEED_KEY_CHUNK_SIZE][index % NEVERBLEED_KEY_CHUNK_SIZE], key,
+                               __ATOMIC_RELEASE);
+}
+
+/**
+ * changes the number of chunks to `num_chunks`; the chunks being dropped must have been freed. Returns the directory that has been
+ * replaced (to be freed after `daemon_keys_synchronize`), or NULL. Must be called while holding the lock.
+ */
+static struct daemon_key_dir_t *daemon_key_dir_resize(struct daemon_key_dir_t **_dir, size_t num_chunks)
+{
+    struct daemon_key_dir_t *olddir = *_dir, *newdir;
+    size_t old_chunks = olddir != NULL ? olddir->num_chunks : 0, i;
+
+    if (num_chunks == old_chunks)
+        return NULL;
+
+    if ((newdir = malloc(offsetof(struct daemon_key_dir_t, chunks) + sizeof(newdir->chunks[0]) * num_chunks)) == NULL)
+        dief("no memory");
+    newdir->num_chunks = num_chunks;
+    for (i = 0; i != num_chunks; ++i) {
+        if (i < old_chunks) {
+            newdir->chunks[i] = olddir->chunks[i];
+        } else {
+            newdir->chunks[i] = NULL;
+        }
+    }
+    for (; i < old_chunks; ++i)
+        assert(olddir->chunks[i] == NULL);
+    __atomic_store_n(_dir, newdir, __ATOMIC_RELEASE);
+
+    return olddir;
+}
+
+static void daemon_refill_enqueue(struct daemon_refill_t *refill)
+{
+    pthread_mutex_lock(&daemon_vars.refills.lock);
+    refill->next = daemon_vars.refills.first;
+    daemon_vars.refills.first = refill;
+    pthread_cond_signal(&daemon_vars.refills.cond);
+    pthread_mutex_unlock(&daemon_vars.refills.lock);
+}
+
+/**
+ * precomputes the values requested through `daemon_refill_enqueue` in the background, at the lowest priority
+ */
+__attribute__((noreturn)) static void *daemon_refill_thread(void *unused)
+{
+    struct daemon_refill_t *refill;
+
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+
+    while (1) {
+        pthread_mutex_lock(&daemon_vars.refills.lock);
+        while ((refill = daemon_vars.refills.first) == NULL)
+            pthread_cond_wait(&daemon_vars.refills.cond, &daemon_vars.refills.lock);
+        daemon_vars.refills.first = refill->next;
+        pthread_mutex_unlock(&daemon_vars.refills.lock);
+
+        refill->cb(refill);
+    }
+}
+
+#define NEVERBLEED_RSA_BLINDING_POOL_SIZE 32
+/**
+ * number of operations for which a blinding factor is used (being squared each time) before it is replaced; kept below the point
+ * at which OpenSSL would recreate the factor inline
+ */
+#define NEVERBLEED_RSA_BLINDING_MAX_USES 16
+
+/**
+ * per-key pool of blinding factors. Instead of sharing the blinding state of the RSA object, which is guarded by a lock, each
+ * operation checks out a factor of its own and returns it when done. Factors that have been used up are replaced by the refill
+ * thread, so the pool grows to the number of threads using the key concurrently. The pool is attached to the key as ex_data.
+ */
+struct daemon_rsa_blinding_t {
+    pthread_mutex_t mutex;
+    RSA *key;
+    struct daemon_refill_t refill;
+    /**
+     * number of factors to be created by the refill thread
+     */
+    size_t num_wanted;
+    size_t num_entries;
+    struct {
+        BN_BLINDING *b;
+        unsigned num_uses;
+    } entries[NEVERBLEED_RSA_BLINDING_POOL_SIZE];
+};
+
+static int (*daemon_rsa_default_mod_exp)(BIGNUM *r0, const BIGNUM *I, RSA *rsa, BN_CTX *ctx);
+
+static void daemon_rsa_blinding_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    struct daemon_rsa_blinding_t *pool = ptr;
+    size_t i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i != pool->num_entries; ++i)
+        BN_BLINDING_free(pool->entries[i].b);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+static void daemon_rsa_blinding_on_refill(struct daemon_refill_t *refill)
+{
+    struct daemon_rsa_blinding_t *pool = (void *)((char *)refill - offsetof(struct daemon_rsa_blinding_t, refill));
+    RSA *rsa = pool->key;
+    BN_BLINDING *b;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->num_wanted != 0) {
+        --pool->num_wanted;
+        pthread_mutex_unlock(&pool->mutex);
+        b = RSA_setup_blinding(rsa, NULL);
+        pthread_mutex_lock(&pool->mutex);
+        if (b == NULL)
+            break;
+        if (pool->num_entries == NEVERBLEED_RSA_BLINDING_POOL_SIZE) {
+            BN_BLINDING_free(b);
+            break;
+        }
+        pool->entries[pool->num_entries].b = b;
+        pool->entries[pool->num_entries].num_uses = 0;
+        ++pool->num_entries;
+    }
+    pool->num_wanted = 0;
+    pool->refill.queued = 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* the pool might be freed along with the key */
+    RSA_free(rsa);
+}
+
+/**
+ * the `rsa_mod_exp` callback of the keys held by the daemon; blinds the input using a factor checked out from the pool, and runs
+ * the default implementation
+ */
+static int daemon_rsa_mod_exp(BIGNUM *r0, const BIGNUM *I, RSA *rsa, BN_CTX *ctx)
+{
+    struct daemon_rsa_blinding_t *pool = RSA_get_ex_data(rsa, daemon_vars.rsa_blinding_index);
+    BN_BLINDING *b = NULL;
+    unsigned num_uses = 0;
+    BIGNUM *blinded;
+    int ret = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->num_entries != 0) {
+        --pool->num_entries;
+        b = pool->entries[pool->num_entries].b;
+        num_uses = pool->entries[pool->num_entries].num_uses;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (b == NULL) {
+        ++daemon_stats()->rsa_blinding_inline;
+        if ((b = RSA_setup_blinding(rsa, ctx)) == NULL)
+            return 0;
+    }
+
+    BN_CTX_start(ctx);
+    if ((blinded = BN_CTX_get(ctx)) != NULL && BN_copy(blinded, I) != NULL && BN_BLINDING_convert_ex(blinded, NULL, b, ctx) &&
+        daemon_rsa_default_mod_exp(r0, blinded, rsa, ctx) && BN_BLINDING_invert_ex(r0, NULL, b, ctx))
+        ret = 1;
+    BN_CTX_end(ctx);
+
+    /* return the factor to the pool, or ask the refill thread to replace it */
+    pthread_mutex_lock(&pool->mutex);
+    if (ret && ++num_uses < NEVERBLEED_RSA_BLINDING_MAX_USES && pool->num_entries != NEVERBLEED_RSA_BLINDING_POOL_SIZE) {
+        pool->entries[pool->num_entries].b = b;
+        pool->entries[pool->num_entries].num_uses = num_uses;
+        ++pool->num_entries;
+        b = NULL;
+    } else if (pool->num_entries + pool->num_wanted < NEVERBLEED_RSA_BLINDING_POOL_SIZE) {
+        ++pool->num_wanted;
+        if (!pool->refill.queued) {
+            pool->refill.queued = 1;
+            RSA_up_ref(rsa);
+            daemon_refill_enqueue(&pool->refill);
+        }
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    if (b != NULL)
+        BN_BLINDING_free(b);
+
+    return ret;
+}
+
+/**
+ * switches the key to the blinding scheme of `daemon_rsa_mod_exp`, if the key is one for which OpenSSL would call `rsa_mod_exp`
+ */
+static void daemon_rsa_blinding_attach(RSA *rsa)
+{
+    static RSA_METHOD *meth;
+    const BIGNUM *p, *q, *dmp1, *dmq1, *iqmp;
+    struct daemon_rsa_blinding_t *pool;
+
+    RSA_get0_factors(rsa, &p, &q);
+    RSA_get0_crt_params(rsa, &dmp1, &dmq1, &iqmp);
+    if (p == NULL || q == NULL || dmp1 == NULL || dmq1 == NULL || iqmp == NULL)
+        return;
+
+    /* called with the key table locked */
+    if (meth == NULL) {
+        if ((meth = RSA_meth_dup(RSA_PKCS1_OpenSSL())) == NULL)
+            dief("no memory");
+        daemon_rsa_default_mod_exp = RSA_meth_get_mod_exp(meth);
+        RSA_meth_set_mod_exp(meth, daemon_rsa_mod_exp);
+    }
+
+    if ((pool = malloc(sizeof(*pool))) == NULL)
+        dief("no memory");
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->key = rsa;
+    pool->refill = (struct daemon_refill_t){NULL, 0, daemon_rsa_blinding_on_refill};
+    pool->num_wanted = 0;
+    pool->num_entries = 0;
+    if (!RSA_set_ex_data(rsa, daemon_vars.rsa_blinding_index, pool))
+        dief("RSA_set_ex_data failed");
+    RSA_set_method(rsa, meth);
+    RSA_blinding_off(rsa);
+}
+
+/**
+ * returns the table holding the keys of `type`
+ */
+static struct daemon_key_dir_t **daemon_keys_dir(enum neverbleed_type type)
+{
+    return type == NEVERBLEED_TYPE_RSA     ? &daemon_vars.keys.rsa_dir
+           : type == NEVERBLEED_TYPE_ECDSA ? &daemon_vars.keys.ecdsa_dir
+                                           : &daemon_vars.keys.eddsa_dir;
+}
+
+static struct key_slots *daemon_keys_slots(enum neverbleed_type type)
+{
+    return type == NEVERBLEED_TYPE_RSA     ? &daemon_vars.keys.rsa_slots
+           : type == NEVERBLEED_TYPE_ECDSA ? &daemon_vars.keys.ecdsa_slots
+                                           : &daemon_vars.keys.eddsa_slots;
+}
+
+/**
+ * set to the entries of the key table that refer to a `struct daemon_lazy_key_t` instead of a key
+ */
+#define DAEMON_LAZY_KEY_TAG ((uintptr_t)1)
+
+static void *daemon_key_load_lazy(enum neverbleed_type type, size_t key_index, void *entry, int *invalid);
+
+/**
+ * returns the key at `key_index`, loading it if it has been registered lazily. Returns NULL if the index is not in use, in which
+ * case `*invalid` is set to 1, or if the key could not be loaded. See `daemon_keys_read_lock`; as loading a key involves leaving
+ * the read section temporarily, objects obtained from the table before calling this function might become invalid.
+ */
+static void *daemon_get_key(enum neverbleed_type type, size_t key_index, int *invalid)
+{
+    void *key = daemon_key_dir_get(daemon_keys_dir(type), key_index);
+
+    *invalid = key == NULL;
+    if (((uintptr_t)key & DAEMON_LAZY_KEY_TAG) != 0)
+        key = daemon_key_load_lazy(type, key_index, key, invalid);
+    return key;
+}
+
+static RSA *daemon_get_rsa(size_t key_index, int *invalid)
+{
+    return daemon_get_key(NEVERBLEED_TYPE_RSA, key_index, invalid);
+}
+
+/**
+ * changes the number of slots to `reserved_size`, a multiple of NEVERBLEED_KEY_CHUNK_SIZE. When shrinking, the slots being dropped
+ * must be available. Returns the directory that has been replaced (to be freed after `daemon_keys_synchronize`), or NULL.
+ */
+static struct daemon_key_dir_t *key_slots_resize(struct key_slots *slots, struct daemon_key_dir_t **dir, size_t reserved_size)
+{
+    size_t old_words = slots->reserved_size / 64, num_words = reserved_size / 64, i;
+    size_t num_chunks = reserved_size / NEVERBLEED_KEY_CHUNK_SIZE;
+
+    if ((slots->avail = realloc(slots->avail, num_words * sizeof(slots->avail[0]))) == NULL ||
+        (slots->avail_summary = realloc(slots->avail_summary, (num_words + 63) / 64 * sizeof(slots->avail_summary[0]))) == NULL ||
+        (slots->chunk_used = realloc(slots->chunk_used, num_chunks * sizeof(slots->chunk_used[0]))) == NULL)
+        dief("no memory");
+    for (i = old_words; i < num_words; ++i)
+        slots->avail[i] = UINT64_MAX;
+    for (i = slots->reserved_size / NEVERBLEED_KEY_CHUNK_SIZE; i < num_chunks; ++i)
+        slots->chunk_used[i] = 0;
+    memset(slots->avail_summary, 0, (num_words + 63) / 64 * sizeof(slots->avail_summary[0]));
+    for (i = 0; i != num_words; ++i)
+        if (slots->avail[i] != 0)
+            slots->avail_summary[i / 64] |= (uint64_t)1 << (i % 64);
+    slots->summary_hint = 0;
+    slots->reserved_size = reserved_size;
+
+    return daemon_key_dir_resize(dir, num_chunks);
+}
+
+static int key_slots_in_use(struct key_slots *slots, size_t index)
+{
+    return index < slots->reserved_size && (slots->avail[index / 64] & ((uint64_t)1 << (index % 64))) == 0;
+}
+
+/**
+ * marks the first available slot as being in use, returning its index, or SIZE_MAX if there is none
+ */
+static size_t key_slots_acquire(struct key_slots *slots)
+{
+    size_t num_summary_words = (slots->reserved_size / 64 + 63) / 64, word, index;
+
+    for (; slots->summary_hint < num_summary_words; ++slots->summary_hint)
+        if (slots->avail_summary[slots->summary_hint] != 0)
+            break;
+    if (slots->summary_hint == num_summary_words)
+        return SIZE_MAX;
+
+    word = slots->summary_hint * 64 + __builtin_ctzll(slots->avail_summary[slots->summary_hint]);
+    index = word * 64 + __builtin_ctzll(slots->avail[word]);
+
+    if ((slots->avail[word] &= ~((uint64_t)1 << (index % 64))) == 0)
+        slots->avail_summary[word / 64] &= ~((uint64_t)1 << (word % 64));
+    ++slots->chunk_used[index / NEVERBLEED_KEY_CHUNK_SIZE];
+    ++slots->size;
+
+    return index;
+}
+
+/**
+ * marks the slot as being available. Returns if the chunk that contains the slot has become empty.
+ */
+static int key_slots_release(struct key_slots *slots, size_t index)
+{
+    size_t word = index / 64;
+
+    slots->avail[word] |= (uint64_t)1 << (index % 64);
+    slots->avail_summary[word / 64] |= (uint64_t)1 << (word % 64);
+    if (word / 64 < slots->summary_hint)
+        slots->summary_hint = word / 64;
+    --slots->size;
+
+    return --slots->chunk_used[index / NEVERBLEED_KEY_CHUNK_SIZE] == 0;
+}
+
+/**
+ * returns the number of slots that the table should be shrunk to, or 0 if it should not be shrunk. The table is shrunk when no more
+ * than a quarter of the slots are in use, while leaving twice the room for the slots up to the last one being used.
+ */
+static size_t key_slots_shrink_size(struct key_slots *slots)
+{
+    size_t num_chunks = slots->reserved_size / NEVERBLEED_KEY_CHUNK_SIZE, new_size;
+
+    if (slots->reserved_size <= default_reserved_size || slots->size > slots->reserved_size / 4)
+        return 0;
+
+    while (num_chunks != 0 && slots->chunk_used[num_chunks - 1] == 0)
+        --num_chunks;
+    if ((new_size = num_chunks * 2 * NEVERBLEED_KEY_CHUNK_SIZE) < default_reserved_size)
+        new_size = default_reserved_size;
+
+    return new_size < slots->reserved_size ? new_size : 0;
+}
+
+/**
+ * delay before reading the file of a lazily-registered key again after a failure; doubled on every failure up to the maximum
+ */
+#define NEVERBLEED_LAZY_KEY_RETRY_MIN_NSEC ((uint64_t)1000000000)
+#define NEVERBLEED_LAZY_KEY_RETRY_MAX_NSEC ((uint64_t)60 * 1000000000)
+
+/**
+ * a key that has been registered by `register_key_stub` without being loaded. The key is loaded when it is used for the first time,
+ * replacing this object in the table (see `daemon_key_load_lazy`).
+ */
+struct daemon_lazy_key_t {
+    char *fn;
+    /**
+     * contents of the file, read at registration so that the key can be loaded after the daemon has dropped its privileges without
+     * the file being kept open. Released when loading fails, in which case the file is read again by its name when retrying.
+     */
+    char *pem;
+    size_t pem_len;
+    /**
+     * held while the key is being loaded, so that the other threads using the key wait for the outcome instead of loading it too
+     */
+    pthread_mutex_t mutex;
+    /**
+     * digest of the public key taken from the certificate, which the private key is required to match
+     */
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    /**
+     * if loading has failed, the time until which the operations using the key fail without reading the file again (zero if not
+     * failed), and the delay to be applied after the next failure
+     */
+    uint64_t retry_at;
+    uint64_t retry_delay;
+};
+
+static void daemon_lazy_key_release_pem(struct daemon_lazy_key_t *lazy)
+{
+    if (lazy->pem != NULL) {
+        OPENSSL_cleanse(lazy->pem, lazy->pem_len);
+        free(lazy->pem);
+        lazy->pem = NULL;
+    }
+}
+
+static void daemon_lazy_key_free(struct daemon_lazy_key_t *lazy)
+{
+    daemon_lazy_key_release_pem(lazy);
+    pthread_mutex_destroy(&lazy->mutex);
+    free(lazy->fn);
+    free(lazy);
+}
+
+static void daemon_digest_update_bn(EVP_MD_CTX *ctx, const BIGNUM *bn)
+{
+    uint32_t len = (uint32_t)BN_num_bytes(bn);
+    unsigned char *bytes;
+
+    if ((bytes = malloc(len + 1)) == NULL)
+        dief("no memory");
+    BN_bn2bin(bn, bytes);
+    EVP_DigestUpdate(ctx, &len, sizeof(len));
+    EVP_DigestUpdate(ctx, bytes, len);
+    free(bytes);
+}
+
+/**
+ * calculates the digest that identifies the public key of `entry`, which is either a key or a lazy entry of the table. The digest
+ * is calculated from the components of the key rather than from its encoding, which might vary (e.g., compressed EC points).
+ */
+static void daemon_key_digest(enum neverbleed_type type, void *entry, unsigned char *digest)
+{
+    EVP_MD_CTX *ctx;
+    uint32_t t = (uint32_t)type;
+
+    if (((uintptr_t)entry & DAEMON_LAZY_KEY_TAG) != 0) {
+        memcpy(digest, ((struct daemon_lazy_key_t *)((uintptr_t)entry & ~DAEMON_LAZY_KEY_TAG))->digest, SHA256_DIGEST_LENGTH);
+        return;
+    }
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL || !EVP_DigestInit_ex(ctx, EVP_sha256(), NULL))
+        dief("failed to initialize digest");
+    EVP_DigestUpdate(ctx, &t, sizeof(t));
+    switch (type) {
+    case NEVERBLEED_TYPE_RSA: {
+        const BIGNUM *n, *e;
+        RSA_get0_key(entry, &n, &e, NULL);
+        daemon_digest_update_bn(ctx, n);
+        daemon_digest_update_bn(ctx, e);
+    } break;
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA: {
+        const EC_GROUP *group = EC_KEY_get0_group(entry);
+        uint32_t curve = (uint32_t)EC_GROUP_get_curve_name(group);
+        unsigned char *point = NULL;
+        size_t point_len;
+        EVP_DigestUpdate(ctx, &curve, sizeof(curve));
+        if ((point_len = EC_POINT_point2buf(group, EC_KEY_get0_public_key(entry), POINT_CONVERSION_UNCOMPRESSED, &point, NULL)) ==
+            0)
+            dief("failed to encode the public key");
+        EVP_DigestUpdate(ctx, point, point_len);
+        OPENSSL_free(point);
+    } break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case NEVERBLEED_TYPE_EDDSA: {
+        uint32_t id = (uint32_t)EVP_PKEY_get_id(entry);
+        unsigned char pub[64];
+        size_t pub_len = sizeof(pub);
+        EVP_DigestUpdate(ctx, &id, sizeof(id));
+        if (!EVP_PKEY_get_raw_public_key(entry, pub, &pub_len))
+            dief("failed to encode the public key");
+        EVP_DigestUpdate(ctx, pub, pub_len);
+    } break;
+#endif
+    default:
+        dief("unexpected key type:%d", (int)type);
+    }
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+}
+
+/**
+ * returns the link pointing to the reference of the key identified by `digest` and stored at `key_index` (or at any index if
+ * `key_index` is SIZE_MAX), or NULL if not found. Must be called while holding the lock.
+ */
+static struct daemon_key_ref_t **daemon_keys_find_ref(const unsigned char *digest, size_t key_index)
+{
+    struct daemon_key_ref_t **ref;
+    size_t hash;
+
+    if (daemon_vars.keys.refs.capacity == 0)
+        return NULL;
+    memcpy(&hash, digest, sizeof(hash));
+    for (ref = daemon_vars.keys.refs.buckets + (hash & (daemon_vars.keys.refs.capacity - 1)); *ref != NULL; ref = &(*ref)->next)
+        if (memcmp((*ref)->digest, digest, SHA256_DIGEST_LENGTH) == 0 && (key_index == SIZE_MAX || (*ref)->key_index == key_index))
+            return ref;
+    return NULL;
+}
+
+static void daemon_keys_add_ref(const unsigned char *digest, size_t key_index)
+{
+    struct daemon_key_ref_t *ref, **bucket;
+    size_t hash;
+
+    /* double the number of buckets when the load factor reaches 1 */
+    if (daemon_vars.keys.refs.size >= daemon_vars.keys.refs.capacity) {
+        size_t old_capacity = daemon_vars.keys.refs.capacity, new_capacity = old_capacity != 0 ? old_capacity * 2 : 256, i;
+        struct daemon_key_ref_t **old_buckets = daemon_vars.keys.refs.buckets;
+        if ((daemon_vars.keys.refs.buckets = calloc(new_capacity, sizeof(*daemon_vars.keys.refs.buckets))) == NULL)
+            dief("no memory");
+        daemon_vars.keys.refs.capacity = new_capacity;
+        for (i = 0; i != old_capacity; ++i) {
+            while ((ref = old_buckets[i]) != NULL) {
+                old_buckets[i] = ref->next;
+                memcpy(&hash, ref->digest, sizeof(hash));
+                bucket = daemon_vars.keys.refs.buckets + (hash & (new_capacity - 1));
+                ref->next = *bucket;
+                *bucket = ref;
+            }
+        }
+        free(old_buckets);
+    }
+
+    if ((ref = malloc(sizeof(*ref))) == NULL)
+        dief("no memory");
+    memcpy(ref->digest, digest, SHA256_DIGEST_LENGTH);
+    ref->key_index = key_index;
+    ref->refcnt = 1;
+    memcpy(&hash, digest, sizeof(hash));
+    bucket = daemon_vars.keys.refs.buckets + (hash & (daemon_vars.keys.refs.capacity - 1));
+    ref->next = *bucket;
+    *bucket = ref;
+    ++daemon_vars.keys.refs.size;
+}
+
+/**
+ * stores `entry` to an available slot of the table, returning the index. Must be called while holding the lock, usually after
+ * checking that the table does not contain the key identified by `digest`. The directory that has been replaced, if any, is
+ * returned through `retired`, and is to be freed after `daemon_keys_synchronize`.
+ */
+static size_t daemon_keys_add(enum neverbleed_type type, void *entry, const unsigned char *digest,
+                              struct daemon_key_dir_t **retired)
+{
+    struct key_slots *slots = daemon_keys_slots(type);
+    struct daemon_key_dir_t **dir = daemon_keys_dir(type);
+    void ***chunk;
+    size_t index;
+
+    /* grow the table by 50% when it is full */
+    *retired = NULL;
+    if (slots->size >= slots->reserved_size) {
+        size_t size = slots->reserved_size != 0 ? slots->reserved_size + slots->reserved_size / 2 : default_reserved_size;
+        size = (size + NEVERBLEED_KEY_CHUNK_SIZE - 1) / NEVERBLEED_KEY_CHUNK_SIZE * NEVERBLEED_KEY_CHUNK_SIZE;
+        *retired = key_slots_resize(slots, dir, size);
+    }
+
+    if ((index = key_slots_acquire(slots)) == SIZE_MAX)
+        dief("no available slot for key");
+
+    chunk = &(*dir)->chunks[index / NEVERBLEED_KEY_CHUNK_SIZE];
+    if (*chunk == NULL) {
+        void **newchunk;
+        if ((newchunk = calloc(NEVERBLEED_KEY_CHUNK_SIZE, sizeof(newchunk[0]))) == NULL)
+            dief("no memory");
+        __atomic_store_n(chunk, newchunk, __ATOMIC_RELEASE);
+    }
+    daemon_key_dir_set(*dir, index, entry);
+    daemon_keys_add_ref(digest, index);
+
+    return index;
+}
+
+/**
+ * frees an entry that has been removed from the table
+ */
+static void daemon_key_free(enum neverbleed_type type, void *entry)
+{
+    if (((uintptr_t)entry & DAEMON_LAZY_KEY_TAG) != 0) {
+        daemon_lazy_key_free((struct daemon_lazy_key_t *)((uintptr_t)entry & ~DAEMON_LAZY_KEY_TAG));
+    } else if (type == NEVERBLEED_TYPE_RSA) {
+        RSA_free(entry);
+#ifdef NEVERBLEED_ECDSA
+    } else if (type == NEVERBLEED_TYPE_ECDSA) {
+        EC_KEY_free(entry);
+#endif
+#ifdef NEVERBLEED_EDDSA
+    } else if (type == NEVERBLEED_TYPE_EDDSA) {
+        EVP_PKEY_free(entry);
+#endif
+    }
+}
+
+/**
+ * takes a reference to a key being stored to the table
+ */
+static void daemon_key_up_ref(enum neverbleed_type type, void *key)
+{
+    switch (type) {
+    case NEVERBLEED_TYPE_RSA:
+        RSA_up_ref(key);
+        break;
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA:
+        EC_KEY_up_ref(key);
+        break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case NEVERBLEED_TYPE_EDDSA:
+        EVP_PKEY_up_ref(key);
+        break;
+#endif
+    default:
+        dief("unexpected key type:%d", (int)type);
+    }
+}
+
+/**
+ * releases a reference to the key at `key_index`, removing the key from the table when the last reference is released. Returns 1
+ * if successful, or 0 if the index is not in use.
+ */
+static int daemon_del_key(enum neverbleed_type type, size_t key_index)
+{
+    struct key_slots *slots = daemon_keys_slots(type);
+    struct daemon_key_dir_t **dir = daemon_keys_dir(type),
+                            *retired = NULL;
+    struct daemon_key_ref_t **ref_link, *ref;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    void *key, **chunk = NULL;
+    size_t shrink_size;
+
+    pthread_mutex_lock(&daemon_vars.keys.lock);
+
+    if (key_index >= slots->reserved_size) {
+        pthread_mutex_unlock(&daemon_vars.keys.lock);
+        errno = 0;
+        warnf("%s: invalid key index %zu", __FUNCTION__, key_index);
+        return 0;
+    }
+
+    if (!key_slots_in_use(slots, key_index)) {
+        pthread_mutex_unlock(&daemon_vars.keys.lock);
+        errno = 0;
+        warnf("%s: index not in use %zu", __FUNCTION__, key_index);
+        return 0;
+    }
+
+    daemon_key_digest(type, daemon_key_dir_get(dir, key_index), digest);
+    if ((ref_link = daemon_keys_find_ref(digest, key_index)) == NULL)
+        dief("reference to key %zu not found", key_index);
+    ref = *ref_link;
+    if (--ref->refcnt != 0) {
+        pthread_mutex_unlock(&daemon_vars.keys.lock);
+        return 1;
+    }
+    *ref_link = ref->next;
+    --daemon_vars.keys.refs.size;
+    free(ref);
+
+    /* set slot as available, releasing the chunk if it has become empty and shrinking the table after mass removals */
+    key = daemon_key_dir_set(*dir, key_index, NULL);
+    if (key_slots_release(slots, key_index)) {
+        chunk = (*dir)->chunks[key_index / NEVERBLEED_KEY_CHUNK_SIZE];
+        __atomic_store_n(&(*dir)->chunks[key_index / NEVERBLEED_KEY_CHUNK_SIZE], NULL, __ATOMIC_RELEASE);
+    }
+    if ((shrink_size = key_slots_shrink_size(slots)) != 0)
+        retired = key_slots_resize(slots, dir, shrink_size);
+    pthread_mutex_unlock(&daemon_vars.keys.lock);
+
+    /* the key is freed once the threads that might be using it are done */
+    daemon_keys_synchronize();
+    daemon_key_free(type, key);
+    free(chunk);
+    free(retired);
+
+    return 1;
+}
+
+static int priv_encdec_proxy(enum neverbleed_opcode opcode, int flen, const unsigned char *from, unsigned char *_to, RSA *rsa,
+                             int padding)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    size_t daemon, key_index, ret;
+    unsigned char *to;
+    size_t tolen;
+
+    get_privsep_data(rsa, &exdata, &thdata);
+    thread_data_take_buf(thdata, &buf);
+
+    daemon = select_daemon(thdata, exdata, &key_index);
+    expbuf_push_cmd(&buf, opcode, key_index, padding, from, flen);
+    keyop_transaction(thdata, daemon, &buf);
+    if (expbuf_shift_num(&buf, &ret) != 0 || (to = expbuf_shift_bytes(&buf, &tolen)) == NULL) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    memcpy(_to, to, tolen);
+    thread_data_release_buf(thdata, &buf);
+
+    return (int)ret;
+}
+
+static int priv_encdec_stub(const char *name,
+                            int (*func)(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding),
+                            struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    unsigned char to[4096];
+    RSA *rsa;
+    int ret, invalid;
+
+    daemon_keys_read_lock();
+    if ((rsa = daemon_get_rsa(cmd->key_index, &invalid)) == NULL && invalid) {
+        daemon_keys_read_unlock();
+        errno = 0;
+        warnf("%s: invalid key index:%zu\n", name, (size_t)cmd->key_index);
+        return -1;
+    }
+    ret = rsa != NULL ? func((int)expbuf_size(buf), (unsigned char *)buf->start, to, rsa, cmd->arg) : -1;
+    daemon_keys_read_unlock();
+    daemon_stats_count_key_op(NEVERBLEED_TYPE_RSA, ret >= 0);
+    expbuf_clear(buf);
+
+    expbuf_push_num(buf, ret);
+    expbuf_push_bytes(buf, to, ret > 0 ? ret : 0);
+
+    return 0;
+}
+
+static int priv_enc_proxy(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    return priv_encdec_proxy(NEVERBLEED_OP_PRIV_ENC, flen, from, to, rsa, padding);
+}
+
+static int priv_enc_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    return priv_encdec_stub(__FUNCTION__, RSA_private_encrypt, cmd, buf);
+}
+
+static int priv_dec_proxy(int flen, const unsigned char *from, unsigned char *to, RSA *rsa, int padding)
+{
+    return priv_encdec_proxy(NEVERBLEED_OP_PRIV_DEC, flen, from, to, rsa, padding);
+}
+
+static int priv_dec_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    return priv_encdec_stub(__FUNCTION__, RSA_private_decrypt, cmd, buf);
+}
+
+static int sign_proxy(int type, const unsigned char *m, unsigned int m_len, unsigned char *_sigret, unsigned *_siglen,
+                      const RSA *rsa)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    size_t daemon, key_index, ret, siglen;
+    unsigned char *sigret;
+
+    get_privsep_data(rsa, &exdata, &thdata);
+    thread_data_take_buf(thdata, &buf);
+
+    daemon = select_daemon(thdata, exdata, &key_index);
+    expbuf_push_cmd(&buf, NEVERBLEED_OP_SIGN, key_index, type, m, m_len);
+    keyop_transaction(thdata, daemon, &buf);
+    if (expbuf_shift_num(&buf, &ret) != 0 || (sigret = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    memcpy(_sigret, sigret, siglen);
+    *_siglen = (unsigned)siglen;
+    thread_data_release_buf(thdata, &buf);
+
+    return (int)ret;
+}
+
+static int sign_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    unsigned char sigret[4096];
+    RSA *rsa;
+    unsigned siglen = 0;
+    int ret, invalid;
+
+    daemon_keys_read_lock();
+    if ((rsa = daemon_get_rsa(cmd->key_index, &invalid)) == NULL && invalid) {
+        daemon_keys_read_unlock();
+        errno = 0;
+        warnf("%s: invalid key index:%zu", __FUNCTION__, (size_t)cmd->key_index);
+        return -1;
+    }
+    ret = rsa != NULL ? RSA_sign(cmd->arg, (unsigned char *)buf->start, (unsigned)expbuf_size(buf), sigret, &siglen, rsa) : 0;
+    daemon_keys_read_unlock();
+    daemon_stats_count_key_op(NEVERBLEED_TYPE_RSA, ret == 1);
+    expbuf_clear(buf);
+
+    expbuf_push_num(buf, ret);
+    expbuf_push_bytes(buf, sigret, ret == 1 ? siglen : 0);
+
+    return 0;
+}
+
+static EVP_PKEY *create_pkey(neverbleed_t *nb, size_t daemon, size_t key_index, const char *ebuf, const char *nbuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata = new_exdata(nb, daemon, key_index);
+    RSA *rsa;
+    EVP_PKEY *pkey;
+    BIGNUM *e = NULL, *n = NULL;
+
+    rsa = RSA_new_method(nb->engine);
+    RSA_set_ex_data(rsa, 0, exdata);
+    if (BN_hex2bn(&e, ebuf) == 0) {
+        fprintf(stderr, "failed to parse e:%s\n", ebuf);
+        abort();
+    }
+    if (BN_hex2bn(&n, nbuf) == 0) {
+        fprintf(stderr, "failed to parse n:%s\n", nbuf);
+        abort();
+    }
+    RSA_set0_key(rsa, n, e, NULL);
+    RSA_set_flags(rsa, RSA_FLAG_EXT_PKEY);
+
+    pkey = EVP_PKEY_new();
+    EVP_PKEY_set1_RSA(pkey, rsa);
+    RSA_free(rsa);
+
+    return pkey;
+}
+
+#ifdef NEVERBLEED_ECDSA
+
+static EC_KEY *daemon_get_ecdsa(size_t key_index, int *invalid)
+{
+    return daemon_get_key(NEVERBLEED_TYPE_ECDSA, key_index, invalid);
+}
+
+#define NEVERBLEED_ECDSA_POOL_SIZE 64
+
+/**
+ * per-key pool of the values precomputed by ECDSA_sign_setup(3), so that the costly scalar multiplication and inversion are done
+ * off the critical path. Each pair is used only once. The pool is attached to the EC key as ex_data and is freed along with the
+ * key.
+ */
+struct daemon_ecdsa_pool_t {
+    pthread_mutex_t mutex;
+    /**
+     * the key that owns the pool; a reference is held while the pool is queued for refill
+     */
+    EC_KEY *key;
+    struct daemon_refill_t refill;
+    size_t num_entries;
+    struct {
+        BIGNUM *kinv;
+        BIGNUM *r;
+    } entries[NEVERBLEED_ECDSA_POOL_SIZE];
+};
+
+static void daemon_ecdsa_pool_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    struct daemon_ecdsa_pool_t *pool = ptr;
+    size_t i;
+
+    if (pool == NULL)
+        return;
+    for (i = 0; i != pool->num_entries; ++i) {
+        BN_clear_free(pool->entries[i].kinv);
+        BN_clear_free(pool->entries[i].r);
+    }
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+/**
+ * must be called with `pool->mutex` held, while the key is alive
+ */
+static void daemon_ecdsa_pool_request_refill(struct daemon_ecdsa_pool_t *pool)
+{
+    if (pool->refill.queued)
+        return;
+    pool->refill.queued = 1;
+    EC_KEY_up_ref(pool->key);
+    daemon_refill_enqueue(&pool->refill);
+}
+
+static void daemon_ecdsa_pool_on_refill(struct daemon_refill_t *refill)
+{
+    struct daemon_ecdsa_pool_t *pool = (void *)((char *)refill - offsetof(struct daemon_ecdsa_pool_t, refill));
+    EC_KEY *ec_key = pool->key;
+    BIGNUM *kinv, *r;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->num_entries != NEVERBLEED_ECDSA_POOL_SIZE) {
+        pthread_mutex_unlock(&pool->mutex);
+        kinv = NULL;
+        r = NULL;
+        if (!ECDSA_sign_setup(ec_key, NULL, &kinv, &r)) {
+            pthread_mutex_lock(&pool->mutex);
+            break;
+        }
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->num_entries == NEVERBLEED_ECDSA_POOL_SIZE) {
+            BN_clear_free(kinv);
+            BN_clear_free(r);
+            break;
+        }
+        pool->entries[pool->num_entries].kinv = kinv;
+        pool->entries[pool->num_entries].r = r;
+        ++pool->num_entries;
+    }
+    pool->refill.queued = 0;
+    pthread_mutex_unlock(&pool->mutex);
+
+    /* the pool might be freed along with the key */
+    EC_KEY_free(ec_key);
+}
+
+/**
+ * attaches an empty pool to the key. The pool is filled once the key is used (see `daemon_ecdsa_sign`), so that no nonces are
+ * computed for the keys that are loaded but never used.
+ */
+static void daemon_ecdsa_pool_attach(EC_KEY *ec_key)
+{
+    struct daemon_ecdsa_pool_t *pool;
+
+    if ((pool = malloc(sizeof(*pool))) == NULL)
+        dief("no memory");
+    pthread_mutex_init(&pool->mutex, NULL);
+    pool->key = ec_key;
+    pool->refill = (struct daemon_refill_t){NULL, 0, daemon_ecdsa_pool_on_refill};
+    pool->num_entries = 0;
+    if (!EC_KEY_set_ex_data(ec_key, daemon_vars.ecdsa_pool_index, pool))
+        dief("EC_KEY_set_ex_data failed");
+}
+
+/**
+ * signs the digest using a precomputed nonce if available, falling back to ECDSA_sign(3)
+ */
+static int daemon_ecdsa_sign(int type, const unsigned char *m, int m_len, unsigned char *sig, unsigned *siglen, EC_KEY *ec_key)
+{
+    struct daemon_ecdsa_pool_t *pool = EC_KEY_get_ex_data(ec_key, daemon_vars.ecdsa_pool_index);
+    BIGNUM *kinv = NULL, *r = NULL;
+    int ret;
+
+    if (pool != NULL) {
+        pthread_mutex_lock(&pool->mutex);
+        if (pool->num_entries != 0) {
+            --pool->num_entries;
+            kinv = pool->entries[pool->num_entries].kinv;
+            r = pool->entries[pool->num_entries].r;
+        }
+        if (pool->num_entries <= NEVERBLEED_ECDSA_POOL_SIZE / 2)
+            daemon_ecdsa_pool_request_refill(pool);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    if (kinv == NULL) {
+        ++daemon_stats()->ecdsa_nonces_inline;
+        return ECDSA_sign(type, m, m_len, sig, siglen, ec_key);
+    }
+    ++daemon_stats()->ecdsa_nonces_precomputed;
+
+    ret = ECDSA_sign_ex(type, m, m_len, sig, siglen, kinv, r, ec_key);
+    BN_clear_free(kinv);
+    BN_clear_free(r);
+    return ret;
+}
+
+static int ecdsa_sign_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    unsigned char sigret[4096];
     EC_KEY *ec_key;
     unsigned siglen = 0;
+    int ret, invalid;
+
+    daemon_keys_read_lock();
+    if ((ec_key = daemon_get_ecdsa(cmd->key_index, &invalid)) == NULL && invalid) {
+        daemon_keys_read_unlock();
+        errno = 0;
+        warnf("%s: invalid key index:%zu", __FUNCTION__, (size_t)cmd->key_index);
+        return -1;
+    }
+
+    ret = ec_key != NULL ? daemon_ecdsa_sign(cmd->arg, (unsigned char *)buf->start, (int)expbuf_size(buf), sigret, &siglen, ec_key)
+                         : 0;
+    daemon_keys_read_unlock();
+    daemon_stats_count_key_op(NEVERBLEED_TYPE_ECDSA, ret == 1);
+    expbuf_clear(buf);
+
+    expbuf_push_num(buf, ret);
+    expbuf_push_bytes(buf, sigret, ret == 1 ? siglen : 0);
+
+    return 0;
+}
+
+static void ecdsa_get_privsep_data(const EC_KEY *ec_key, struct st_neverbleed_rsa_exdata_t **exdata,
+                                   struct st_neverbleed_thread_data_t **thdata)
+{
+    *exdata = EC_KEY_get_ex_data(ec_key, 0);
+    if (*exdata == NULL) {
+        errno = 0;
+        dief("invalid internal ref");
+    }
+    *thdata = get_thread_data((*exdata)->nb);
+}
+
+static int ecdsa_sign_proxy(int type, const unsigned char *m, int m_len, unsigned char *_sigret, unsigned int *_siglen,
+                            const BIGNUM *kinv, const BIGNUM *rp, EC_KEY *ec_key)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    size_t daemon, key_index, ret, siglen;
+    unsigned char *sigret;
+
+    ecdsa_get_privsep_data(ec_key, &exdata, &thdata);
+
+    /* as far as I've tested so far, kinv and rp are always NULL.
+       Looks like setup_sign will precompute this, but it is only
+       called sign_sig, and it seems to be not used in TLS ECDSA */
+    if (kinv != NULL || rp != NULL) {
+        errno = 0;
+        dief("unexpected non-NULL kinv and rp");
+    }
+
+    thread_data_take_buf(thdata, &buf);
+    daemon = select_daemon(thdata, exdata, &key_index);
+    expbuf_push_cmd(&buf, NEVERBLEED_OP_ECDSA_SIGN, key_index, type, m, m_len);
+    keyop_transaction(thdata, daemon, &buf);
+    if (expbuf_shift_num(&buf, &ret) != 0 || (sigret = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    memcpy(_sigret, sigret, siglen);
+    *_siglen = (unsigned)siglen;
+    thread_data_release_buf(thdata, &buf);
+
+    return (int)ret;
+}
+
+static EVP_PKEY *ecdsa_create_pkey(neverbleed_t *nb, size_t daemon, size_t key_index, int curve_name, const char *ec_pubkeybuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata = new_exdata(nb, daemon, key_index);
+    EC_KEY *ec_key;
+    EC_GROUP *ec_group;
+    BIGNUM *ec_pubkeybn = NULL;
+    EC_POINT *ec_pubkey;
+    EVP_PKEY *pkey;
+
+    ec_key = EC_KEY_new_method(nb->engine);
+    EC_KEY_set_ex_data(ec_key, 0, exdata);
+
+    ec_group = EC_GROUP_new_by_curve_name(curve_name);
+    if (!ec_group) {
+        fprintf(stderr, "could not create EC_GROUP\n");
+        abort();
+    }
+
+    EC_KEY_set_group(ec_key, ec_group);
+
+    if (BN_hex2bn(&ec_pubkeybn, ec_pubkeybuf) == 0) {
+        fprintf(stderr, "failed to parse ECDSA ephemeral public key:%s\n", ec_pubkeybuf);
+        abort();
+    }
+
+    if ((ec_pubkey = EC_POINT_bn2point(ec_group, ec_pubkeybn, NULL, NULL)) == NULL) {
+        fprintf(stderr, "failed to get ECDSA ephemeral public key from BIGNUM\n");
+        abort();
+    }
+
+    EC_KEY_set_public_key(ec_key, ec_pubkey);
+
+    pkey = EVP_PKEY_new();
+    EVP_PKEY_set1_EC_KEY(pkey, ec_key);
+
+    EC_POINT_free(ec_pubkey);
+    BN_free(ec_pubkeybn);
+    EC_GROUP_free(ec_group);
+    EC_KEY_free(ec_key);
+
+    return pkey;
+}
+
+static void priv_ecdsa_finish(EC_KEY *key)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+
+    ecdsa_get_privsep_data(key, &exdata, &thdata);
+    release_exdata(thdata, exdata, NEVERBLEED_OP_DEL_ECDSA_KEY);
+}
+
+static int del_ecdsa_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    int ret = daemon_del_key(NEVERBLEED_TYPE_ECDSA, cmd->key_index);
+
+    expbuf_clear(buf);
+    expbuf_push_num(buf, ret);
+    return 0;
+}
+
+#endif
+
+#ifdef NEVERBLEED_EDDSA
+
+static EVP_PKEY *daemon_get_eddsa(size_t key_index, int *invalid)
+{
+    return daemon_get_key(NEVERBLEED_TYPE_EDDSA, key_index, invalid);
+}
+
+/**
+ * signs the message `m`; unlike RSA and ECDSA, EdDSA signs the message itself rather than its digest
+ */
+static int daemon_eddsa_sign(const unsigned char *m, size_t m_len, unsigned char *sig, size_t *siglen, EVP_PKEY *pkey)
+{
+    EVP_MD_CTX *ctx;
+    int ret;
+
+    if ((ctx = EVP_MD_CTX_new()) == NULL)
+        dief("no memory");
+    ret = EVP_DigestSignInit(ctx, NULL, NULL, NULL, pkey) == 1 && EVP_DigestSign(ctx, sig, siglen, m, m_len) == 1;
+    EVP_MD_CTX_free(ctx);
+
+    return ret;
+}
+
+static int eddsa_sign_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    unsigned char sigret[256];
+    EVP_PKEY *pkey;
+    size_t siglen = sizeof(sigret);
+    int ret, invalid;
+
+    daemon_keys_read_lock();
+    if ((pkey = daemon_get_eddsa(cmd->key_index, &invalid)) == NULL && invalid) {
+        daemon_keys_read_unlock();
+        errno = 0;
+        warnf("%s: invalid key index:%zu", __FUNCTION__, (size_t)cmd->key_index);
+        return -1;
+    }
+    ret = pkey != NULL ? daemon_eddsa_sign((unsigned char *)buf->start, expbuf_size(buf), sigret, &siglen, pkey) : 0;
+    daemon_keys_read_unlock();
+    daemon_stats_count_key_op(NEVERBLEED_TYPE_EDDSA, ret == 1);
+    expbuf_clear(buf);
+
+    expbuf_push_num(buf, ret);
+    expbuf_push_bytes(buf, sigret, ret == 1 ? siglen : 0);
+
+    return 0;
+}
+
+/**
+ * the keys built by the engine are the Ed25519 and Ed448 keys of OpenSSL holding the public key, with the signing operation being
+ * replaced by `eddsa_digestsign_proxy`. The reference to the key in the daemon is stored as ex_data of EVP_PKEY, and is released
+ * when the EVP_PKEY is freed.
+ */
+static struct {
+    EVP_PKEY_METHOD *ed25519_meth;
+    EVP_PKEY_METHOD *ed448_meth;
+    int exdata_index;
+} eddsa_vars = {NULL, NULL, -1};
+
+static void eddsa_exdata_free(void *parent, void *ptr, CRYPTO_EX_DATA *ad, int idx, long argl, void *argp)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata = ptr;
+
+    /* called for every EVP_PKEY being freed, including those not built by the engine */
+    if (exdata == NULL)
+        return;
+    release_exdata(get_thread_data(exdata->nb), exdata, NEVERBLEED_OP_DEL_EDDSA_KEY);
+}
+
+static int eddsa_exdata_dup(CRYPTO_EX_DATA *to, const CRYPTO_EX_DATA *from, void **from_d, int idx, long argl, void *argp)
+{
+    /* the reference cannot be shared, as each copy would release it */
+    return *from_d == NULL;
+}
+
+static int eddsa_digestsign_proxy(EVP_MD_CTX *ctx, unsigned char *_sigret, size_t *_siglen, const unsigned char *tbs, size_t tbslen)
+{
+    EVP_PKEY *pkey = EVP_PKEY_CTX_get0_pkey(EVP_MD_CTX_get_pkey_ctx(ctx));
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    size_t daemon, key_index, ret, siglen;
+    unsigned char *sigret;
+
+    if (_sigret == NULL) {
+        *_siglen = (size_t)EVP_PKEY_get_size(pkey);
+        return 1;
+    }
+    if ((exdata = EVP_PKEY_get_ex_data(pkey, eddsa_vars.exdata_index)) == NULL) {
+        errno = 0;
+        dief("invalid internal ref");
+    }
+    thdata = get_thread_data(exdata->nb);
+
+    thread_data_take_buf(thdata, &buf);
+    daemon = select_daemon(thdata, exdata, &key_index);
+    expbuf_push_cmd(&buf, NEVERBLEED_OP_EDDSA_SIGN, key_index, 0, tbs, tbslen);
+    keyop_transaction(thdata, daemon, &buf);
+    if (expbuf_shift_num(&buf, &ret) != 0 || (sigret = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    if (ret == 1 && siglen <= *_siglen) {
+        memcpy(_sigret, sigret, siglen);
+        *_siglen = siglen;
+    } else {
+        ret = 0;
+    }
+    thread_data_release_buf(thdata, &buf);
+
+    return (int)ret;
+}
+
+static int eddsa_pkey_meths(ENGINE *e, EVP_PKEY_METHOD **pmeth, const int **nids, int nid)
+{
+    static const int eddsa_nids[] = {EVP_PKEY_ED25519, EVP_PKEY_ED448};
+
+    if (pmeth == NULL) {
+        *nids = eddsa_nids;
+        return sizeof(eddsa_nids) / sizeof(eddsa_nids[0]);
+    }
+    switch (nid) {
+    case EVP_PKEY_ED25519:
+        *pmeth = eddsa_vars.ed25519_meth;
+        return 1;
+    case EVP_PKEY_ED448:
+        *pmeth = eddsa_vars.ed448_meth;
+        return 1;
+    default:
+        *pmeth = NULL;
+        return 0;
+    }
+}
+
+static EVP_PKEY_METHOD *eddsa_new_pkey_meth(int nid)
+{
+    EVP_PKEY_METHOD *meth;
+
+    if ((meth = EVP_PKEY_meth_new(nid, EVP_PKEY_FLAG_SIGCTX_CUSTOM)) == NULL)
+        dief("no memory");
+    EVP_PKEY_meth_copy(meth, EVP_PKEY_meth_find(nid));
+    EVP_PKEY_meth_set_digestsign(meth, eddsa_digestsign_proxy);
+
+    return meth;
+}
+
+static void eddsa_setup(void)
+{
+    eddsa_vars.ed25519_meth = eddsa_new_pkey_meth(EVP_PKEY_ED25519);
+    eddsa_vars.ed448_meth = eddsa_new_pkey_meth(EVP_PKEY_ED448);
+    if ((eddsa_vars.exdata_index = EVP_PKEY_get_ex_new_index(0, NULL, NULL, eddsa_exdata_dup, eddsa_exdata_free)) == -1)
+        dief("EVP_PKEY_get_ex_new_index failed");
+}
+
+static EVP_PKEY *eddsa_create_pkey(neverbleed_t *nb, size_t daemon, size_t key_index, int nid, const unsigned char *pub,
+                                   size_t pub_len)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata = new_exdata(nb, daemon, key_index);
+    EVP_PKEY *pkey;
+
+    if ((pkey = EVP_PKEY_new_raw_public_key(nid, nb->engine, pub, pub_len)) == NULL) {
+        fprintf(stderr, "failed to build EdDSA public key\n");
+        abort();
+    }
+    EVP_PKEY_set_ex_data(pkey, eddsa_vars.exdata_index, exdata);
+
+    return pkey;
+}
+
+static int del_eddsa_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    int ret = daemon_del_key(NEVERBLEED_TYPE_EDDSA, cmd->key_index);
+
+    expbuf_clear(buf);
+    expbuf_push_num(buf, ret);
+    return 0;
+}
+
+#endif
+
+static void daemon_key_attach(enum neverbleed_type type, void *key)
+{
+    if (type == NEVERBLEED_TYPE_RSA) {
+        daemon_rsa_blinding_attach(key);
+#ifdef NEVERBLEED_ECDSA
+    } else if (type == NEVERBLEED_TYPE_ECDSA) {
+        daemon_ecdsa_pool_attach(key);
+#endif
+    }
+}
+
+/**
+ * stores a reference to `key` in the table, returning the index. If the table already contains the same key, the slot is shared,
+ * and the reference being taken is released when `daemon_del_key` is called as many times as the slot has been returned.
+ */
+static size_t daemon_set_key(enum neverbleed_type type, void *key)
+{
+    struct daemon_key_dir_t **dir = daemon_keys_dir(type);
+    struct daemon_key_dir_t *retired = NULL;
+    struct daemon_key_ref_t **ref;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    void *entry = NULL;
+    size_t index;
+
+    daemon_key_digest(type, key, digest);
+
+    pthread_mutex_lock(&daemon_vars.keys.lock);
+    if ((ref = daemon_keys_find_ref(digest, SIZE_MAX)) != NULL) {
+        index = (*ref)->key_index;
+        ++(*ref)->refcnt;
+        /* a lazy entry that has not been used yet is replaced by the key, as there is no need to read the file any more */
+        if (((uintptr_t)(entry = daemon_key_dir_get(dir, index)) & DAEMON_LAZY_KEY_TAG) == 0)
+            entry = NULL;
+    }
+    if (ref == NULL || entry != NULL) {
+        daemon_key_up_ref(type, key);
+        daemon_key_attach(type, key);
+        if (ref == NULL) {
+            index = daemon_keys_add(type, key, digest, &retired);
+        } else {
+            daemon_key_dir_set(*dir, index, key);
+        }
+    }
+    pthread_mutex_unlock(&daemon_vars.keys.lock);
+
+    if (retired != NULL || entry != NULL) {
+        daemon_keys_synchronize();
+        free(retired);
+        if (entry != NULL)
+            daemon_key_free(type, entry);
+    }
+
+    return index;
+}
+
+static neverbleed_req_t *start_request(struct st_neverbleed_thread_data_t *thdata, size_t daemon, enum neverbleed_req_kind kind,
+                                       struct expbuf_t *buf, void *data, int *fd)
+{
+    struct st_neverbleed_conn_t *conn = &thdata->daemons[daemon].async_conn;
+    neverbleed_req_t *req;
+
+    if (conn->fd == -1) {
+        conn_open(thdata->nb, daemon, conn, neverbleed_use_shm_ring);
+#ifdef NEVERBLEED_SHM_RING
+        /* the application polls the eventfd instead of us, so the daemon always needs to signal it */
+        if (conn->shm != NULL)
+            conn->shm->cq.need_wakeup = 1;
+#endif
+    }
+
+    if ((req = malloc(sizeof(*req))) == NULL)
+        dief("no memory");
+    req->thdata = thdata;
+    req->kind = kind;
+    req->data = data;
+    req->fork_generation = client_vars.fork_generation;
+    conn_submit(conn, req, buf);
+
+    *fd = conn->shm != NULL ? conn->cq_efd : conn->fd;
+    return req;
+}
+
+static void unlink_completed(neverbleed_req_t *req)
+{
+    neverbleed_req_t **ref;
+
+    for (ref = &req->thdata->completed.first; *ref != req; ref = &(*ref)->next)
+        assert(*ref != NULL);
+    if ((*ref = req->next) == NULL)
+        req->thdata->completed.tail = ref;
+}
+
+/**
+ * releases `req` if it has been started before the process forked, in which case the response will never arrive. Returns if the
+ * request has been released.
+ */
+static int discard_stale_request(neverbleed_req_t *req)
+{
+    if (req->fork_generation == client_vars.fork_generation)
+        return 0;
+    /* let the thread data be set up again unless it has been, so that `req` is no longer linked from it */
+    get_thread_data(req->thdata->nb);
+    req_dispose(req);
+    return 1;
+}
+
+static int finish_request(neverbleed_req_t *req, size_t *ret, unsigned char *out, size_t *outlen)
+{
+    unsigned char *p;
+    size_t len;
+
+    if (discard_stale_request(req))
+        return -1;
+    if (!req->completed)
+        return 0;
+    unlink_completed(req);
+
+    if (expbuf_shift_num(&req->buf, ret) != 0 || (p = expbuf_shift_bytes(&req->buf, &len)) == NULL) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    memcpy(out, p, len);
+    *outlen = len;
+    thread_data_release_buf(req->thdata, &req->buf);
+    req_dispose(req);
+
+    return 1;
+}
+
+/**
+ * obtains the reference to the key in the daemon, along with its type. Returns 0 if successful, or -1 if the key cannot be used.
+ */
+static int get_pkey_exdata(EVP_PKEY *pkey, struct st_neverbleed_rsa_exdata_t **exdata, enum neverbleed_type *type, char *errbuf)
+{
+    switch (EVP_PKEY_base_id(pkey)) {
+    case EVP_PKEY_RSA: {
+        RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+        *exdata = RSA_get_ex_data(rsa, 0);
+        RSA_free(rsa);
+        *type = NEVERBLEED_TYPE_RSA;
+        break;
+    }
+#ifdef NEVERBLEED_ECDSA
+    case EVP_PKEY_EC:
+        *exdata = EC_KEY_get_ex_data(EVP_PKEY_get0_EC_KEY(pkey), 0);
+        *type = NEVERBLEED_TYPE_ECDSA;
+        break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case EVP_PKEY_ED25519:
+    case EVP_PKEY_ED448:
+        *exdata = EVP_PKEY_get_ex_data(pkey, eddsa_vars.exdata_index);
+        *type = NEVERBLEED_TYPE_EDDSA;
+        break;
+#endif
+    default:
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "unsupported key type: %d", EVP_PKEY_base_id(pkey));
+        return -1;
+    }
+    if (*exdata == NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "the key has not been loaded by neverbleed");
+        return -1;
+    }
+
+    return 0;
+}
+
+neverbleed_req_t *neverbleed_start_sign(EVP_PKEY *pkey, int type, const unsigned char *m, size_t m_len, void *data, int *fd,
+                                        char *errbuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    enum neverbleed_type key_type;
+    size_t daemon, key_index;
+
+    if (get_pkey_exdata(pkey, &exdata, &key_type, errbuf) != 0)
+        return NULL;
+
+    thdata = get_thread_data(exdata->nb);
+    thread_data_take_buf(thdata, &buf);
+    daemon = select_daemon(thdata, exdata, &key_index);
+    switch (key_type) {
+    case NEVERBLEED_TYPE_RSA:
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_SIGN, key_index, type, m, m_len);
+        return start_request(thdata, daemon, NEVERBLEED_REQ_RSA_SIGN, &buf, data, fd);
+    case NEVERBLEED_TYPE_EDDSA:
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_EDDSA_SIGN, key_index, 0, m, m_len);
+        return start_request(thdata, daemon, NEVERBLEED_REQ_EDDSA_SIGN, &buf, data, fd);
+    default:
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_ECDSA_SIGN, key_index, type, m, m_len);
+        return start_request(thdata, daemon, NEVERBLEED_REQ_ECDSA_SIGN, &buf, data, fd);
+    }
+}
+
+int neverbleed_finish_sign(neverbleed_req_t *req, unsigned char *sig, size_t *siglen)
+{
+    size_t ret;
+    int r;
+
+    assert(req->kind == NEVERBLEED_REQ_RSA_SIGN || req->kind == NEVERBLEED_REQ_ECDSA_SIGN ||
+           req->kind == NEVERBLEED_REQ_EDDSA_SIGN);
+
+    if ((r = finish_request(req, &ret, sig, siglen)) != 1)
+        return r;
+    return (int)ret == 1 ? 1 : -1;
+}
+
+neverbleed_req_t *neverbleed_start_decrypt(EVP_PKEY *pkey, const unsigned char *from, size_t flen, int padding, void *data,
+                                           int *fd, char *errbuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t buf;
+    size_t daemon, key_index;
+    RSA *rsa;
+
+    if (EVP_PKEY_base_id(pkey) != EVP_PKEY_RSA) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "unsupported key type: %d", EVP_PKEY_base_id(pkey));
+        return NULL;
+    }
+    rsa = EVP_PKEY_get1_RSA(pkey);
+    exdata = RSA_get_ex_data(rsa, 0);
+    RSA_free(rsa);
+    if (exdata == NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "the key has not been loaded by neverbleed");
+        return NULL;
+    }
+
+    thdata = get_thread_data(exdata->nb);
+    thread_data_take_buf(thdata, &buf);
+    daemon = select_daemon(thdata, exdata, &key_index);
+    expbuf_push_cmd(&buf, NEVERBLEED_OP_PRIV_DEC, key_index, padding, from, flen);
+
+    return start_request(thdata, daemon, NEVERBLEED_REQ_DECRYPT, &buf, data, fd);
+}
+
+int neverbleed_finish_decrypt(neverbleed_req_t *req, unsigned char *to, size_t *tolen)
+{
+    size_t ret;
+    int r;
+
+    assert(req->kind == NEVERBLEED_REQ_DECRYPT);
+
+    if ((r = finish_request(req, &ret, to, tolen)) != 1)
+        return r;
+    return (int)ret >= 0 ? 1 : -1;
+}
+
+neverbleed_req_t *neverbleed_get_completed(neverbleed_t *nb)
+{
+    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
+    size_t i;
+
+    for (i = 0; thdata->completed.first == NULL && i != nb->num_daemons; ++i) {
+        struct st_neverbleed_conn_t *conn = &thdata->daemons[i].async_conn;
+        if (conn->fd != -1)
+            while (thdata->completed.first == NULL && conn_read(conn, 0))
+                ;
+    }
+    return thdata->completed.first;
+}
+
+void *neverbleed_get_data(neverbleed_req_t *req)
+{
+    return req->data;
+}
+
+void neverbleed_cancel(neverbleed_req_t *req)
+{
+    if (discard_stale_request(req))
+        return;
+    if (req->completed) {
+        unlink_completed(req);
+        req_dispose(req);
+    } else {
+        req->cancelled = 1;
+    }
+}
+
+int neverbleed_sign_batch(neverbleed_t *nb, neverbleed_sign_op_t *ops, size_t num_ops, char *errbuf)
+{
+    struct st_neverbleed_thread_data_t *thdata;
+    struct {
+        enum neverbleed_type key_type;
+        size_t daemon;
+        size_t key_index;
+    } *targets;
+    size_t daemon, i;
+
+    if (num_ops == 0)
+        return 0;
+    for (i = 0; i != num_ops; ++i) {
+        /* each operation has to fit in a request along with the numbers preceding it */
+        if (ops[i].m_len > UINT32_MAX - sizeof(size_t) * 4) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "operation %zu is too large", i);
+            return -1;
+        }
+    }
+
+    thdata = get_thread_data(nb);
+    if ((targets = malloc(sizeof(*targets) * num_ops)) == NULL)
+        dief("no memory");
+    for (i = 0; i != num_ops; ++i) {
+        struct st_neverbleed_rsa_exdata_t *exdata;
+        if (get_pkey_exdata(ops[i].pkey, &exdata, &targets[i].key_type, errbuf) != 0) {
+            free(targets);
+            return -1;
+        }
+        if (exdata->nb != nb) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "the key has been loaded by a different instance");
+            free(targets);
+            return -1;
+        }
+        targets[i].daemon = select_daemon(thdata, exdata, &targets[i].key_index);
+    }
+
+    /* send the operations to each daemon holding the keys, in chunks of a bounded size */
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        size_t start = 0, end;
+        while (1) {
+            struct expbuf_t payload = {NULL}, buf = {NULL};
+            size_t num_items = 0, num_results;
+            for (end = start; end != num_ops; ++end) {
+                if (targets[end].daemon != daemon)
+                    continue;
+                if (num_items == NEVERBLEED_SIGN_BATCH_CHUNK_SIZE ||
+                    (num_items != 0 && expbuf_size(&payload) + ops[end].m_len > NEVERBLEED_SIGN_BATCH_CHUNK_BYTES))
+                    break;
+                expbuf_push_num(&payload, targets[end].key_type);
+                expbuf_push_num(&payload, targets[end].key_index);
+                expbuf_push_num(&payload, (size_t)ops[end].type);
+                expbuf_push_bytes(&payload, ops[end].m, ops[end].m_len);
+                ++num_items;
+            }
+            if (num_items == 0)
+                break;
+            expbuf_push_cmd(&buf, NEVERBLEED_OP_SIGN_BATCH, 0, (int)num_items, payload.start, expbuf_size(&payload));
+            expbuf_dispose(&payload);
+
+            keyop_transaction(thdata, daemon, &buf);
+            if (expbuf_shift_num(&buf, &num_results) != 0 || num_results != num_items) {
+                errno = 0;
+                dief("failed to parse response");
+            }
+            for (i = start; i != end; ++i) {
+                size_t ret, siglen;
+                unsigned char *sig;
+                if (targets[i].daemon != daemon)
+                    continue;
+                if (expbuf_shift_num(&buf, &ret) != 0 || (sig = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
+                    errno = 0;
+                    dief("failed to parse response");
+                }
+                memcpy(ops[i].sig, sig, siglen);
+                ops[i].siglen = siglen;
+                ops[i].ok = ret == 1;
+            }
+            expbuf_dispose(&buf);
+            start = end;
+        }
+    }
+    free(targets);
+
+    return 0;
+}
+
+/**
+ * items of a request being processed. The items are picked up in order by the thread handling the request and by the workers that
+ * happen to be idle, so that the items are processed concurrently.
+ */
+struct daemon_batch_t {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    /**
+     * number of references held by the thread handling the request and by the queued jobs
+     */
+    size_t refcnt;
+    size_t num_started;
+    size_t num_finished;
+    size_t num_items;
+    void (*run_item)(void *items, size_t index);
+    void *items;
+};
+
+static void daemon_enqueue_job(struct daemon_job_t *job);
+
+/**
+ * processes the items that have not yet been started by other threads
+ */
+static void daemon_batch_work(struct daemon_batch_t *batch)
+{
+    size_t i;
+
+    pthread_mutex_lock(&batch->mutex);
+    while ((i = batch->num_started) != batch->num_items) {
+        ++batch->num_started;
+        pthread_mutex_unlock(&batch->mutex);
+        batch->run_item(batch->items, i);
+        pthread_mutex_lock(&batch->mutex);
+        if (++batch->num_finished == batch->num_items)
+            pthread_cond_signal(&batch->cond);
+    }
+    pthread_mutex_unlock(&batch->mutex);
+}
+
+static void daemon_batch_release(struct daemon_batch_t *batch)
+{
+    size_t refcnt;
+
+    pthread_mutex_lock(&batch->mutex);
+    refcnt = --batch->refcnt;
+    pthread_mutex_unlock(&batch->mutex);
+
+    if (refcnt == 0) {
+        pthread_mutex_destroy(&batch->mutex);
+        pthread_cond_destroy(&batch->cond);
+        free(batch);
+    }
+}
+
+static void daemon_batch_help(struct daemon_job_t *job)
+{
+    daemon_batch_work(job->batch);
+    daemon_batch_release(job->batch);
+    daemon_job_free(job);
+}
+
+/**
+ * calls `run_item` for each of the `num_items` items, using the workers that are idle as well as the calling thread. Returns when
+ * all the items have been processed; the jobs queued for helping might still be running, but they no longer access `items`.
+ */
+static void daemon_batch_run(void *items, size_t num_items, void (*run_item)(void *items, size_t index))
+{
+    struct daemon_batch_t *batch;
+    size_t num_helpers, i;
+
+    /* queue jobs that help processing the items, one for each worker that might be idle, and process the items ourselves too */
+    num_helpers = (num_items < daemon_vars.num_workers ? num_items : daemon_vars.num_workers) - 1;
+    if ((batch = malloc(sizeof(*batch))) == NULL)
+        dief("no memory");
+    pthread_mutex_init(&batch->mutex, NULL);
+    pthread_cond_init(&batch->cond, NULL);
+    batch->refcnt = 1 + num_helpers;
+    batch->num_started = 0;
+    batch->num_finished = 0;
+    batch->num_items = num_items;
+    batch->run_item = run_item;
+    batch->items = items;
+    for (i = 0; i != num_helpers; ++i) {
+        struct daemon_job_t *job = daemon_job_new();
+        job->batch = batch;
+        daemon_enqueue_job(job);
+    }
+    daemon_batch_work(batch);
+
+    /* wait for the items being processed by the helpers */
+    pthread_mutex_lock(&batch->mutex);
+    while (batch->num_finished != batch->num_items)
+        pthread_cond_wait(&batch->cond, &batch->mutex);
+    pthread_mutex_unlock(&batch->mutex);
+
+    daemon_batch_release(batch);
+}
+
+struct daemon_sign_batch_item_t {
+    size_t key_type;
+    size_t key_index;
+    size_t nid;
+    /**
+     * the digest, pointing to the request
+     */
+    const unsigned char *m;
+    size_t m_len;
     int ret;
+    unsigned char *sig;
+    unsigned siglen;
+};
+
+static void daemon_sign_batch_run_item(void *items, size_t index)
+{
+    struct daemon_sign_batch_item_t *item = (struct daemon_sign_batch_item_t *)items + index;
+    int invalid;
+
+    daemon_keys_read_lock();
+
+    switch (item->key_type) {
+    case NEVERBLEED_TYPE_RSA: {
+        RSA *rsa;
+        if ((rsa = daemon_get_rsa(item->key_index, &invalid)) == NULL)
+            goto InvalidKey;
+        if ((item->sig = malloc(RSA_size(rsa))) == NULL)
+            dief("no memory");
+        item->ret = RSA_sign((int)item->nid, item->m, (unsigned)item->m_len, item->sig, &item->siglen, rsa);
+    } break;
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA: {
+        EC_KEY *ec_key;
+        if ((ec_key = daemon_get_ecdsa(item->key_index, &invalid)) == NULL)
+            goto InvalidKey;
+        if ((item->sig = malloc(ECDSA_size(ec_key))) == NULL)
+            dief("no memory");
+        item->ret = daemon_ecdsa_sign((int)item->nid, item->m, (int)item->m_len, item->sig, &item->siglen, ec_key);
+    } break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case NEVERBLEED_TYPE_EDDSA: {
+        EVP_PKEY *pkey;
+        size_t siglen;
+        if ((pkey = daemon_get_eddsa(item->key_index, &invalid)) == NULL)
+            goto InvalidKey;
+        siglen = (size_t)EVP_PKEY_get_size(pkey);
+        if ((item->sig = malloc(siglen)) == NULL)
+            dief("no memory");
+        item->ret = daemon_eddsa_sign(item->m, item->m_len, item->sig, &siglen, pkey);
+        item->siglen = (unsigned)siglen;
+    } break;
+#endif
+    default:
+    InvalidKey:
+        errno = 0;
+        warnf("%s: invalid key:%zu:%zu", __FUNCTION__, item->key_type, item->key_index);
+        break;
+    }
+
+    daemon_keys_read_unlock();
+    if (item->key_type == NEVERBLEED_TYPE_RSA || item->key_type == NEVERBLEED_TYPE_ECDSA || item->key_type == NEVERBLEED_TYPE_EDDSA)
+        daemon_stats_count_key_op((enum neverbleed_type)item->key_type, item->ret == 1);
+}
+
+static int sign_batch_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    struct daemon_sign_batch_item_t *items;
+    size_t num_items = (size_t)cmd->arg, i;
+
+    /* each item occupies at least four numbers, which caps the allocation below */
+    if (cmd->arg <= 0 || num_items > expbuf_size(buf) / (sizeof(size_t) * 4)) {
+        errno = 0;
+        warnf("%s: invalid number of items:%d", __FUNCTION__, (int)cmd->arg);
+        return -1;
+    }
+    if ((items = malloc(sizeof(*items) * num_items)) == NULL)
+        dief("no memory");
+    for (i = 0; i != num_items; ++i) {
+        struct daemon_sign_batch_item_t *item = items + i;
+        if (expbuf_shift_num(buf, &item->key_type) != 0 || expbuf_shift_num(buf, &item->key_index) != 0 ||
+            expbuf_shift_num(buf, &item->nid) != 0 || (item->m = expbuf_shift_bytes(buf, &item->m_len)) == NULL) {
+            errno = 0;
+            warnf("%s: failed to parse request", __FUNCTION__);
+            free(items);
+            return -1;
+        }
+        item->ret = 0;
+        item->sig = NULL;
+        item->siglen = 0;
+    }
+
+    daemon_batch_run(items, num_items, daemon_sign_batch_run_item);
+
+    expbuf_clear(buf);
+    expbuf_push_num(buf, num_items);
+    for (i = 0; i != num_items; ++i) {
+        struct daemon_sign_batch_item_t *item = items + i;
+        expbuf_push_num(buf, item->ret);
+        expbuf_push_bytes(buf, item->sig, item->ret == 1 ? item->siglen : 0);
+        free(item->sig);
+    }
+    free(items);
+
+    return 0;
+}
+
+/**
+ * builds the key from the response of `daemon` to a load request, or returns NULL with the error stored to `errbuf`
+ */
+static EVP_PKEY *load_key_parse_response(neverbleed_t *nb, size_t daemon, struct expbuf_t *buf, char *errbuf)
+{
+    size_t index, type;
+
+    if (expbuf_shift_num(buf, &type) != 0 || expbuf_shift_num(buf, &index) != 0) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+
+    switch (type) {
+    case NEVERBLEED_TYPE_RSA: {
+        char *estr, *nstr;
+
+        if ((estr = expbuf_shift_str(buf)) == NULL || (nstr = expbuf_shift_str(buf)) == NULL) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        return create_pkey(nb, daemon, index, estr, nstr);
+    }
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA: {
+        char *ec_pubkeystr;
+        size_t curve_name;
+
+        if (expbuf_shift_num(buf, &curve_name) != 0 || (ec_pubkeystr = expbuf_shift_str(buf)) == NULL) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        return ecdsa_create_pkey(nb, daemon, index, (int)curve_name, ec_pubkeystr);
+    }
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case NEVERBLEED_TYPE_EDDSA: {
+        unsigned char *pub;
+        size_t nid, pub_len;
+
+        if (expbuf_shift_num(buf, &nid) != 0 || (pub = expbuf_shift_bytes(buf, &pub_len)) == NULL) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        return eddsa_create_pkey(nb, daemon, index, (int)nid, pub, pub_len);
+    }
+#endif
+    default: {
+        char *errstr;
+
+        if ((errstr = expbuf_shift_str(buf)) == NULL) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "%s", errstr);
+        return NULL;
+    }
+    }
+}
+
+/**
+ * records the replica of `pkey` that `daemon` has loaded, using the response of the daemon to the same request that has created
+ * `pkey`. If the daemon has failed to load the key, `pkey` is freed (removing the other replicas), and NULL is returned with the
+ * error stored to `errbuf`.
+ */
+static EVP_PKEY *load_key_add_replica(EVP_PKEY *pkey, size_t daemon, struct expbuf_t *buf, char *errbuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    enum neverbleed_type key_type;
+    size_t index, type;
+    char *errstr;
+
+    if (expbuf_shift_num(buf, &type) != 0 || expbuf_shift_num(buf, &index) != 0) {
+        errno = 0;
+        dief("failed to parse response");
+    }
+    if (get_pkey_exdata(pkey, &exdata, &key_type, errbuf) != 0) {
+        errno = 0;
+        dief("%s", errbuf);
+    }
+
+    if (type == key_type) {
+        add_replica(exdata, daemon, index);
+        return pkey;
+    }
+
+    if (type == NEVERBLEED_TYPE_ERROR && (errstr = expbuf_shift_str(buf)) != NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "%s", errstr);
+    } else {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "daemons loaded the key differently");
+    }
+    EVP_PKEY_free(pkey);
+    return NULL;
+}
+
+static void expbuf_copy(struct expbuf_t *dst, struct expbuf_t *src)
+{
+    expbuf_reserve(dst, expbuf_size(src));
+    memcpy(dst->end, src->start, expbuf_size(src));
+    dst->end += expbuf_size(src);
+}
+
+/**
+ * sends the load request stored in `req` to the daemon holding the fewest keys, or to all the daemons if the keys are to be
+ * replicated, and builds the key from the responses. Returns NULL with the error stored to `errbuf` if failed.
+ */
+static EVP_PKEY *load_key_transaction(struct st_neverbleed_thread_data_t *thdata, struct expbuf_t *req, char *errbuf)
+{
+    neverbleed_t *nb = thdata->nb;
+    struct expbuf_t buf = {NULL};
+    EVP_PKEY *pkey = NULL;
+    size_t daemon;
+
+    if (!neverbleed_replicate_keys || nb->num_daemons == 1) {
+        daemon = select_daemon_for_load(nb);
+        expbuf_copy(&buf, req);
+        neverbleed_transaction(thdata, daemon, &buf);
+        pkey = load_key_parse_response(nb, daemon, &buf, errbuf);
+        expbuf_dispose(&buf);
+        return pkey;
+    }
+
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        expbuf_copy(&buf, req);
+        neverbleed_transaction(thdata, daemon, &buf);
+        pkey = daemon == 0 ? load_key_parse_response(nb, daemon, &buf, errbuf) : load_key_add_replica(pkey, daemon, &buf, errbuf);
+        expbuf_dispose(&buf);
+        if (pkey == NULL)
+            break;
+    }
+    return pkey;
+}
+
+/**
+ * builds the request that registers the key stored in file `fn` without loading it, using the public key of the certificate
+ * that has been assigned to `ctx`. Returns -1 with `errbuf` being set if failed.
+ */
+static int build_register_key_request(struct expbuf_t *buf, SSL_CTX *ctx, const char *fn, char *errbuf)
+{
+    X509 *cert;
+    EVP_PKEY *pubkey;
+    struct expbuf_t payload = {NULL};
+    unsigned char *der = NULL;
+    int der_len;
+
+    if ((cert = SSL_CTX_get0_certificate(ctx)) == NULL || (pubkey = X509_get_pubkey(cert)) == NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "the certificate must be assigned before the private key is loaded lazily");
+        return -1;
+    }
+    der_len = i2d_PUBKEY(pubkey, &der);
+    EVP_PKEY_free(pubkey);
+    if (der_len <= 0) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to serialize the public key of the certificate");
+        return -1;
+    }
+
+    expbuf_push_str(&payload, fn);
+    expbuf_push_bytes(&payload, der, der_len);
+    expbuf_push_cmd(buf, NEVERBLEED_OP_REGISTER_KEY, 0, 0, payload.start, expbuf_size(&payload));
+    expbuf_dispose(&payload);
+    OPENSSL_free(der);
+
+    return 0;
+}
+
+int neverbleed_load_private_key_file(neverbleed_t *nb, SSL_CTX *ctx, const char *fn, char *errbuf)
+{
+    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
+    struct expbuf_t buf = {NULL};
+    int ret = 1;
+    EVP_PKEY *pkey;
+
+    if (neverbleed_load_keys_lazily) {
+        if (build_register_key_request(&buf, ctx, fn, errbuf) != 0)
+            return -1;
+    } else {
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_LOAD_KEY, 0, 0, fn, strlen(fn) + 1);
+    }
+    pkey = load_key_transaction(thdata, &buf, errbuf);
+    expbuf_dispose(&buf);
+    if (pkey == NULL)
+        return -1;
+
+    /* success */
+    if (SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "SSL_CTX_use_PrivateKey failed");
+        ret = 0;
+    }
+
+    EVP_PKEY_free(pkey);
+    return ret;
+}
+
+void neverbleed_load_private_key_files(neverbleed_t *nb, const char **fns, size_t num_fns, neverbleed_load_result_t *results)
+{
+    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
+    int replicate = neverbleed_replicate_keys && nb->num_daemons > 1;
+    size_t chunk_size = NEVERBLEED_LOAD_KEYS_CHUNK_SIZE, offset, num_items, i;
+
+    for (i = 0; i != num_fns; ++i)
+        results[i].pkey = NULL;
+
+    /* the files are sent in chunks, so that the size of each message stays moderate; when the keys are not replicated, each chunk
+     * is sent to the daemon holding the fewest keys, with the chunks being small enough to let all the daemons share the keys */
+    if (!replicate && (num_fns + nb->num_daemons - 1) / nb->num_daemons < chunk_size)
+        chunk_size = (num_fns + nb->num_daemons - 1) / nb->num_daemons;
+    for (offset = 0; offset < num_fns; offset += num_items) {
+        struct expbuf_t req = {NULL}, payload = {NULL};
+        size_t daemon, first_daemon, last_daemon;
+
+        num_items = num_fns - offset < chunk_size ? num_fns - offset : chunk_size;
+        for (i = 0; i != num_items; ++i)
+            expbuf_push_str(&payload, fns[offset + i]);
+        expbuf_push_cmd(&req, NEVERBLEED_OP_LOAD_KEYS, 0, (int)num_items, payload.start, expbuf_size(&payload));
+        expbuf_dispose(&payload);
+
+        if (replicate) {
+            first_daemon = 0;
+            last_daemon = nb->num_daemons - 1;
+        } else {
+            first_daemon = last_daemon = select_daemon_for_load(nb);
+        }
+        for (daemon = first_daemon; daemon <= last_daemon; ++daemon) {
+            struct expbuf_t buf = {NULL};
+            size_t num_resps;
+            expbuf_copy(&buf, &req);
+            neverbleed_transaction(thdata, daemon, &buf);
+            if (expbuf_shift_num(&buf, &num_resps) != 0 || num_resps != num_items) {
+                errno = 0;
+                dief("failed to parse response");
+            }
+            for (i = 0; i != num_items; ++i) {
+                neverbleed_load_result_t *result = results + offset + i;
+                struct expbuf_t resp;
+                size_t len;
+                if ((resp.start = expbuf_shift_bytes(&buf, &len)) == NULL) {
+                    errno = 0;
+                    dief("failed to parse response");
+                }
+                resp.buf = resp.start;
+                resp.end = resp.start + len;
+                resp.capacity = len;
+                if (daemon == first_daemon) {
+                    result->errbuf[0] = '\0';
+                    result->pkey = load_key_parse_response(nb, daemon, &resp, result->errbuf);
+                } else if (result->pkey != NULL) {
+                    result->pkey = load_key_add_replica(result->pkey, daemon, &resp, result->errbuf);
+                }
+            }
+            expbuf_dispose(&buf);
+        }
+        expbuf_dispose(&req);
+    }
+}
+
+EVP_PKEY *neverbleed_replace_private_key(EVP_PKEY *pkey, const char *fn, char *errbuf)
+{
+    struct st_neverbleed_rsa_exdata_t *exdata;
+    struct st_neverbleed_thread_data_t *thdata;
+    struct expbuf_t payload = {NULL};
+    enum neverbleed_type type;
+    EVP_PKEY *new_pkey = NULL;
+    size_t daemon;
+    int first = 1;
+
+    if (get_pkey_exdata(pkey, &exdata, &type, errbuf) != 0)
+        return NULL;
+    thdata = get_thread_data(exdata->nb);
+
+    expbuf_push_num(&payload, type);
+    switch (type) {
+    case NEVERBLEED_TYPE_RSA: {
+        RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+        const BIGNUM *e;
+        char *e_hex;
+        RSA_get0_key(rsa, NULL, &e, NULL);
+        if ((e_hex = BN_bn2hex(e)) == NULL)
+            dief("no memory");
+        expbuf_push_num(&payload, RSA_size(rsa));
+        expbuf_push_str(&payload, e_hex);
+        OPENSSL_free(e_hex);
+        RSA_free(rsa);
+    } break;
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA:
+        expbuf_push_num(&payload, EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey))));
+        break;
+#endif
+    default:
+        /* EdDSA keys are identified by the algorithm */
+        expbuf_push_num(&payload, EVP_PKEY_base_id(pkey));
+        break;
+    }
+    expbuf_push_str(&payload, fn);
+
+    /* the new key is loaded by each daemon holding the key being replaced, in the same way as `neverbleed_load_private_key_file`
+     * loads keys into multiple daemons; as the daemons read the same file, all of them are expected to succeed or fail */
+    for (daemon = 0; daemon != exdata->nb->num_daemons; ++daemon) {
+        size_t key_index = exdata->replica_indices != NULL ? __atomic_load_n(exdata->replica_indices + daemon, __ATOMIC_RELAXED)
+                           : daemon == exdata->daemon      ? exdata->key_index
+                                                           : SIZE_MAX;
+        struct expbuf_t buf = {NULL};
+        if (key_index == SIZE_MAX)
+            continue;
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_REPLACE_KEY, key_index, 0, payload.start, expbuf_size(&payload));
+        neverbleed_transaction(thdata, daemon, &buf);
+        if (first) {
+            new_pkey = load_key_parse_response(exdata->nb, daemon, &buf, errbuf);
+            first = 0;
+        } else {
+            new_pkey = load_key_add_replica(new_pkey, daemon, &buf, errbuf);
+        }
+        expbuf_dispose(&buf);
+        if (new_pkey == NULL)
+            break;
+    }
+    expbuf_dispose(&payload);
+
+    return new_pkey;
+}
+
+/**
+ * appends the type, the index and the public key of a key that has been added to the table, from which the client builds the key
+ * (see `load_key_parse_response`). Returns -1 with `errbuf` being set if failed.
+ */
+static int daemon_push_public_key(struct expbuf_t *buf, size_t key_index, EVP_PKEY *pkey, char *errbuf)
+{
+    switch (EVP_PKEY_base_id(pkey)) {
+    case EVP_PKEY_RSA: {
+        RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+        const BIGNUM *e, *n;
+        char *estr, *nstr;
+
+        RSA_get0_key(rsa, &n, &e, NULL);
+        estr = BN_bn2hex(e);
+        nstr = BN_bn2hex(n);
+        expbuf_push_num(buf, NEVERBLEED_TYPE_RSA);
+        expbuf_push_num(buf, key_index);
+        expbuf_push_str(buf, estr != NULL ? estr : "");
+        expbuf_push_str(buf, nstr != NULL ? nstr : "");
+        if (estr != NULL)
+            OPENSSL_free(estr);
+        if (nstr != NULL)
+            OPENSSL_free(nstr);
+        RSA_free(rsa);
+        return 0;
+    }
+#ifdef NEVERBLEED_ECDSA
+    case EVP_PKEY_EC: {
+        const EC_KEY *ec_key = EVP_PKEY_get0_EC_KEY(pkey);
+        const EC_GROUP *ec_group = EC_KEY_get0_group(ec_key);
+        BIGNUM *ec_pubkeybn;
+        char *ec_pubkeystr;
+
+        if ((ec_pubkeybn = BN_new()) == NULL ||
+            !EC_POINT_point2bn(ec_group, EC_KEY_get0_public_key(ec_key), POINT_CONVERSION_COMPRESSED, ec_pubkeybn, NULL) ||
+            (ec_pubkeystr = BN_bn2hex(ec_pubkeybn)) == NULL) {
+            BN_free(ec_pubkeybn);
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to convert ECDSA public key to BIGNUM");
+            return -1;
+        }
+        expbuf_push_num(buf, NEVERBLEED_TYPE_ECDSA);
+        expbuf_push_num(buf, key_index);
+        expbuf_push_num(buf, EC_GROUP_get_curve_name(ec_group));
+        expbuf_push_str(buf, ec_pubkeystr);
+        OPENSSL_free(ec_pubkeystr);
+        BN_free(ec_pubkeybn);
+        return 0;
+    }
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case EVP_PKEY_ED25519:
+    case EVP_PKEY_ED448: {
+        unsigned char pub[64];
+        size_t pub_len = sizeof(pub);
+
+        if (!EVP_PKEY_get_raw_public_key(pkey, pub, &pub_len)) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to obtain EdDSA public key");
+            return -1;
+        }
+        expbuf_push_num(buf, NEVERBLEED_TYPE_EDDSA);
+        expbuf_push_num(buf, key_index);
+        expbuf_push_num(buf, EVP_PKEY_get_id(pkey));
+        expbuf_push_bytes(buf, pub, pub_len);
+        return 0;
+    }
+#endif
+    default:
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "unsupported private key: %d", EVP_PKEY_base_id(pkey));
+        return -1;
+    }
+}
+
+static void daemon_push_load_error(struct expbuf_t *buf, const char *errbuf)
+{
+    expbuf_push_num(buf, NEVERBLEED_TYPE_ERROR);
+    expbuf_push_num(buf, SIZE_MAX);
+    expbuf_push_str(buf, errbuf);
+}
+
+/**
+ * reads the private key stored in file `fn`, or returns NULL with `errbuf` being set
+ */
+static EVP_PKEY *daemon_read_private_key(const char *fn, char *errbuf)
+{
+    FILE *fp;
+    EVP_PKEY *pkey;
+
+    if ((fp = fopen(fn, "rt")) == NULL) {
+        strerror_buf(errno, errbuf, NEVERBLEED_ERRBUF_SIZE);
+        return NULL;
+    }
+    pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL);
+    fclose(fp);
+    if (pkey == NULL)
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to parse the private key");
+
+    return pkey;
+}
+
+/**
+ * reads the contents of file `fn` into a buffer being allocated, or returns NULL with `errbuf` being set. The buffer is sized after
+ * the file, as it might be retained for a long time (see `struct daemon_lazy_key_t`).
+ */
+static char *daemon_read_file(const char *fn, size_t *size, char *errbuf)
+{
+    struct stat st;
+    char *bytes;
+    size_t capacity;
+    ssize_t rret;
+    int fd;
+
+    if ((fd = open(fn, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) != 0) {
+        strerror_buf(errno, errbuf, NEVERBLEED_ERRBUF_SIZE);
+        if (fd != -1)
+            close(fd);
+        return NULL;
+    }
+
+    /* one extra byte for detecting the end of the file without reallocating */
+    capacity = (size_t)st.st_size + 1;
+    if ((bytes = malloc(capacity)) == NULL)
+        dief("no memory");
+    *size = 0;
+    do {
+        if (*size == capacity) {
+            char *newbytes;
+            if ((newbytes = malloc(capacity * 2)) == NULL)
+                dief("no memory");
+            memcpy(newbytes, bytes, *size);
+            OPENSSL_cleanse(bytes, *size);
+            free(bytes);
+            bytes = newbytes;
+            capacity *= 2;
+        }
+        while ((rret = read(fd, bytes + *size, capacity - *size)) == -1 && errno == EINTR)
+            ;
+        if (rret == -1) {
+            strerror_buf(errno, errbuf, NEVERBLEED_ERRBUF_SIZE);
+            OPENSSL_cleanse(bytes, *size);
+            free(bytes);
+            bytes = NULL;
+            break;
+        }
+        *size += rret;
+    } while (rret != 0);
+    close(fd);
+
+    return bytes;
+}
+
+/**
+ * parses the private key stored in PEM format, or returns NULL with `errbuf` being set
+ */
+static EVP_PKEY *daemon_parse_private_key(const char *pem, size_t pem_len, char *errbuf)
+{
+    BIO *bio;
+    EVP_PKEY *pkey;
+
+    if ((bio = BIO_new_mem_buf(pem, (int)pem_len)) == NULL)
+        dief("no memory");
+    pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+    BIO_free(bio);
+    if (pkey == NULL)
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to parse the private key");
+
+    return pkey;
+}
+
+/**
+ * loads the private key stored in file `fn`, appending the outcome to `buf`
+ */
+static void daemon_load_key(const char *fn, struct expbuf_t *buf)
+{
+    EVP_PKEY *pkey;
+    size_t key_index;
+    char errbuf[NEVERBLEED_ERRBUF_SIZE] = "";
+
+    if ((pkey = daemon_read_private_key(fn, errbuf)) == NULL)
+        goto Error;
+
+    switch (EVP_PKEY_base_id(pkey)) {
+    case EVP_PKEY_RSA: {
+        RSA *rsa = EVP_PKEY_get1_RSA(pkey);
+        key_index = daemon_set_key(NEVERBLEED_TYPE_RSA, rsa);
+        RSA_free(rsa);
+        break;
+    }
+    case EVP_PKEY_EC:
+#ifdef NEVERBLEED_ECDSA
+        key_index = daemon_set_key(NEVERBLEED_TYPE_ECDSA, (EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey));
+        break;
+#else
+        snprintf(errbuf, sizeof(errbuf), "ECDSA support requires OpenSSL >= 1.1.0 or LibreSSL >= 2.9.1");
+        goto Error;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case EVP_PKEY_ED25519:
+    case EVP_PKEY_ED448:
+        key_index = daemon_set_key(NEVERBLEED_TYPE_EDDSA, pkey);
+        break;
+#endif
+    default:
+        snprintf(errbuf, sizeof(errbuf), "unsupported private key: %d", EVP_PKEY_base_id(pkey));
+        goto Error;
+    }
+
+    if (daemon_push_public_key(buf, key_index, pkey, errbuf) != 0)
+        goto Error;
+    EVP_PKEY_free(pkey);
+    return;
+
+Error:
+    daemon_push_load_error(buf, errbuf);
+    if (pkey != NULL)
+        EVP_PKEY_free(pkey);
+}
+
+static int load_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    struct expbuf_t res = {NULL};
+    char *fn;
+
+    if ((fn = expbuf_shift_cmd_str(buf)) == NULL) {
+        errno = 0;
+        warnf("%s: failed to parse request", __FUNCTION__);
+        return -1;
+    }
+    daemon_load_key(fn, &res);
+    expbuf_dispose(buf);
+    *buf = res;
+
+    return 0;
+}
+
+struct daemon_load_keys_item_t {
+    /**
+     * name of the file, pointing to the request
+     */
+    const char *fn;
+    struct expbuf_t res;
+};
+
+static void daemon_load_keys_run_item(void *items, size_t index)
+{
+    struct daemon_load_keys_item_t *item = (struct daemon_load_keys_item_t *)items + index;
+
+    daemon_load_key(item->fn, &item->res);
+}
+
+static int load_keys_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    struct daemon_load_keys_item_t *items;
+    struct expbuf_t res = {NULL};
+    size_t num_items = (size_t)cmd->arg, i;
+
+    /* each file name occupies at least one byte, which caps the allocation below */
+    if (cmd->arg <= 0 || num_items > expbuf_size(buf)) {
+        errno = 0;
+        warnf("%s: invalid number of files:%d", __FUNCTION__, (int)cmd->arg);
+        return -1;
+    }
+    if ((items = malloc(sizeof(*items) * num_items)) == NULL)
+        dief("no memory");
+    for (i = 0; i != num_items; ++i) {
+        if ((items[i].fn = expbuf_shift_str(buf)) == NULL) {
+            errno = 0;
+            warnf("%s: failed to parse request", __FUNCTION__);
+            free(items);
+            return -1;
+        }
+        memset(&items[i].res, 0, sizeof(items[i].res));
+    }
+
+    daemon_batch_run(items, num_items, daemon_load_keys_run_item);
+
+    expbuf_push_num(&res, num_items);
+    for (i = 0; i != num_items; ++i) {
+        expbuf_push_bytes(&res, items[i].res.start, expbuf_size(&items[i].res));
+        expbuf_dispose(&items[i].res);
+    }
+    free(items);
+    expbuf_dispose(buf);
+    *buf = res;
+
+    return 0;
+}
+
+/**
+ * reads the private key of a lazily-registered key, returning the RSA, EC_KEY or EVP_PKEY (for EdDSA) object, or NULL with `errbuf`
+ * being set. Must be called while holding the mutex of `lazy`.
+ */
+static void *daemon_lazy_key_read(enum neverbleed_type type, struct daemon_lazy_key_t *lazy, char *errbuf)
+{
+    EVP_PKEY *pkey;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    void *key = NULL;
+
+    if (lazy->pem == NULL && (lazy->pem = daemon_read_file(lazy->fn, &lazy->pem_len, errbuf)) == NULL)
+        return NULL;
+    if ((pkey = daemon_parse_private_key(lazy->pem, lazy->pem_len, errbuf)) == NULL) {
+        daemon_lazy_key_release_pem(lazy);
+        return NULL;
+    }
+
+    switch (type) {
+    case NEVERBLEED_TYPE_RSA:
+        key = EVP_PKEY_get1_RSA(pkey);
+        break;
+#ifdef NEVERBLEED_ECDSA
+    case NEVERBLEED_TYPE_ECDSA:
+        key = EVP_PKEY_get1_EC_KEY(pkey);
+        break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case NEVERBLEED_TYPE_EDDSA:
+        if (EVP_PKEY_get_id(pkey) == EVP_PKEY_ED25519 || EVP_PKEY_get_id(pkey) == EVP_PKEY_ED448) {
+            EVP_PKEY_up_ref(pkey);
+            key = pkey;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    if (key != NULL) {
+        daemon_key_digest(type, key, digest);
+        if (memcmp(digest, lazy->digest, sizeof(digest)) != 0) {
+            daemon_key_free(type, key);
+            key = NULL;
+        }
+    }
+    if (key == NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "the private key does not match the certificate");
+        daemon_lazy_key_release_pem(lazy);
+    }
+
+    EVP_PKEY_free(pkey);
+    return key;
+}
+
+/**
+ * loads the key being referred to by the lazy entry `entry` of the table, and returns the key being found at `key_index`
+ * afterwards. Called by `daemon_get_key` within the read section; the section is left while the lazy entry is being freed. Only one
+ * thread loads the key; the others wait for it while staying in the read section, which keeps the lazy entry alive, and then use
+ * the key being installed or fail as it did.
+ */
+static void *daemon_key_load_lazy(enum neverbleed_type type, size_t key_index, void *entry, int *invalid)
+{
+    struct daemon_lazy_key_t *lazy = (struct daemon_lazy_key_t *)((uintptr_t)entry & ~DAEMON_LAZY_KEY_TAG);
+    struct daemon_key_dir_t **dir = daemon_keys_dir(type);
+    char errbuf[NEVERBLEED_ERRBUF_SIZE];
+    uint64_t retry_at, now, delay;
+    void *key;
+    int installed = 0;
+
+    pthread_mutex_lock(&lazy->mutex);
+    if (daemon_key_dir_get(dir, key_index) != entry) {
+        /* loaded (or removed) by another thread while waiting */
+        pthread_mutex_unlock(&lazy->mutex);
+        return daemon_get_key(type, key_index, invalid);
+    }
+    retry_at = __atomic_load_n(&lazy->retry_at, __ATOMIC_RELAXED);
+    now = now_nsec();
+    if (retry_at != 0 && now < retry_at) {
+        pthread_mutex_unlock(&lazy->mutex);
+        return NULL;
+    }
+    if ((key = daemon_lazy_key_read(type, lazy, errbuf)) == NULL) {
+        /* the failure might be transient (e.g., the file being rewritten), hence the file is read again after a delay */
+        delay = __atomic_load_n(&lazy->retry_delay, __ATOMIC_RELAXED);
+        errno = 0;
+        warnf("failed to load key:%s:%s (retrying in %d seconds)", lazy->fn, errbuf, (int)(delay / 1000000000));
+        __atomic_store_n(&lazy->retry_at, now + delay, __ATOMIC_RELAXED);
+        if ((delay *= 2) > NEVERBLEED_LAZY_KEY_RETRY_MAX_NSEC)
+            delay = NEVERBLEED_LAZY_KEY_RETRY_MAX_NSEC;
+        __atomic_store_n(&lazy->retry_delay, delay, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&lazy->mutex);
+        return NULL;
+    }
+
+    /* install the key, unless the key has been removed in the meantime */
+    pthread_mutex_lock(&daemon_vars.keys.lock);
+    if (daemon_key_dir_get(dir, key_index) == entry) {
+        daemon_key_attach(type, key);
+        daemon_key_dir_set(*dir, key_index, key);
+        installed = 1;
+    }
+    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    pthread_mutex_unlock(&lazy->mutex);
+
+    if (installed) {
+        /* free the lazy entry once the other threads stop referring to it */
+        daemon_keys_read_unlock();
+        daemon_keys_synchronize();
+        daemon_lazy_key_free(lazy);
+        daemon_keys_read_lock();
+    } else {
+        daemon_key_free(type, key);
+    }
+
+    return daemon_get_key(type, key_index, invalid);
+}
+
+static int register_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    struct daemon_lazy_key_t *lazy;
+    struct daemon_key_dir_t *retired = NULL;
+    struct daemon_key_dir_t **dir;
+    struct daemon_key_ref_t **ref;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    const unsigned char *der, *p;
+    size_t der_len, key_index = SIZE_MAX;
+    enum neverbleed_type type;
+    EVP_PKEY *pubkey = NULL;
+    void *entry = NULL;
+    char *fn, *pem = NULL, errbuf[NEVERBLEED_ERRBUF_SIZE] = "";
+    size_t pem_len = 0;
+    struct expbuf_t res = {NULL};
+
+    if ((fn = expbuf_shift_str(buf)) == NULL || (der = expbuf_shift_bytes(buf, &der_len)) == NULL) {
+        errno = 0;
+        warnf("%s: failed to parse request", __FUNCTION__);
+        return -1;
+    }
+
+    /* the file is read now, as the daemon might not be able to open it once `neverbleed_setuidgid` has been called */
+    p = der;
+    if ((pem = daemon_read_file(fn, &pem_len, errbuf)) == NULL)
+        goto Error;
+    if ((pubkey = d2i_PUBKEY(NULL, &p, (long)der_len)) == NULL) {
+        snprintf(errbuf, sizeof(errbuf), "failed to parse the public key");
+        goto Error;
+    }
+    switch (EVP_PKEY_base_id(pubkey)) {
+    case EVP_PKEY_RSA:
+        type = NEVERBLEED_TYPE_RSA;
+        daemon_key_digest(type, (RSA *)EVP_PKEY_get0_RSA(pubkey), digest);
+        break;
+#ifdef NEVERBLEED_ECDSA
+    case EVP_PKEY_EC:
+        type = NEVERBLEED_TYPE_ECDSA;
+        daemon_key_digest(type, (EC_KEY *)EVP_PKEY_get0_EC_KEY(pubkey), digest);
+        break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case EVP_PKEY_ED25519:
+    case EVP_PKEY_ED448:
+        type = NEVERBLEED_TYPE_EDDSA;
+        daemon_key_digest(type, pubkey, digest);
+        break;
+#endif
+    default:
+        snprintf(errbuf, sizeof(errbuf), "unsupported private key: %d", EVP_PKEY_base_id(pubkey));
+        goto Error;
+    }
+    dir = daemon_keys_dir(type);
 
-    if (expbuf_shift_num(buf, &type) != 0 || (m = expbuf_shift_bytes(buf, &m_len)) == NULL ||
-        expbuf_shift_num(buf, &key_index) != 0) {
-        errno = 0;
-        warnf("%s: failed to parse request", __FUNCTION__);
-        return -1;
+    /* share the slot if the key has been registered or loaded already, unless an earlier registration has failed to load it */
+    pthread_mutex_lock(&daemon_vars.keys.lock);
+    if ((ref = daemon_keys_find_ref(digest, SIZE_MAX)) != NULL) {
+        key_index = (*ref)->key_index;
+        ++(*ref)->refcnt;
+        entry = daemon_key_dir_get(dir, key_index);
+        if (((uintptr_t)entry & DAEMON_LAZY_KEY_TAG) == 0 ||
+            __atomic_load_n(&((struct daemon_lazy_key_t *)((uintptr_t)entry & ~DAEMON_LAZY_KEY_TAG))->retry_at, __ATOMIC_RELAXED) ==
+                0)
+            entry = NULL;
+    }
+    if (ref == NULL || entry != NULL) {
+        if ((lazy = malloc(sizeof(*lazy))) == NULL || (lazy->fn = strdup(fn)) == NULL)
+            dief("no memory");
+        lazy->pem = pem;
+        lazy->pem_len = pem_len;
+        pem = NULL;
+        pthread_mutex_init(&lazy->mutex, NULL);
+        memcpy(lazy->digest, digest, sizeof(digest));
+        lazy->retry_at = 0;
+        lazy->retry_delay = NEVERBLEED_LAZY_KEY_RETRY_MIN_NSEC;
+        if (ref == NULL) {
+            key_index = daemon_keys_add(type, (void *)((uintptr_t)lazy | DAEMON_LAZY_KEY_TAG), digest, &retired);
+        } else {
+            daemon_key_dir_set(*dir, key_index, (void *)((uintptr_t)lazy | DAEMON_LAZY_KEY_TAG));
+        }
+    }
+    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    if (retired != NULL || entry != NULL) {
+        daemon_keys_synchronize();
+        free(retired);
+        if (entry != NULL)
+            daemon_key_free(type, entry);
+    }
+
+    /* respond with the public key, in the same form as for the keys being loaded */
+    if (daemon_push_public_key(&res, key_index, pubkey, errbuf) != 0)
+        goto Error;
+    goto Exit;
+
+Error:
+    daemon_push_load_error(&res, errbuf);
+Exit:
+    if (pem != NULL) {
+        OPENSSL_cleanse(pem, pem_len);
+        free(pem);
     }
-    if ((ec_key = daemon_get_ecdsa(key_index)) == NULL) {
+    if (pubkey != NULL)
+        EVP_PKEY_free(pubkey);
+    expbuf_dispose(buf);
+    *buf = res;
+    return 0;
+}
+
+/**
+ * loads the private key stored in the file as the replacement of the key at `cmd->key_index`, responding in the same form as for the
+ * keys being loaded. The request carries the type of the key being replaced and its size (the modulus size for RSA, the curve for
+ * ECDSA, the algorithm for EdDSA), which the new key is required to match.
+ */
+static int replace_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    struct expbuf_t res = {NULL};
+    size_t type, size, key_index;
+    EVP_PKEY *pkey = NULL;
+    BIGNUM *e = NULL;
+    void *key = NULL;
+    char *e_hex, *fn, errbuf[NEVERBLEED_ERRBUF_SIZE] = "";
+    int in_use;
+
+    if (expbuf_shift_num(buf, &type) != 0 || expbuf_shift_num(buf, &size) != 0 ||
+        (type == NEVERBLEED_TYPE_RSA && ((e_hex = expbuf_shift_str(buf)) == NULL || BN_hex2bn(&e, e_hex) == 0)) ||
+        (fn = expbuf_shift_str(buf)) == NULL) {
         errno = 0;
-        warnf("%s: invalid key index:%zu", __FUNCTION__, key_index);
+        warnf("%s: failed to parse request", __FUNCTION__);
+        BN_free(e);
         return -1;
     }
 
-    ret = ECDSA_sign((int)type, m, (unsigned)m_len, sigret, &siglen, ec_key);
+    if ((pkey = daemon_read_private_key(fn, errbuf)) == NULL)
+        goto Error;
+    switch (EVP_PKEY_base_id(pkey)) {
+    case EVP_PKEY_RSA:
+        if (type == NEVERBLEED_TYPE_RSA && (size_t)RSA_size(EVP_PKEY_get0_RSA(pkey)) == size) {
+            const BIGNUM *new_e;
+            RSA_get0_key(EVP_PKEY_get0_RSA(pkey), NULL, &new_e, NULL);
+            if (BN_cmp(new_e, e) == 0)
+                key = EVP_PKEY_get1_RSA(pkey);
+        }
+        break;
+#ifdef NEVERBLEED_ECDSA
+    case EVP_PKEY_EC:
+        if (type == NEVERBLEED_TYPE_ECDSA && (size_t)EC_GROUP_get_curve_name(EC_KEY_get0_group(EVP_PKEY_get0_EC_KEY(pkey))) == size)
+            key = EVP_PKEY_get1_EC_KEY(pkey);
+        break;
+#endif
+#ifdef NEVERBLEED_EDDSA
+    case EVP_PKEY_ED25519:
+    case EVP_PKEY_ED448:
+        if (type == NEVERBLEED_TYPE_EDDSA && (size_t)EVP_PKEY_base_id(pkey) == size) {
+            EVP_PKEY_up_ref(pkey);
+            key = pkey;
+        }
+        break;
+#endif
+    default:
+        break;
+    }
+    if (key == NULL) {
+        snprintf(errbuf, sizeof(errbuf),
+                 "the new key must be of the same type, size and public exponent as the key being replaced");
+        goto Error;
+    }
+    pthread_mutex_lock(&daemon_vars.keys.lock);
+    in_use = key_slots_in_use(daemon_keys_slots((enum neverbleed_type)type), cmd->key_index);
+    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    if (!in_use) {
+        daemon_key_free((enum neverbleed_type)type, key);
+        snprintf(errbuf, sizeof(errbuf), "the key being replaced is not loaded");
+        goto Error;
+    }
+    /* the key being replaced is left intact for the objects still referring to it; they release it as they are freed */
+    key_index = daemon_set_key((enum neverbleed_type)type, key);
+    daemon_key_free((enum neverbleed_type)type, key);
+    if (daemon_push_public_key(&res, key_index, pkey, errbuf) != 0)
+        goto Error;
+    goto Exit;
+
+Error:
+    daemon_push_load_error(&res, errbuf);
+Exit:
+    if (pkey != NULL)
+        EVP_PKEY_free(pkey);
+    BN_free(e);
     expbuf_dispose(buf);
+    *buf = res;
+    return 0;
+}
 
-    EC_KEY_free(ec_key);
+int neverbleed_get_stats(neverbleed_t *nb, neverbleed_stats_t *stats)
+{
+    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
+    size_t daemon, i;
+
+    memset(stats, 0, sizeof(*stats));
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        struct expbuf_t buf = {NULL};
+        uint64_t *src, *dst = (uint64_t *)stats;
+        size_t len;
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_STATS, 0, 0, NULL, 0);
+        neverbleed_transaction(thdata, daemon, &buf);
+        if ((src = expbuf_shift_bytes(&buf, &len)) == NULL || len != sizeof(*stats)) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        /* all the counters and the buckets of the histograms are uint64_t, and are summed up */
+        for (i = 0; i != sizeof(*stats) / sizeof(uint64_t); ++i) {
+            uint64_t v;
+            memcpy(&v, src + i, sizeof(v));
+            dst[i] += v;
+        }
+        expbuf_dispose(&buf);
+    }
 
-    expbuf_push_num(buf, ret);
-    expbuf_push_bytes(buf, sigret, ret == 1 ? siglen : 0);
+    return 0;
+}
+
+static int stats_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    neverbleed_stats_t *stats;
+
+    if ((stats = malloc(sizeof(*stats))) == NULL)
+        dief("no memory");
+    daemon_stats_collect(stats);
+    expbuf_clear(buf);
+    expbuf_push_bytes(buf, stats, sizeof(*stats));
+    free(stats);
 
     return 0;
 }
 
-static void ecdsa_get_privsep_data(const EC_KEY *ec_key, struct st_neverbleed_rsa_exdata_t **exdata,
-                                   struct st_neverbleed_thread_data_t **thdata)
+int neverbleed_setuidgid(neverbleed_t *nb, const char *user, int change_socket_ownership)
 {
-    *exdata = EC_KEY_get_ex_data(ec_key, 0);
-    if (*exdata == NULL) {
+    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
+    size_t daemon, ret;
+    int result = 0;
+
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        struct expbuf_t buf = {NULL};
+        expbuf_push_cmd(&buf, NEVERBLEED_OP_SETUIDGID, 0, change_socket_ownership, user, strlen(user) + 1);
+        neverbleed_transaction(thdata, daemon, &buf);
+        if (expbuf_shift_num(&buf, &ret) != 0) {
+            errno = 0;
+            dief("failed to parse response");
+        }
+        expbuf_dispose(&buf);
+        if ((int)ret != 0)
+            result = (int)ret;
+    }
+
+    return result;
+}
+
+static int setuidgid_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    const char *user;
+    int change_socket_ownership = cmd->arg;
+    struct passwd pwbuf, *pw;
+    char pwstrbuf[65536]; /* should be large enough */
+    int ret = -1;
+
+    if ((user = expbuf_shift_cmd_str(buf)) == NULL) {
         errno = 0;
-        dief("invalid internal ref");
+        warnf("%s: failed to parse request", __FUNCTION__);
+        return -1;
     }
-    *thdata = get_thread_data((*exdata)->nb);
+
+    errno = 0;
+    if (getpwnam_r(user, &pwbuf, pwstrbuf, sizeof(pwstrbuf), &pw) != 0) {
+        warnf("%s: getpwnam_r failed", __FUNCTION__);
+        goto Respond;
+    }
+    if (pw == NULL) {
+        warnf("%s: failed to obtain information of user:%s", __FUNCTION__, user);
+        goto Respond;
+    }
+
+    if (change_socket_ownership) {
+        char *dir;
+        if (chown(daemon_vars.nb->sun_.sun_path, pw->pw_uid, pw->pw_gid) != 0)
+            dief("chown failed for:%s", daemon_vars.nb->sun_.sun_path);
+        dir = dirname(daemon_vars.nb->sun_.sun_path);
+        if (chown(dir, pw->pw_uid, pw->pw_gid) != 0)
+            dief("chown failed for:%s", dir);
+        free(dir);
+    }
+
+    /* setuidgid */
+    if (setgid(pw->pw_gid) != 0) {
+        warnf("%s: setgid(%d) failed", __FUNCTION__, (int)pw->pw_gid);
+        goto Respond;
+    }
+    if (initgroups(pw->pw_name, pw->pw_gid) != 0) {
+        warnf("%s: initgroups(%s, %d) failed", __FUNCTION__, pw->pw_name, (int)pw->pw_gid);
+        goto Respond;
+    }
+    if (setuid(pw->pw_uid) != 0) {
+        warnf("%s: setuid(%d) failed\n", __FUNCTION__, (int)pw->pw_uid);
+        goto Respond;
+    }
+    ret = 0;
+
+Respond:
+    expbuf_clear(buf);
+    expbuf_push_num(buf, ret);
+    return 0;
 }
 
-static int ecdsa_sign_proxy(int type, const unsigned char *m, int m_len, unsigned char *_sigret, unsigned int *_siglen,
-                            const BIGNUM *kinv, const BIGNUM *rp, EC_KEY *ec_key)
+__attribute__((noreturn)) static void *daemon_close_notify_thread(void *_close_notify_fd)
+{
+    int close_notify_fd = (int)((char *)_close_notify_fd - (char *)NULL);
+    char b;
+    ssize_t r;
+
+Redo:
+    r = read(close_notify_fd, &b, 1);
+    if (r == -1 && errno == EINTR)
+        goto Redo;
+    if (r > 0)
+        goto Redo;
+    /* close or error */
+
+    /* unlink the temporary directory and socket file */
+    unlink_dir(dirname(daemon_vars.nb->sun_.sun_path));
+
+    _exit(0);
+}
+
+static int priv_rsa_finish(RSA *rsa)
 {
     struct st_neverbleed_rsa_exdata_t *exdata;
     struct st_neverbleed_thread_data_t *thdata;
-    struct expbuf_t buf = {};
-    size_t ret, siglen;
-    unsigned char *sigret;
 
-    ecdsa_get_privsep_data(ec_key, &exdata, &thdata);
+    get_privsep_data(rsa, &exdata, &thdata);
+    return release_exdata(thdata, exdata, NEVERBLEED_OP_DEL_RSA_KEY);
+}
 
-    /* as far as I've tested so far, kinv and rp are always NULL.
-       Looks like setup_sign will precompute this, but it is only
-       called sign_sig, and it seems to be not used in TLS ECDSA */
-    if (kinv != NULL || rp != NULL) {
+static int del_rsa_key_stub(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf)
+{
+    int ret = daemon_del_key(NEVERBLEED_TYPE_RSA, cmd->key_index);
+
+    expbuf_clear(buf);
+    expbuf_push_num(buf, ret);
+    return 0;
+}
+
+static int (*const daemon_handlers[NEVERBLEED_OP_NUM])(struct st_neverbleed_cmd_t *cmd, struct expbuf_t *buf) = {
+    [NEVERBLEED_OP_PRIV_ENC] = priv_enc_stub,
+    [NEVERBLEED_OP_PRIV_DEC] = priv_dec_stub,
+    [NEVERBLEED_OP_SIGN] = sign_stub,
+#ifdef NEVERBLEED_ECDSA
+    [NEVERBLEED_OP_ECDSA_SIGN] = ecdsa_sign_stub,
+    [NEVERBLEED_OP_DEL_ECDSA_KEY] = del_ecdsa_key_stub,
+#endif
+    [NEVERBLEED_OP_LOAD_KEY] = load_key_stub,
+    [NEVERBLEED_OP_DEL_RSA_KEY] = del_rsa_key_stub,
+    [NEVERBLEED_OP_SETUIDGID] = setuidgid_stub,
+    [NEVERBLEED_OP_SIGN_BATCH] = sign_batch_stub,
+    [NEVERBLEED_OP_STATS] = stats_stub,
+    [NEVERBLEED_OP_LOAD_KEYS] = load_keys_stub,
+    [NEVERBLEED_OP_REGISTER_KEY] = register_key_stub,
+    [NEVERBLEED_OP_REPLACE_KEY] = replace_key_stub,
+#ifdef NEVERBLEED_EDDSA
+    [NEVERBLEED_OP_EDDSA_SIGN] = eddsa_sign_stub,
+    [NEVERBLEED_OP_DEL_EDDSA_KEY] = del_eddsa_key_stub,
+#endif
+};
+
+/**
+ * processes a request, replacing the content of `buf` with the response. Returns -1 if the connection should be closed.
+ */
+static int daemon_handle_request(struct expbuf_t *buf, uint64_t received_at)
+{
+    struct st_neverbleed_cmd_t cmd;
+    uint64_t started_at = now_nsec();
+    int ret;
+
+    if (expbuf_size(buf) < sizeof(cmd)) {
         errno = 0;
-        dief("unexpected non-NULL kinv and rp");
+        warnf("failed to parse request");
+        return -1;
+    }
+    memcpy(&cmd, buf->start, sizeof(cmd));
+    buf->start += sizeof(cmd);
+    if (cmd.payload_len != expbuf_size(buf)) {
+        errno = 0;
+        warnf("failed to parse request");
+        return -1;
+    }
+    if (cmd.opcode >= NEVERBLEED_OP_NUM || daemon_handlers[cmd.opcode] == NULL) {
+        errno = 0;
+        warnf("unknown opcode:%d", (int)cmd.opcode);
+        return -1;
     }
 
-    expbuf_push_str(&buf, "ecdsa_sign");
-    expbuf_push_num(&buf, type);
-    expbuf_push_bytes(&buf, m, m_len);
-    expbuf_push_num(&buf, exdata->key_index);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+    ret = daemon_handlers[cmd.opcode](&cmd, buf);
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0 || (sigret = expbuf_shift_bytes(&buf, &siglen)) == NULL) {
-        errno = 0;
-        dief("failed to parse response");
+    { /* update the counters of the operation */
+        neverbleed_stats_t *stats = daemon_stats();
+        uint64_t now = now_nsec();
+        ++stats->ops[cmd.opcode].requests;
+        stats->ops[cmd.opcode].bytes_received += cmd.payload_len;
+        if (ret == 0) {
+            stats->ops[cmd.opcode].bytes_sent += expbuf_size(buf);
+        } else {
+            ++stats->ops[cmd.opcode].errors;
+        }
+        ++stats->ops[cmd.opcode].queue_time.buckets[histogram_index(started_at - received_at)];
+        ++stats->ops[cmd.opcode].crypto_time.buckets[histogram_index(now - started_at)];
     }
-    memcpy(_sigret, sigret, siglen);
-    *_siglen = (unsigned)siglen;
-    expbuf_dispose(&buf);
 
-    return (int)ret;
+    return ret;
 }
 
-static EVP_PKEY *ecdsa_create_pkey(neverbleed_t *nb, size_t key_index, int curve_name, const char *ec_pubkeybuf)
+static struct daemon_conn_t *daemon_conn_new(int fd)
 {
-    struct st_neverbleed_rsa_exdata_t *exdata;
-    EC_KEY *ec_key;
-    EC_GROUP *ec_group;
-    BIGNUM *ec_pubkeybn = NULL;
-    EC_POINT *ec_pubkey;
-    EVP_PKEY *pkey;
+    struct daemon_conn_t *conn;
 
-    if ((exdata = malloc(sizeof(*exdata))) == NULL) {
-        fprintf(stderr, "no memory\n");
-        abort();
-    }
-    exdata->nb = nb;
-    exdata->key_index = key_index;
+    if ((conn = malloc(sizeof(*conn))) == NULL)
+        dief("no memory");
+    conn->fd = fd;
+    pthread_mutex_init(&conn->mutex, NULL);
+    conn->refcnt = 1;
+    memset(&conn->rbuf, 0, sizeof(conn->rbuf));
+    conn->established = 0;
+    conn->shm = NULL;
+    conn->sq_efd = -1;
+    conn->cq_efd = -1;
+#ifdef NEVERBLEED_EPOLL
+    conn->closed = 0;
+    memset(&conn->wbuf, 0, sizeof(conn->wbuf));
+    conn->write_ev.fd = -1;
+    conn->read_paused = 0;
+#endif
 
-    ec_key = EC_KEY_new_method(nb->engine);
-    EC_KEY_set_ex_data(ec_key, 0, exdata);
+    return conn;
+}
 
-    ec_group = EC_GROUP_new_by_curve_name(curve_name);
-    if (!ec_group) {
-        fprintf(stderr, "could not create EC_GROUP\n");
-        abort();
+static void daemon_conn_release(struct daemon_conn_t *conn)
+{
+    size_t refcnt;
+
+    pthread_mutex_lock(&conn->mutex);
+    refcnt = --conn->refcnt;
+    pthread_mutex_unlock(&conn->mutex);
+
+    if (refcnt == 0) {
+        close(conn->fd);
+#ifdef NEVERBLEED_SHM_RING
+        if (conn->shm != NULL) {
+            munmap(conn->shm, sizeof(*conn->shm));
+            close(conn->sq_efd);
+            close(conn->cq_efd);
+        }
+#endif
+#ifdef NEVERBLEED_EPOLL
+        if (conn->write_ev.fd != -1)
+            close(conn->write_ev.fd);
+        expbuf_dispose(&conn->wbuf);
+#endif
+        expbuf_dispose(&conn->rbuf);
+        pthread_mutex_destroy(&conn->mutex);
+        free(conn);
     }
+}
 
-    EC_KEY_set_group(ec_key, ec_group);
+#ifdef NEVERBLEED_EPOLL
+static int daemon_conn_send(struct daemon_conn_t *conn, size_t id, struct expbuf_t *buf);
+#endif
 
-    if (BN_hex2bn(&ec_pubkeybn, ec_pubkeybuf) == 0) {
-        fprintf(stderr, "failed to parse ECDSA ephemeral public key:%s\n", ec_pubkeybuf);
-        abort();
-    }
+static void daemon_run_job(struct daemon_job_t *job)
+{
+    struct daemon_conn_t *conn = job->conn;
+    int sent = 0;
 
-    if ((ec_pubkey = EC_POINT_bn2point(ec_group, ec_pubkeybn, NULL, NULL)) == NULL) {
-        fprintf(stderr, "failed to get ECDSA ephemeral public key from BIGNUM\n");
-        abort();
+    if (job->batch != NULL) {
+        daemon_batch_help(job);
+        return;
     }
 
-    EC_KEY_set_public_key(ec_key, ec_pubkey);
+    if (daemon_worker != NULL)
+        __atomic_store_n(&daemon_worker->busy_since, now_nsec(), __ATOMIC_RELAXED);
 
-    pkey = EVP_PKEY_new();
-    EVP_PKEY_set1_EC_KEY(pkey, ec_key);
+    if (daemon_handle_request(&job->buf, job->received_at) == 0) {
+        pthread_mutex_lock(&conn->mutex);
+#ifdef NEVERBLEED_SHM_RING
+        /* responses that do not fit in the ring are sent through the socket */
+        if (job->via_ring && ring_push(&conn->shm->cq, job->id, &job->buf) == 0)
+            sent = 1;
+#endif
+#ifdef NEVERBLEED_EPOLL
+        if (!sent && daemon_conn_send(conn, job->id, &job->buf) != 0) {
+#else
+        if (!sent && expbuf_write(&job->buf, job->id, conn->fd) != 0) {
+#endif
+            warnf(errno != 0 ? "write error" : "connection closed by client");
+            shutdown(conn->fd, SHUT_RDWR);
+        }
+#ifdef NEVERBLEED_SHM_RING
+        /* the client might be sleeping on the eventfd, regardless of how the response has been sent */
+        if (conn->shm != NULL && ring_need_wakeup(&conn->shm->cq))
+            efd_notify(conn->cq_efd);
+#endif
+        pthread_mutex_unlock(&conn->mutex);
+    } else {
+        /* let the reader notice the error and close the connection */
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if (daemon_worker != NULL)
+        __atomic_store_n(&daemon_worker->busy_since, 0, __ATOMIC_RELAXED);
+    daemon_conn_release(conn);
+    daemon_job_free(job);
+}
 
-    EC_POINT_free(ec_pubkey);
-    BN_free(ec_pubkeybn);
-    EC_GROUP_free(ec_group);
-    EC_KEY_free(ec_key);
+/**
+ * called by a worker thread when key affinity is enabled. On Linux, the worker is bound to one of the CPUs that the daemon may
+ * run on.
+ */
+static void daemon_worker_setup(struct daemon_worker_t *worker)
+{
+    daemon_worker = worker;
+    worker->tid = pthread_self();
+#ifdef __linux__
+    cpu_set_t allowed, cpus;
+    size_t num_cpus, cpu, nth;
 
-    return pkey;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 || (num_cpus = (size_t)CPU_COUNT(&allowed)) == 0)
+        return;
+    nth = worker->index % num_cpus;
+    for (cpu = 0; !(CPU_ISSET(cpu, &allowed) && nth-- == 0); ++cpu)
+        ;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    if (pthread_setaffinity_np(worker->tid, sizeof(cpus), &cpus) != 0)
+        warnf("failed to bind worker %zu to CPU %zu", worker->index, cpu);
+#endif
 }
 
-static void priv_ecdsa_finish(EC_KEY *key)
-{
-    struct st_neverbleed_rsa_exdata_t *exdata;
-    struct st_neverbleed_thread_data_t *thdata;
+#ifdef NEVERBLEED_EPOLL
 
-    ecdsa_get_privsep_data(key, &exdata, &thdata);
+static void daemon_epoll_arm_events(int op, struct daemon_event_t *ev, uint32_t events)
+{
+    struct epoll_event e = {events | EPOLLONESHOT};
 
-    struct expbuf_t buf = {NULL};
-    size_t ret;
+    e.data.ptr = ev;
+    if (epoll_ctl(daemon_vars.epoll_fd, op, ev->fd, &e) != 0)
+        dief("epoll_ctl failed");
+}
 
-    expbuf_push_str(&buf, "del_ecdsa_key");
-    expbuf_push_num(&buf, exdata->key_index);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+static void daemon_epoll_arm(int op, struct daemon_event_t *ev)
+{
+    daemon_epoll_arm_events(op, ev, EPOLLIN);
+}
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0) {
-        errno = 0;
-        dief("failed to parse response");
-    }
-    expbuf_dispose(&buf);
+static void daemon_on_jobs(struct daemon_event_t *ev)
+{
+    struct daemon_job_t *job;
+
+    pthread_mutex_lock(&daemon_vars.jobs.lock);
+    if ((job = daemon_vars.jobs.first) != NULL && (daemon_vars.jobs.first = job->next) == NULL)
+        daemon_vars.jobs.tail = &daemon_vars.jobs.first;
+    if (daemon_vars.jobs.first == NULL)
+        efd_clear(ev->fd);
+    pthread_mutex_unlock(&daemon_vars.jobs.lock);
+
+    /* if more jobs are queued, the eventfd is still readable, and therefore another worker picks up the next one */
+    daemon_epoll_arm(EPOLL_CTL_MOD, ev);
+    if (job != NULL)
+        daemon_run_job(job);
 }
 
-static int del_ecdsa_key_stub(struct expbuf_t *buf)
+static void daemon_enqueue_job(struct daemon_job_t *job)
 {
-    size_t key_index;
-    int ret = 0;
+    pthread_mutex_lock(&daemon_vars.jobs.lock);
+    job->next = NULL;
+    if (daemon_vars.jobs.first == NULL)
+        efd_notify(daemon_vars.jobs.ev.fd);
+    *daemon_vars.jobs.tail = job;
+    daemon_vars.jobs.tail = &job->next;
+    pthread_mutex_unlock(&daemon_vars.jobs.lock);
+}
 
-    if (expbuf_shift_num(buf, &key_index) != 0) {
-        errno = 0;
-        warnf("%s: failed to parse request", __FUNCTION__);
-        return -1;
-    }
+#else
 
-    if (!daemon_vars.keys.ecdsa_keys || key_index >= daemon_vars.keys.ecdsa_slots.reserved_size) {
-        errno = 0;
-        warnf("%s: invalid key index %zu", __FUNCTION__, key_index);
-        goto respond;
-    }
+static struct daemon_job_t *daemon_worker_dequeue(struct daemon_worker_t *worker);
+static struct daemon_job_t *daemon_worker_steal(void);
 
-    if (BITCHECK(daemon_vars.keys.ecdsa_slots.bita_avail, key_index)) {
-        warnf("%s: index not in use %zu", __FUNCTION__, key_index);
-        goto respond;
-    }
+__attribute__((noreturn)) static void *daemon_worker_thread(void *_worker)
+{
+    struct daemon_worker_t *worker = _worker;
+    struct daemon_job_t *job;
 
-    pthread_mutex_lock(&daemon_vars.keys.lock);
-    /* set slot as available */
-    BITSET(daemon_vars.keys.ecdsa_slots.bita_avail, key_index);
-    daemon_vars.keys.ecdsa_slots.size--;
-    EC_KEY_free(daemon_vars.keys.ecdsa_keys[key_index]);
-    daemon_vars.keys.ecdsa_keys[key_index] = NULL;
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
+    if (worker != NULL)
+        daemon_worker_setup(worker);
+
+    while (1) {
+        pthread_mutex_lock(&daemon_vars.jobs.lock);
+        while (1) {
+            /* the jobs queued to the worker take precedence, followed by those left behind by the stalled workers */
+            if (worker != NULL && ((job = daemon_worker_dequeue(worker)) != NULL || (job = daemon_worker_steal()) != NULL))
+                break;
+            if ((job = daemon_vars.jobs.first) != NULL) {
+                if ((daemon_vars.jobs.first = job->next) == NULL)
+                    daemon_vars.jobs.tail = &daemon_vars.jobs.first;
+                break;
+            }
+            if (worker != NULL)
+                worker->sleeping = 1;
+            if (worker != NULL && daemon_vars.affinity.num_queued != 0) {
+                struct timespec deadline;
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                if ((deadline.tv_nsec += NEVERBLEED_AFFINITY_STALL_NSEC) >= 1000000000) {
+                    deadline.tv_nsec -= 1000000000;
+                    ++deadline.tv_sec;
+                }
+                pthread_cond_timedwait(&daemon_vars.jobs.cond, &daemon_vars.jobs.lock, &deadline);
+            } else {
+                pthread_cond_wait(&daemon_vars.jobs.cond, &daemon_vars.jobs.lock);
+            }
+        }
+        if (worker != NULL)
+            worker->sleeping = 0;
+        pthread_mutex_unlock(&daemon_vars.jobs.lock);
 
-    ret = 1;
+        daemon_run_job(job);
+    }
+}
 
-respond:
-    expbuf_dispose(buf);
-    expbuf_push_num(buf, ret);
-    return 0;
+static void daemon_enqueue_job(struct daemon_job_t *job)
+{
+    pthread_mutex_lock(&daemon_vars.jobs.lock);
+    job->next = NULL;
+    *daemon_vars.jobs.tail = job;
+    daemon_vars.jobs.tail = &job->next;
+    pthread_cond_signal(&daemon_vars.jobs.cond);
+    pthread_mutex_unlock(&daemon_vars.jobs.lock);
 }
 
 #endif
 
-int neverbleed_load_private_key_file(neverbleed_t *nb, SSL_CTX *ctx, const char *fn, char *errbuf)
+/**
+ * returns the worker with the least load, halving the loads if a second has passed since they were last halved
+ */
+static struct daemon_worker_t *daemon_affinity_least_loaded(void)
 {
-    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
-    struct expbuf_t buf = {NULL};
-    int ret = 1;
-    size_t index, type;
-    EVP_PKEY *pkey;
-
-    expbuf_push_str(&buf, "load_key");
-    expbuf_push_str(&buf, fn);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
-
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &type) != 0 || expbuf_shift_num(&buf, &index) != 0) {
-        errno = 0;
-        dief("failed to parse response");
+    uint64_t now = now_nsec() / 1000000000, decayed_at, load, least_load = UINT64_MAX;
+    struct daemon_worker_t *worker, *least = NULL;
+    size_t i;
+
+    decayed_at = __atomic_exchange_n(&daemon_vars.affinity.decayed_at, now, __ATOMIC_RELAXED);
+    for (i = 0; i != daemon_vars.num_workers; ++i) {
+        worker = daemon_vars.affinity.workers + i;
+        load = __atomic_load_n(&worker->load, __ATOMIC_RELAXED);
+        if (now > decayed_at) {
+            load >>= now - decayed_at < 64 ? now - decayed_at : 63;
+            __atomic_store_n(&worker->load, load, __ATOMIC_RELAXED);
+        }
+        if (load < least_load) {
+            least = worker;
+            least_load = load;
+        }
     }
 
-    switch (type) {
-    case NEVERBLEED_TYPE_RSA: {
-        char *estr, *nstr;
+    return least;
+}
 
-        if ((estr = expbuf_shift_str(&buf)) == NULL || (nstr = expbuf_shift_str(&buf)) == NULL) {
-            errno = 0;
-            dief("failed to parse response");
-        }
-        pkey = create_pkey(nb, index, estr, nstr);
+/**
+ * returns the home worker of the key used by the request, assigning one if necessary, or NULL if the request is not a private key
+ * operation using a single key or if key affinity is disabled
+ */
+static struct daemon_worker_t *daemon_affinity_home(struct daemon_job_t *job)
+{
+    struct st_neverbleed_cmd_t cmd;
+    struct daemon_worker_t *home;
+    uint64_t *entry, v;
+
+    if (daemon_vars.affinity.workers == NULL || job->batch != NULL || expbuf_size(&job->buf) < sizeof(cmd))
+        return NULL;
+    memcpy(&cmd, job->buf.start, sizeof(cmd));
+    switch (cmd.opcode) {
+    case NEVERBLEED_OP_PRIV_ENC:
+    case NEVERBLEED_OP_PRIV_DEC:
+    case NEVERBLEED_OP_SIGN:
+        entry = daemon_vars.affinity.homes + (cmd.key_index * 3) % NEVERBLEED_AFFINITY_TABLE_SIZE;
+        break;
+    case NEVERBLEED_OP_ECDSA_SIGN:
+        entry = daemon_vars.affinity.homes + (cmd.key_index * 3 + 1) % NEVERBLEED_AFFINITY_TABLE_SIZE;
         break;
+    case NEVERBLEED_OP_EDDSA_SIGN:
+        entry = daemon_vars.affinity.homes + (cmd.key_index * 3 + 2) % NEVERBLEED_AFFINITY_TABLE_SIZE;
+        break;
+    default:
+        return NULL;
     }
-#ifdef NEVERBLEED_ECDSA
-    case NEVERBLEED_TYPE_ECDSA: {
-        char *ec_pubkeystr;
-        size_t curve_name;
 
-        if (expbuf_shift_num(&buf, &curve_name) != 0 || (ec_pubkeystr = expbuf_shift_str(&buf)) == NULL) {
-            errno = 0;
-            dief("failed to parse response");
-        }
-        pkey = ecdsa_create_pkey(nb, index, (int)curve_name, ec_pubkeystr);
-        break;
+    if ((v = __atomic_load_n(entry, __ATOMIC_RELAXED)) >> 32 == cmd.key_index && (uint32_t)v != 0) {
+        home = daemon_vars.affinity.workers + (uint32_t)v - 1;
+    } else {
+        home = daemon_affinity_least_loaded();
+        __atomic_store_n(entry, (uint64_t)cmd.key_index << 32 | (home->index + 1), __ATOMIC_RELAXED);
     }
-#endif
-    default: {
-        char *errstr;
+    __atomic_add_fetch(&home->load, 1, __ATOMIC_RELAXED);
 
-        if ((errstr = expbuf_shift_str(&buf)) == NULL) {
-            errno = 0;
-            dief("failed to parse response");
-        }
+    return home;
+}
 
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "%s", errstr);
-        return -1;
-    }
-    }
+/**
+ * queues the job to the worker, unless the worker already has `NEVERBLEED_AFFINITY_MAX_QUEUED` jobs queued or is stalled, in which
+ * case returns zero. If `if_sleeping` is set, the job is queued only if the worker is waiting for something to do.
+ */
+static int daemon_worker_enqueue(struct daemon_worker_t *worker, struct daemon_job_t *job, int if_sleeping)
+{
+    uint64_t busy_since = __atomic_load_n(&worker->busy_since, __ATOMIC_RELAXED);
 
-    expbuf_dispose(&buf);
+    if (busy_since != 0 && now_nsec() - busy_since > NEVERBLEED_AFFINITY_STALL_NSEC)
+        return 0;
 
-    /* success */
-    if (SSL_CTX_use_PrivateKey(ctx, pkey) != 1) {
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "SSL_CTX_use_PrivateKey failed");
-        ret = 0;
+    pthread_mutex_lock(&daemon_vars.jobs.lock);
+    if (if_sleeping ? !worker->sleeping : worker->num_queued >= NEVERBLEED_AFFINITY_MAX_QUEUED) {
+        pthread_mutex_unlock(&daemon_vars.jobs.lock);
+        return 0;
     }
+    job->next = NULL;
+    *worker->tail = job;
+    worker->tail = &job->next;
+    ++worker->num_queued;
+    ++daemon_vars.affinity.num_queued;
+#ifdef NEVERBLEED_EPOLL
+    if (worker->sleeping) {
+        worker->sleeping = 0;
+        pthread_kill(worker->tid, NEVERBLEED_WAKEUP_SIGNAL);
+    }
+#else
+    pthread_cond_broadcast(&daemon_vars.jobs.cond);
+#endif
+    pthread_mutex_unlock(&daemon_vars.jobs.lock);
 
-    EVP_PKEY_free(pkey);
-    return ret;
+    return 1;
 }
 
-static int load_key_stub(struct expbuf_t *buf)
+/**
+ * removes the first job queued to the worker; must be called while holding `daemon_vars.jobs.lock`
+ */
+static struct daemon_job_t *daemon_worker_dequeue(struct daemon_worker_t *worker)
 {
-    char *fn;
-    FILE *fp = NULL;
-    RSA *rsa = NULL;
-    size_t key_index = SIZE_MAX;
-    char *estr = NULL, *nstr = NULL, errbuf[NEVERBLEED_ERRBUF_SIZE] = "";
-    size_t type = NEVERBLEED_TYPE_ERROR;
-    EVP_PKEY *pkey = NULL;
-#ifdef NEVERBLEED_ECDSA
-    const EC_GROUP *ec_group;
-    BIGNUM *ec_pubkeybn = NULL;
-    char *ec_pubkeystr = NULL;
-#endif
+    struct daemon_job_t *job;
 
-    if ((fn = expbuf_shift_str(buf)) == NULL) {
-        warnf("%s: failed to parse request", __FUNCTION__);
-        return -1;
+    if ((job = worker->first) != NULL) {
+        if ((worker->first = job->next) == NULL)
+            worker->tail = &worker->first;
+        --worker->num_queued;
+        --daemon_vars.affinity.num_queued;
     }
 
-    if ((fp = fopen(fn, "rt")) == NULL) {
-        strerror_r(errno, errbuf, sizeof(errbuf));
-        goto Respond;
-    }
+    return job;
+}
 
-    if ((pkey = PEM_read_PrivateKey(fp, NULL, NULL, NULL)) == NULL) {
-        snprintf(errbuf, sizeof(errbuf), "failed to parse the private key");
-        goto Respond;
-    }
+/**
+ * removes a job that has been waiting for longer than `NEVERBLEED_AFFINITY_STALL_NSEC` in the queue of some worker, which might be
+ * stalled. Must be called while holding `daemon_vars.jobs.lock`.
+ */
+static struct daemon_job_t *daemon_worker_steal(void)
+{
+    uint64_t now;
+    size_t i;
 
-    switch (EVP_PKEY_base_id(pkey)) {
-    case EVP_PKEY_RSA: {
-        const BIGNUM *e, *n;
+    if (daemon_vars.affinity.num_queued == 0)
+        return NULL;
 
-        rsa = EVP_PKEY_get1_RSA(pkey);
-        type = NEVERBLEED_TYPE_RSA;
-        key_index = daemon_set_rsa(rsa);
-        RSA_get0_key(rsa, &n, &e, NULL);
-        estr = BN_bn2hex(e);
-        nstr = BN_bn2hex(n);
-        break;
+    now = now_nsec();
+    for (i = 0; i != daemon_vars.num_workers; ++i) {
+        struct daemon_worker_t *worker = daemon_vars.affinity.workers + i;
+        if (worker->first != NULL && now - worker->first->received_at > NEVERBLEED_AFFINITY_STALL_NSEC)
+            return daemon_worker_dequeue(worker);
     }
-    case EVP_PKEY_EC: {
-#ifdef NEVERBLEED_ECDSA
-        const EC_POINT *ec_pubkey;
-        EC_KEY *ec_key;
 
-        ec_key = (EC_KEY *)EVP_PKEY_get0_EC_KEY(pkey);
-        type = NEVERBLEED_TYPE_ECDSA;
-        key_index = daemon_set_ecdsa(ec_key);
-        ec_group = EC_KEY_get0_group(ec_key);
-        ec_pubkey = EC_KEY_get0_public_key(ec_key);
-        ec_pubkeybn = BN_new();
-        if (!EC_POINT_point2bn(ec_group, ec_pubkey, POINT_CONVERSION_COMPRESSED, ec_pubkeybn, NULL)) {
-            type = NEVERBLEED_TYPE_ERROR;
-            snprintf(errbuf, sizeof(errbuf), "failed to convert ECDSA public key to BIGNUM");
-            goto Respond;
-        }
-        ec_pubkeystr = BN_bn2hex(ec_pubkeybn);
-        break;
-#else
-        snprintf(errbuf, sizeof(errbuf), "ECDSA support requires OpenSSL >= 1.1.0 or LibreSSL >= 2.9.1");
-        goto Respond;
-#endif
-    }
-    default:
-        snprintf(errbuf, sizeof(errbuf), "unsupported private key: %d", EVP_PKEY_base_id(pkey));
-        goto Respond;
+    return NULL;
+}
+
+/**
+ * queues the jobs so that the workers process them concurrently, except for the last one, which is run by the calling thread.
+ * When key affinity is enabled, the private key operations are queued to the home workers of the keys. The last one is handed to
+ * the home only if the home is sleeping; otherwise, the request could wait behind the jobs of a connection whose writes are
+ * blocked, while the calling thread is free to run it.
+ */
+static void daemon_run_jobs(struct daemon_job_t *jobs)
+{
+    struct daemon_job_t *job;
+    struct daemon_worker_t *home;
+
+    while ((job = jobs) != NULL) {
+        jobs = job->next;
+        if ((home = daemon_affinity_home(job)) != NULL) {
+            if (home == daemon_worker && jobs == NULL) {
+                ++daemon_stats()->affinity_routed;
+            } else if (daemon_worker_enqueue(home, job, jobs == NULL)) {
+                ++daemon_stats()->affinity_routed;
+                continue;
+            } else {
+                ++daemon_stats()->affinity_spilled;
+            }
+        }
+        if (jobs != NULL) {
+            daemon_enqueue_job(job);
+        } else {
+            daemon_run_job(job);
+        }
     }
+}
 
-Respond:
-    expbuf_dispose(buf);
-    expbuf_push_num(buf, type);
-    expbuf_push_num(buf, key_index);
-    switch (type) {
-    case NEVERBLEED_TYPE_RSA:
-        expbuf_push_str(buf, estr != NULL ? estr : "");
-        expbuf_push_str(buf, nstr != NULL ? nstr : "");
-        break;
-#ifdef NEVERBLEED_ECDSA
-    case NEVERBLEED_TYPE_ECDSA:
-        expbuf_push_num(buf, EC_GROUP_get_curve_name(ec_group));
-        expbuf_push_str(buf, ec_pubkeystr);
-        break;
-#endif
-    default:
-        expbuf_push_str(buf, errbuf);
+/**
+ * sets up a job obtained from `daemon_job_new` for handling the request that has been stored to its buffer (prefixed by the id).
+ * Returns -1 if the request is broken, in which case the job is freed.
+ */
+static int daemon_conn_init_job(struct daemon_conn_t *conn, struct daemon_job_t *job, int via_ring)
+{
+    job->conn = conn;
+    job->via_ring = via_ring;
+    job->received_at = now_nsec();
+    if (expbuf_shift_num(&job->buf, &job->id) != 0) {
+        errno = 0;
+        warnf("failed to parse request");
+        daemon_job_free(job);
+        return -1;
     }
-    if (rsa != NULL)
-        RSA_free(rsa);
-    if (pkey != NULL)
-        EVP_PKEY_free(pkey);
-    if (estr != NULL)
-        OPENSSL_free(estr);
-    if (nstr != NULL)
-        OPENSSL_free(nstr);
-#ifdef NEVERBLEED_ECDSA
-    if (ec_pubkeystr != NULL)
-        OPENSSL_free(ec_pubkeystr);
-    if (ec_pubkeybn != NULL)
-        BN_free(ec_pubkeybn);
-#endif
-    if (fp != NULL)
-        fclose(fp);
+
+    pthread_mutex_lock(&conn->mutex);
+    ++conn->refcnt;
+    pthread_mutex_unlock(&conn->mutex);
 
     return 0;
 }
 
-int neverbleed_setuidgid(neverbleed_t *nb, const char *user, int change_socket_ownership)
+/**
+ * reads the socket and builds the jobs for the complete requests, which are returned through `jobs`. Returns 1 if something has
+ * been read, 0 if `flags` contains MSG_DONTWAIT and there was nothing to read, or -1 if the connection should be closed (the jobs
+ * built up to the error are still returned).
+ */
+static int daemon_conn_read(struct daemon_conn_t *conn, int flags, struct daemon_job_t **jobs)
 {
-    struct st_neverbleed_thread_data_t *thdata = get_thread_data(nb);
-    struct expbuf_t buf = {NULL};
-    size_t ret;
+    struct expbuf_t *rbuf = &conn->rbuf;
+    struct daemon_job_t *job, **tail = jobs;
+    size_t sz;
+    ssize_t r;
+    int ret = 1;
 
-    expbuf_push_str(&buf, "setuidgid");
-    expbuf_push_str(&buf, user);
-    expbuf_push_num(&buf, change_socket_ownership);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+    *jobs = NULL;
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0) {
-        errno = 0;
-        dief("failed to parse response");
+    expbuf_reserve(rbuf, 4096);
+    while ((r = recv(conn->fd, rbuf->end, rbuf->buf + rbuf->capacity - rbuf->end, flags)) == -1 && errno == EINTR)
+        ;
+    if (r <= 0) {
+        if (r == -1) {
+            if ((flags & MSG_DONTWAIT) != 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 0;
+            warnf("read error");
+        }
+        return -1;
     }
-    expbuf_dispose(&buf);
+    rbuf->end += r;
 
-    return (int)ret;
+    /* handle the complete requests */
+    while (expbuf_size(rbuf) >= sizeof(sz)) {
+        memcpy(&sz, rbuf->start, sizeof(sz));
+        if (expbuf_size(rbuf) - sizeof(sz) < sz) {
+            expbuf_reserve(rbuf, sizeof(sz) + sz);
+            break;
+        }
+        rbuf->start += sizeof(sz);
+        job = daemon_job_new();
+        expbuf_reserve(&job->buf, sz);
+        memcpy(job->buf.end, rbuf->start, sz);
+        job->buf.end += sz;
+        rbuf->start += sz;
+        if (daemon_conn_init_job(conn, job, 0) != 0) {
+            ret = -1;
+            break;
+        }
+        *tail = job;
+        tail = &job->next;
+    }
+
+    /* move the partial request to the head of the buffer */
+    if (rbuf->start != rbuf->buf) {
+        size_t remaining = expbuf_size(rbuf);
+        memmove(rbuf->buf, rbuf->start, remaining);
+        OPENSSL_cleanse(rbuf->buf + remaining, rbuf->end - rbuf->buf - remaining);
+        rbuf->start = rbuf->buf;
+        rbuf->end = rbuf->buf + remaining;
+    }
+
+    return ret;
 }
 
-static int setuidgid_stub(struct expbuf_t *buf)
-{
-    const char *user;
-    size_t change_socket_ownership;
-    struct passwd pwbuf, *pw;
-    char pwstrbuf[65536]; /* should be large enough */
-    int ret = -1;
+#ifdef NEVERBLEED_SHM_RING
 
-    if ((user = expbuf_shift_str(buf)) == NULL || expbuf_shift_num(buf, &change_socket_ownership) != 0) {
-        errno = 0;
-        warnf("%s: failed to parse request", __FUNCTION__);
+/**
+ * receives the rings and the eventfds sent by `conn_setup_shm`
+ */
+static int daemon_conn_setup_shm(struct daemon_conn_t *conn, struct msghdr *msg)
+{
+    struct cmsghdr *cmsg;
+    int fds[3], seals, ret = -1;
+    struct stat st;
+    void *shm;
+
+    if ((cmsg = CMSG_FIRSTHDR(msg)) == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        warnf("shared memory not received from client");
         return -1;
     }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
 
-    errno = 0;
-    if (getpwnam_r(user, &pwbuf, pwstrbuf, sizeof(pwstrbuf), &pw) != 0) {
-        warnf("%s: getpwnam_r failed", __FUNCTION__);
-        goto Respond;
+    /* the memory being shared with an untrusted process, make sure that it cannot be shrunk after being mapped */
+    if (fstat(fds[0], &st) != 0 || st.st_size != sizeof(*conn->shm) || (seals = fcntl(fds[0], F_GET_SEALS)) == -1 ||
+        (seals & F_SEAL_SHRINK) == 0) {
+        warnf("invalid shared memory received from client");
+        goto Exit;
     }
-    if (pw == NULL) {
-        warnf("%s: failed to obtain information of user:%s", __FUNCTION__, user);
-        goto Respond;
+    if ((shm = mmap(NULL, sizeof(*conn->shm), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0)) == MAP_FAILED) {
+        warnf("failed to map shared memory");
+        goto Exit;
     }
+    /* the eventfds are written while holding the connection lock, and therefore must never block */
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[2], F_SETFL, O_NONBLOCK);
+    set_cloexec(fds[1]);
+    set_cloexec(fds[2]);
+
+    conn->shm = shm;
+    conn->sq_efd = fds[1];
+    conn->cq_efd = fds[2];
+    fds[1] = fds[2] = -1;
+    ret = 0;
 
-    if (change_socket_ownership) {
-        char *dir;
-        if (chown(daemon_vars.nb->sun_.sun_path, pw->pw_uid, pw->pw_gid) != 0)
-            dief("chown failed for:%s", daemon_vars.nb->sun_.sun_path);
-        dir = dirname(daemon_vars.nb->sun_.sun_path);
-        if (chown(dir, pw->pw_uid, pw->pw_gid) != 0)
-            dief("chown failed for:%s", dir);
-        free(dir);
-    }
+Exit:
+    close(fds[0]);
+    if (fds[1] != -1)
+        close(fds[1]);
+    if (fds[2] != -1)
+        close(fds[2]);
+    return ret;
+}
 
-    /* setuidgid */
-    if (setgid(pw->pw_gid) != 0) {
-        warnf("%s: setgid(%d) failed", __FUNCTION__, (int)pw->pw_gid);
-        goto Respond;
-    }
-    if (initgroups(pw->pw_name, pw->pw_gid) != 0) {
-        warnf("%s: initgroups(%s, %d) failed", __FUNCTION__, pw->pw_name, (int)pw->pw_gid);
-        goto Respond;
+/**
+ * builds the jobs for the requests found in the submission ring, which are returned through `jobs`. Returns -1 if the ring is
+ * broken.
+ */
+static int daemon_conn_drain_ring(struct daemon_conn_t *conn, struct daemon_job_t **jobs)
+{
+    struct daemon_job_t *job, **tail = jobs;
+    int r;
+
+    *jobs = NULL;
+    while (1) {
+        job = daemon_job_new();
+        if ((r = ring_shift(&conn->shm->sq, &job->buf)) <= 0) {
+            daemon_job_free(job);
+            break;
+        }
+        if (daemon_conn_init_job(conn, job, 1) != 0)
+            return -1;
+        *tail = job;
+        tail = &job->next;
     }
-    if (setuid(pw->pw_uid) != 0) {
-        warnf("%s: setuid(%d) failed\n", __FUNCTION__, (int)pw->pw_uid);
-        goto Respond;
+    if (r < 0) {
+        errno = 0;
+        warnf("broken submission ring");
+        return -1;
     }
-    ret = 0;
-
-Respond:
-    expbuf_dispose(buf);
-    expbuf_push_num(buf, ret);
     return 0;
 }
 
-__attribute__((noreturn)) static void *daemon_close_notify_thread(void *_close_notify_fd)
+#endif
+
+/**
+ * receives the authentication token and the transport mode. Returns 1 if complete, 0 if `flags` contains MSG_DONTWAIT and more
+ * bytes are needed, or -1 if the connection should be closed.
+ */
+static int daemon_conn_handshake(struct daemon_conn_t *conn, int flags)
 {
-    int close_notify_fd = (int)((char *)_close_notify_fd - (char *)NULL);
-    char b;
+    struct expbuf_t *rbuf = &conn->rbuf;
+    char mode, cbuf[CMSG_SPACE(sizeof(int) * 3)];
+    struct iovec vec = {&mode, 1};
+    struct msghdr msg = {NULL};
     ssize_t r;
 
-Redo:
-    r = read(close_notify_fd, &b, 1);
-    if (r == -1 && errno == EINTR)
-        goto Redo;
-    if (r > 0)
-        goto Redo;
-    /* close or error */
+    /* authenticate; the token is read without overrunning, as the transport mode might be accompanied by descriptors */
+    while (expbuf_size(rbuf) < NEVERBLEED_AUTH_TOKEN_SIZE) {
+        expbuf_reserve(rbuf, NEVERBLEED_AUTH_TOKEN_SIZE);
+        while ((r = recv(conn->fd, rbuf->end, NEVERBLEED_AUTH_TOKEN_SIZE - expbuf_size(rbuf), flags)) == -1 && errno == EINTR)
+            ;
+        if (r == -1 && (flags & MSG_DONTWAIT) != 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (r == 0 && expbuf_size(rbuf) == 0)
+            return -1; /* closed without being used (e.g., a spare channel discarded by a child process) */
+        if (r <= 0) {
+            warnf("failed to receive authencication token from client");
+            return -1;
+        }
+        rbuf->end += r;
+    }
+    if (memcmp(rbuf->start, daemon_vars.nb->auth_token, NEVERBLEED_AUTH_TOKEN_SIZE) != 0) {
+        warnf("client authentication failed");
+        return -1;
+    }
 
-    /* unlink the temporary directory and socket file */
-    unlink_dir(dirname(daemon_vars.nb->sun_.sun_path));
+    /* receive the transport mode, along with the rings if they are to be used */
+    msg.msg_iov = &vec;
+    msg.msg_iovlen = 1;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof(cbuf);
+    while ((r = recvmsg(conn->fd, &msg, flags)) == -1 && errno == EINTR)
+        ;
+    if (r == -1 && (flags & MSG_DONTWAIT) != 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        return 0;
+    if (r != 1) {
+        warnf("failed to receive transport mode from client");
+        return -1;
+    }
+    switch (mode) {
+    case 0:
+        break;
+#ifdef NEVERBLEED_SHM_RING
+    case 1:
+        if (daemon_conn_setup_shm(conn, &msg) != 0)
+            return -1;
+        break;
+#endif
+    default:
+        warnf("unknown transport mode:%d", (int)mode);
+        return -1;
+    }
 
-    _exit(0);
+    expbuf_clear(rbuf);
+    conn->established = 1;
+    return 1;
 }
 
-static int priv_rsa_finish(RSA *rsa)
-{
-    struct st_neverbleed_rsa_exdata_t *exdata;
-    struct st_neverbleed_thread_data_t *thdata;
+#ifdef NEVERBLEED_EPOLL
 
-    get_privsep_data(rsa, &exdata, &thdata);
+#ifdef NEVERBLEED_SHM_RING
 
-    struct expbuf_t buf = {NULL};
-    size_t ret;
+/**
+ * services the submission ring. After handling the requests, the ring is polled for a short while before the eventfd is re-armed,
+ * as the client often sends the next request soon.
+ */
+static void daemon_conn_on_ring(struct daemon_event_t *ev)
+{
+    struct daemon_conn_t *conn = (void *)((char *)ev - offsetof(struct daemon_conn_t, ring_ev));
+    struct daemon_job_t *jobs;
+    int closed;
+
+    efd_clear(conn->sq_efd);
+    __atomic_store_n(&conn->shm->sq.need_wakeup, 0, __ATOMIC_RELAXED);
+
+    do {
+        do {
+            if (daemon_conn_drain_ring(conn, &jobs) != 0) {
+                /* let the reader of the socket close the connection */
+                daemon_run_jobs(jobs);
+                shutdown(conn->fd, SHUT_RDWR);
+                goto Rearm;
+            }
+            daemon_run_jobs(jobs);
+        } while (ring_spin(&conn->shm->sq));
+    } while (ring_prepare_sleep(&conn->shm->sq) != 0);
+
+Rearm:
+    pthread_mutex_lock(&conn->mutex);
+    if (!(closed = conn->closed))
+        daemon_epoll_arm(EPOLL_CTL_MOD, ev);
+    pthread_mutex_unlock(&conn->mutex);
+    if (closed) {
+        epoll_ctl(daemon_vars.epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
+        daemon_conn_release(conn);
+    }
+}
 
-    expbuf_push_str(&buf, "del_rsa_key");
-    expbuf_push_num(&buf, exdata->key_index);
-    if (expbuf_write(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "write error" : "connection closed by daemon");
-    expbuf_dispose(&buf);
+#endif
 
-    if (expbuf_read(&buf, thdata->fd) != 0)
-        dief(errno != 0 ? "read error" : "connection closed by daemon");
-    if (expbuf_shift_num(&buf, &ret) != 0) {
-        errno = 0;
-        dief("failed to parse response");
+/**
+ * flushes the bytes of the responses that could not be written by `daemon_conn_send`. The reference to the connection taken when
+ * the event was armed is released once all of them have been written.
+ */
+static void daemon_conn_on_writable(struct daemon_event_t *ev)
+{
+    struct daemon_conn_t *conn = (void *)((char *)ev - offsetof(struct daemon_conn_t, write_ev));
+    struct expbuf_t *wbuf = &conn->wbuf;
+    int flushed, resume_reading = 0;
+    ssize_t r;
+
+    pthread_mutex_lock(&conn->mutex);
+    while (expbuf_size(wbuf) != 0) {
+        while ((r = write(ev->fd, wbuf->start, expbuf_size(wbuf))) == -1 && errno == EINTR)
+            ;
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            /* the responses are discarded; the reader notices the error and closes the connection */
+            warnf("write error");
+            shutdown(conn->fd, SHUT_RDWR);
+            expbuf_clear(wbuf);
+            break;
+        }
+        wbuf->start += r;
     }
-    expbuf_dispose(&buf);
+    if ((flushed = expbuf_size(wbuf) == 0)) {
+        expbuf_dispose(wbuf);
+        resume_reading = conn->read_paused;
+        conn->read_paused = 0;
+    } else {
+        /* move the remaining bytes to the head of the buffer, so that the buffer does not grow while the client keeps up */
+        size_t remaining = expbuf_size(wbuf);
+        memmove(wbuf->buf, wbuf->start, remaining);
+        wbuf->start = wbuf->buf;
+        wbuf->end = wbuf->buf + remaining;
+        daemon_epoll_arm_events(EPOLL_CTL_MOD, ev, EPOLLOUT);
+    }
+    pthread_mutex_unlock(&conn->mutex);
 
-    return (int)ret;
+    if (resume_reading)
+        daemon_epoll_arm(EPOLL_CTL_MOD, &conn->sock_ev);
+    if (flushed)
+        daemon_conn_release(conn);
 }
 
-static int del_rsa_key_stub(struct expbuf_t *buf)
+/**
+ * sends a response without blocking. The bytes that cannot be written right away are appended to `conn->wbuf`, to be written by
+ * `daemon_conn_on_writable` when the socket becomes writable. Must be called while holding `conn->mutex`. Returns 0 if successful,
+ * or -1 if the connection is broken.
+ */
+static int daemon_conn_send(struct daemon_conn_t *conn, size_t id, struct expbuf_t *buf)
 {
-    size_t key_index;
-
-    int ret = 0;
+    size_t bufsz = sizeof(id) + expbuf_size(buf), vecindex = 0;
+    struct iovec vecs[3] = {{&bufsz, sizeof(bufsz)}, {&id, sizeof(id)}, {buf->start, expbuf_size(buf)}};
+    int was_empty = expbuf_size(&conn->wbuf) == 0;
+    ssize_t r;
 
-    if (expbuf_shift_num(buf, &key_index) != 0) {
-        errno = 0;
-        warnf("%s: failed to parse request", __FUNCTION__);
-        return -1;
+    /* write directly unless there are bytes waiting to be written, which have to precede the response */
+    while (was_empty && vecindex != sizeof(vecs) / sizeof(vecs[0])) {
+        while ((r = writev(conn->fd, vecs + vecindex, sizeof(vecs) / sizeof(vecs[0]) - vecindex)) == -1 && errno == EINTR)
+            ;
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        while (vecindex != sizeof(vecs) / sizeof(vecs[0]) && r >= vecs[vecindex].iov_len) {
+            r -= vecs[vecindex].iov_len;
+            ++vecindex;
+        }
+        if (r != 0) {
+            vecs[vecindex].iov_base = (char *)vecs[vecindex].iov_base + r;
+            vecs[vecindex].iov_len -= r;
+        }
     }
+    if (vecindex == sizeof(vecs) / sizeof(vecs[0]))
+        return 0;
 
-    if (!daemon_vars.keys.keys || key_index >= daemon_vars.keys.rsa_slots.reserved_size) {
-        errno = 0;
-        warnf("%s: invalid key index %zu", __FUNCTION__, key_index);
-        goto respond;
+    for (; vecindex != sizeof(vecs) / sizeof(vecs[0]); ++vecindex) {
+        expbuf_reserve(&conn->wbuf, vecs[vecindex].iov_len);
+        memcpy(conn->wbuf.end, vecs[vecindex].iov_base, vecs[vecindex].iov_len);
+        conn->wbuf.end += vecs[vecindex].iov_len;
     }
 
-    if (BITCHECK(daemon_vars.keys.rsa_slots.bita_avail, key_index)) {
-        warnf("%s: index not in use %zu", __FUNCTION__, key_index);
-        goto respond;
+    /* start watching the socket, unless it is already being watched */
+    if (was_empty) {
+        int op = EPOLL_CTL_MOD;
+        if (conn->write_ev.fd == -1) {
+            if ((conn->write_ev.fd = fcntl(conn->fd, F_DUPFD_CLOEXEC, 0)) == -1) {
+                warnf("failed to duplicate socket");
+                expbuf_dispose(&conn->wbuf);
+                return -1;
+            }
+            conn->write_ev.cb = daemon_conn_on_writable;
+            op = EPOLL_CTL_ADD;
+        }
+        ++conn->refcnt;
+        daemon_epoll_arm_events(op, &conn->write_ev, EPOLLOUT);
     }
 
-    pthread_mutex_lock(&daemon_vars.keys.lock);
-    /* set slot as available */
-    BITSET(daemon_vars.keys.rsa_slots.bita_avail, key_index);
-    daemon_vars.keys.rsa_slots.size--;
-    RSA_free(daemon_vars.keys.keys[key_index]);
-    daemon_vars.keys.keys[key_index] = NULL;
-    pthread_mutex_unlock(&daemon_vars.keys.lock);
-
-    ret = 1;
-
-respond:
-    expbuf_dispose(buf);
-    expbuf_push_num(buf, ret);
     return 0;
 }
 
-static void *daemon_conn_thread(void *_sock_fd)
+static void daemon_conn_on_sock(struct daemon_event_t *ev)
 {
-    int sock_fd = (int)((char *)_sock_fd - (char *)NULL);
-    struct expbuf_t buf = {NULL};
-    unsigned char auth_token[NEVERBLEED_AUTH_TOKEN_SIZE];
-
-    /* authenticate */
-    if (read_nbytes(sock_fd, &auth_token, sizeof(auth_token)) != 0) {
-        warnf("failed to receive authencication token from client");
-        goto Exit;
+    struct daemon_conn_t *conn = (void *)((char *)ev - offsetof(struct daemon_conn_t, sock_ev));
+    struct daemon_job_t *jobs = NULL;
+    int r;
+
+    if (!conn->established) {
+        if ((r = daemon_conn_handshake(conn, MSG_DONTWAIT)) < 0)
+            goto Close;
+        if (r == 0) {
+            daemon_epoll_arm(EPOLL_CTL_MOD, ev);
+            return;
+        }
+#ifdef NEVERBLEED_SHM_RING
+        if (conn->shm != NULL) {
+            pthread_mutex_lock(&conn->mutex);
+            ++conn->refcnt;
+            pthread_mutex_unlock(&conn->mutex);
+            conn->ring_ev.fd = conn->sq_efd;
+            conn->ring_ev.cb = daemon_conn_on_ring;
+            daemon_epoll_arm(EPOLL_CTL_ADD, &conn->ring_ev);
+        }
+#endif
     }
-    if (memcmp(auth_token, daemon_vars.nb->auth_token, NEVERBLEED_AUTH_TOKEN_SIZE) != 0) {
-        warnf("client authentication failed");
-        goto Exit;
+
+    /* re-arm before running the requests, so that other workers can read the ones that follow, unless the client is not reading
+     * the responses (in which case `daemon_conn_on_writable` re-arms once they are written) */
+    if (daemon_conn_read(conn, MSG_DONTWAIT, &jobs) < 0)
+        goto Close;
+    pthread_mutex_lock(&conn->mutex);
+    if (!(conn->read_paused = expbuf_size(&conn->wbuf) > NEVERBLEED_DAEMON_WBUF_MAX_SIZE))
+        daemon_epoll_arm(EPOLL_CTL_MOD, ev);
+    pthread_mutex_unlock(&conn->mutex);
+    daemon_run_jobs(jobs);
+    return;
+
+Close:
+    daemon_run_jobs(jobs);
+    pthread_mutex_lock(&conn->mutex);
+    conn->closed = 1;
+    pthread_mutex_unlock(&conn->mutex);
+    epoll_ctl(daemon_vars.epoll_fd, EPOLL_CTL_DEL, ev->fd, NULL);
+#ifdef NEVERBLEED_SHM_RING
+    /* wake up the reader of the ring, so that it notices the closure and releases its reference */
+    if (conn->shm != NULL)
+        efd_notify(conn->sq_efd);
+#endif
+    daemon_conn_release(conn);
+}
+
+__attribute__((noreturn)) static void *daemon_worker_thread(void *_worker)
+{
+    struct daemon_worker_t *worker = _worker;
+    struct daemon_job_t *job;
+    struct epoll_event e;
+    sigset_t waitmask;
+    int events_due = 0, r;
+
+    if (worker != NULL) {
+        daemon_worker_setup(worker);
+        /* the wakeup signal, blocked by `daemon_main`, is accepted only while waiting for events */
+        pthread_sigmask(SIG_SETMASK, NULL, &waitmask);
+        sigdelset(&waitmask, NEVERBLEED_WAKEUP_SIGNAL);
     }
 
     while (1) {
-        char *cmd;
-        if (expbuf_read(&buf, sock_fd) != 0) {
-            if (errno != 0)
-                warnf("read error");
-            break;
-        }
-        if ((cmd = expbuf_shift_str(&buf)) == NULL) {
-            errno = 0;
-            warnf("failed to parse request");
-            break;
+        int timeout = -1;
+        if (worker != NULL && !events_due) {
+            pthread_mutex_lock(&daemon_vars.jobs.lock);
+            /* the jobs queued to the worker take precedence, followed by those left behind by the stalled workers */
+            if ((job = daemon_worker_dequeue(worker)) == NULL && (job = daemon_worker_steal()) == NULL) {
+                worker->sleeping = 1;
+                if (daemon_vars.affinity.num_queued != 0)
+                    timeout = NEVERBLEED_AFFINITY_STALL_NSEC / 1000000;
+            }
+            pthread_mutex_unlock(&daemon_vars.jobs.lock);
+            if (job != NULL) {
+                daemon_run_job(job);
+                /* take turns with the events, so that the requests arriving on other connections are not starved by a backlog */
+                events_due = 1;
+                continue;
+            }
         }
-        if (strcmp(cmd, "priv_enc") == 0) {
-            if (priv_enc_stub(&buf) != 0)
-                break;
-        } else if (strcmp(cmd, "priv_dec") == 0) {
-            if (priv_dec_stub(&buf) != 0)
-                break;
-        } else if (strcmp(cmd, "sign") == 0) {
-            if (sign_stub(&buf) != 0)
-                break;
-#ifdef NEVERBLEED_ECDSA
-        } else if (strcmp(cmd, "ecdsa_sign") == 0) {
-            if (ecdsa_sign_stub(&buf) != 0)
-                break;
-        } else if (strcmp(cmd, "del_ecdsa_key") == 0) {
-            if (del_ecdsa_key_stub(&buf) != 0)
-                break;
-#endif
-        } else if (strcmp(cmd, "load_key") == 0) {
-            if (load_key_stub(&buf) != 0)
-                break;
-        } else if (strcmp(cmd, "del_rsa_key") == 0) {
-            if (del_rsa_key_stub(&buf) != 0)
-                break;
-        } else if (strcmp(cmd, "setuidgid") == 0) {
-            if (setuidgid_stub(&buf) != 0)
-                break;
-        } else {
-            warnf("unknown command:%s", cmd);
-            break;
+        r = epoll_pwait(daemon_vars.epoll_fd, &e, 1, events_due ? 0 : timeout, worker != NULL ? &waitmask : NULL);
+        events_due = 0;
+        if (worker != NULL)
+            __atomic_store_n(&worker->sleeping, 0, __ATOMIC_RELAXED);
+        if (r == -1) {
+            if (errno == EINTR)
+                continue;
+            dief("epoll_wait failed");
         }
-        if (expbuf_write(&buf, sock_fd) != 0) {
-            warnf(errno != 0 ? "write error" : "connection closed by client");
-            break;
+        if (r == 1) {
+            struct daemon_event_t *ev = e.data.ptr;
+            ev->cb(ev);
         }
-        expbuf_dispose(&buf);
     }
+}
 
-Exit:
-    expbuf_dispose(&buf);
-    close(sock_fd);
+#else
+
+static void *daemon_conn_thread(void *_conn)
+{
+    struct daemon_conn_t *conn = _conn;
+    struct daemon_job_t *jobs;
+    int r;
+
+    if (daemon_conn_handshake(conn, 0) == 1) {
+        do {
+            r = daemon_conn_read(conn, 0, &jobs);
+            daemon_run_jobs(jobs);
+        } while (r > 0);
+    }
+    daemon_conn_release(conn);
+    daemon_keys_reader_dispose();
+    daemon_stats_dispose();
 
     return NULL;
 }
 
+#endif
+
 #if !(defined(__FreeBSD__) || defined(__NetBSD__) || defined(__OpenBSD__))
 #define closefrom my_closefrom
 static void my_closefrom(int lowfd)
@@ -1390,7 +6254,7 @@ static void my_closefrom(int lowfd)
 }
 #endif
 
-static void cleanup_fds(int listen_fd, int close_notify_fd)
+static void cleanup_fds(int listen_fd, int channel_fd, int close_notify_fd)
 {
     int maxfd, k;
 
@@ -1398,11 +6262,14 @@ static void cleanup_fds(int listen_fd, int close_notify_fd)
     if (listen_fd > maxfd) {
         maxfd = listen_fd;
     }
+    if (channel_fd > maxfd) {
+        maxfd = channel_fd;
+    }
     if (close_notify_fd > maxfd) {
         maxfd = close_notify_fd;
     }
     for (k = 0; k < maxfd; k++) {
-        if (k == listen_fd || k == close_notify_fd)
+        if (k == listen_fd || k == channel_fd || k == close_notify_fd)
                 continue;
         switch (k) {
         case STDOUT_FILENO:
@@ -1416,35 +6283,227 @@ static void cleanup_fds(int listen_fd, int close_notify_fd)
     closefrom(maxfd + 1);
 }
 
-__attribute__((noreturn)) static void daemon_main(int listen_fd, int close_notify_fd, const char *tempdir)
+/**
+ * hands the connection to the workers (or to a thread dedicated to the connection, if epoll is unavailable)
+ */
+static void daemon_conn_start(int sock_fd, pthread_attr_t *thattr)
+{
+    struct daemon_conn_t *conn = daemon_conn_new(sock_fd);
+
+#ifdef NEVERBLEED_EPOLL
+    /* the workers serve many connections, and therefore must not block on any of them */
+    fcntl(sock_fd, F_SETFL, O_NONBLOCK);
+    conn->sock_ev.fd = sock_fd;
+    conn->sock_ev.cb = daemon_conn_on_sock;
+    daemon_epoll_arm(EPOLL_CTL_ADD, &conn->sock_ev);
+#else
+    pthread_t tid;
+    if (pthread_create(&tid, thattr, daemon_conn_thread, conn) != 0)
+        dief("pthread_create failed");
+#endif
+}
+
+/**
+ * hands out pre-connected channels through the control socket (see `neverbleed_use_socketpairs`). Each request, consisting of the
+ * number of channels wanted, is answered by a datagram carrying the client-side ends of the channels, the other ends being served
+ * like the connections that have been accepted.
+ */
+__attribute__((noreturn)) static void *daemon_channel_thread(void *_channel_fd)
+{
+    int channel_fd = (int)((char *)_channel_fd - (char *)NULL), fds[NEVERBLEED_CHANNEL_BATCH], pair[2];
+    char cbuf[CMSG_SPACE(sizeof(fds))];
+    unsigned char num;
+    struct iovec vec = {&num, 1};
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    pthread_attr_t thattr;
+    size_t i;
+    ssize_t r;
+
+    pthread_attr_init(&thattr);
+    pthread_attr_setdetachstate(&thattr, 1);
+
+    while (1) {
+        while ((r = recv(channel_fd, &num, 1, 0)) == -1 && errno == EINTR)
+            ;
+        if (r != 1)
+            dief("failed to read from the channel socket");
+        if (num == 0 || num > NEVERBLEED_CHANNEL_BATCH)
+            num = NEVERBLEED_CHANNEL_BATCH;
+        for (i = 0; i != num; ++i) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) != 0)
+                dief("socketpair failed");
+            set_cloexec(pair[0]);
+            daemon_conn_start(pair[0], &thattr);
+            fds[i] = pair[1];
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &vec;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(fds[0]) * num);
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds[0]) * num);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds[0]) * num);
+        while ((r = sendmsg(channel_fd, &msg, 0)) == -1 && errno == EINTR)
+            ;
+        if (r != 1)
+            warnf("failed to send channels");
+        /* the client owns its ends once they are sent; if sending failed, the daemon-side ends see EOF and are disposed of */
+        for (i = 0; i != num; ++i)
+            close(fds[i]);
+    }
+}
+
+static void daemon_refill_start(pthread_attr_t *thattr)
+{
+    pthread_t tid;
+
+    pthread_mutex_init(&daemon_vars.refills.lock, NULL);
+    pthread_cond_init(&daemon_vars.refills.cond, NULL);
+    if ((daemon_vars.rsa_blinding_index = RSA_get_ex_new_index(0, NULL, NULL, NULL, daemon_rsa_blinding_free)) == -1)
+        dief("RSA_get_ex_new_index failed");
+#ifdef NEVERBLEED_ECDSA
+    if ((daemon_vars.ecdsa_pool_index = EC_KEY_get_ex_new_index(0, NULL, NULL, NULL, daemon_ecdsa_pool_free)) == -1)
+        dief("EC_KEY_get_ex_new_index failed");
+#endif
+    if (pthread_create(&tid, thattr, daemon_refill_thread, NULL) != 0)
+        dief("pthread_create failed");
+}
+
+#ifdef NEVERBLEED_EPOLL
+
+static void daemon_on_wakeup_signal(int signo)
+{
+}
+
+#endif
+
+__attribute__((noreturn)) static void daemon_main(int listen_fd, int channel_fd, int close_notify_fd, const char *tempdir)
 {
     pthread_t tid;
     pthread_attr_t thattr;
+    size_t num_workers;
     int sock_fd;
 
-    cleanup_fds(listen_fd, close_notify_fd);
+    cleanup_fds(listen_fd, channel_fd, close_notify_fd);
     pthread_attr_init(&thattr);
     pthread_attr_setdetachstate(&thattr, 1);
 
     if (pthread_create(&tid, &thattr, daemon_close_notify_thread, (char *)NULL + close_notify_fd) != 0)
         dief("pthread_create failed");
+#ifdef NEVERBLEED_EPOLL
+    if ((daemon_vars.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        dief("epoll_create1 failed");
+    if ((daemon_vars.jobs.ev.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) == -1)
+        dief("eventfd failed");
+    daemon_vars.jobs.ev.cb = daemon_on_jobs;
+    daemon_epoll_arm(EPOLL_CTL_ADD, &daemon_vars.jobs.ev);
+#endif
+    if ((num_workers = neverbleed_num_workers) == 0) {
+#ifdef __linux__
+        cpu_set_t cpus;
+        long n = sched_getaffinity(0, sizeof(cpus), &cpus) == 0 ? CPU_COUNT(&cpus) : sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+        num_workers = n > 0 ? n : 1;
+    }
+    daemon_vars.num_workers = num_workers;
+    daemon_refill_start(&thattr);
+    if (neverbleed_key_affinity) {
+        size_t i;
+        if (posix_memalign((void **)&daemon_vars.affinity.workers, 64, sizeof(daemon_vars.affinity.workers[0]) * num_workers) != 0)
+            dief("no memory");
+        memset(daemon_vars.affinity.workers, 0, sizeof(daemon_vars.affinity.workers[0]) * num_workers);
+        for (i = 0; i != num_workers; ++i) {
+            daemon_vars.affinity.workers[i].index = i;
+            daemon_vars.affinity.workers[i].tail = &daemon_vars.affinity.workers[i].first;
+        }
+#ifdef NEVERBLEED_EPOLL
+        { /* the signal interrupts epoll_pwait, blocked by the threads being created except while waiting for events */
+            sigset_t mask;
+            set_signal_handler(NEVERBLEED_WAKEUP_SIGNAL, daemon_on_wakeup_signal);
+            sigemptyset(&mask);
+            sigaddset(&mask, NEVERBLEED_WAKEUP_SIGNAL);
+            pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        }
+#endif
+        for (i = 0; i != num_workers; ++i)
+            if (pthread_create(&tid, &thattr, daemon_worker_thread, daemon_vars.affinity.workers + i) != 0)
+                dief("pthread_create failed");
+    } else {
+        while (num_workers-- != 0)
+            if (pthread_create(&tid, &thattr, daemon_worker_thread, NULL) != 0)
+                dief("pthread_create failed");
+    }
+
+    if (channel_fd != -1 && pthread_create(&tid, &thattr, daemon_channel_thread, (char *)NULL + channel_fd) != 0)
+        dief("pthread_create failed");
 
+    /* accept the connections */
     while (1) {
         while ((sock_fd = accept(listen_fd, NULL, NULL)) == -1)
             ;
-        if (pthread_create(&tid, &thattr, daemon_conn_thread, (char *)NULL + sock_fd) != 0)
-            dief("pthread_create failed");
+        set_cloexec(sock_fd);
+        daemon_conn_start(sock_fd, &thattr);
     }
 }
 
-static void set_signal_handler(int signo, void (*cb)(int signo))
+#ifdef __linux__
+
+/**
+ * binds the daemon to its share of the CPUs that the process is allowed to run on, dividing the CPUs into `num_daemons` contiguous
+ * groups. The memory being allocated by the threads of the daemon thereby stays local to the NUMA node of those CPUs.
+ */
+static void daemon_bind_cpus(size_t daemon, size_t num_daemons)
 {
-    struct sigaction action;
+    cpu_set_t allowed, cpus;
+    size_t num_cpus, cpu, nth = 0;
 
-    memset(&action, 0, sizeof(action));
-    sigemptyset(&action.sa_mask);
-    action.sa_handler = cb;
-    sigaction(signo, &action, NULL);
+    if (num_daemons < 2 || sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+        (num_cpus = (size_t)CPU_COUNT(&allowed)) < num_daemons)
+        return;
+
+    CPU_ZERO(&cpus);
+    for (cpu = 0; cpu != CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed))
+            continue;
+        if (nth * num_daemons / num_cpus == daemon)
+            CPU_SET(cpu, &cpus);
+        ++nth;
+    }
+    if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        warnf("failed to bind daemon %zu to its CPUs", daemon);
+}
+
+#endif
+
+__attribute__((noreturn)) static void daemon_spawned(neverbleed_t *nb, size_t daemon, int listen_fd, int channel_fd,
+                                                     int pipe_fds[2], const char *tempdir)
+{
+    close(pipe_fds[1]);
+#if defined(__linux__)
+    prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
+    prctl(PR_SET_PDEATHSIG, SIGTERM);
+    daemon_bind_cpus(daemon, nb->num_daemons);
+#elif defined(__FreeBSD__)
+    int dumpable = PROC_TRACE_CTL_DISABLE;
+    procctl(P_PID, 0, PROC_TRACE_CTL, &dumpable);
+#elif defined(__sun)
+    setpflags(__PROC_PROTECT, 1);
+#elif defined(__APPLE__)
+    ptrace(PT_DENY_ATTACH, 0, 0, 0);
+#endif
+    set_signal_handler(SIGTERM, SIG_IGN);
+    /* the clients might go away before receiving the responses (e.g., by abandoning an ASYNC_JOB); the writes report the error */
+    set_signal_handler(SIGPIPE, SIG_IGN);
+    if (neverbleed_post_fork_cb != NULL)
+        neverbleed_post_fork_cb();
+    daemon_vars.nb = nb;
+    daemon_main(listen_fd, channel_fd, pipe_fds[0], tempdir);
 }
 
 #ifndef NEVERBLEED_OPAQUE_RSA_METHOD
@@ -1470,8 +6529,13 @@ static RSA_METHOD static_rsa_method = {
 
 int neverbleed_init(neverbleed_t *nb, char *errbuf)
 {
-    int pipe_fds[2] = {-1, -1}, listen_fd = -1;
+    static pthread_once_t fork_handlers_once = PTHREAD_ONCE_INIT;
+#ifdef NEVERBLEED_EDDSA
+    static pthread_once_t eddsa_once = PTHREAD_ONCE_INIT;
+#endif
+    int pipe_fds[2] = {-1, -1}, listen_fd = -1, channel_fds[2] = {-1, -1};
     char *tempdir = NULL;
+    size_t daemon;
     const RSA_METHOD *rsa_default_method;
     RSA_METHOD *rsa_method;
 #ifdef NEVERBLEED_ECDSA
@@ -1507,7 +6571,16 @@ int neverbleed_init(neverbleed_t *nb, char *errbuf)
     EC_KEY_METHOD_set_init(ecdsa_method, NULL, priv_ecdsa_finish, NULL, NULL, NULL, NULL);
 #endif
 
+#ifdef NEVERBLEED_EDDSA
+    pthread_once(&eddsa_once, eddsa_setup);
+#endif
+
+#ifdef NEVERBLEED_SHM_RING
+    ring_spin_usec = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? NEVERBLEED_RING_SPIN_USEC : 0;
+#endif
+
     /* setup the daemon */
+    nb->daemons = NULL;
     if (pipe(pipe_fds) != 0) {
         snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "pipe(2) failed:%s", strerror(errno));
         goto Fail;
@@ -1521,59 +6594,112 @@ int neverbleed_init(neverbleed_t *nb, char *errbuf)
         snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to create temporary directory under /tmp:%s", strerror(errno));
         goto Fail;
     }
-    memset(&nb->sun_, 0, sizeof(nb->sun_));
-    nb->sun_.sun_family = AF_UNIX;
-    snprintf(nb->sun_.sun_path, sizeof(nb->sun_.sun_path), "%s/_", tempdir);
     RAND_bytes(nb->auth_token, sizeof(nb->auth_token));
-    if ((listen_fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "socket(2) failed:%s", strerror(errno));
-        goto Fail;
-    }
-    if (bind(listen_fd, (void *)&nb->sun_, sizeof(nb->sun_)) != 0) {
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to bind to %s:%s", nb->sun_.sun_path, strerror(errno));
+    nb->num_daemons = neverbleed_num_daemons != 0 ? neverbleed_num_daemons : 1;
+    if ((nb->daemons = calloc(nb->num_daemons, sizeof(nb->daemons[0]))) == NULL) {
+        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "no memory");
         goto Fail;
     }
-    if (listen(listen_fd, SOMAXCONN) != 0) {
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "listen(2) failed:%s", strerror(errno));
-        goto Fail;
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        nb->daemons[daemon].channels.control_fd = -1;
+        pthread_mutex_init(&nb->daemons[daemon].channels.lock, NULL);
     }
-    nb->daemon_pid = fork();
-    switch (nb->daemon_pid) {
-    case -1:
-        snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "fork(2) failed:%s", strerror(errno));
-        goto Fail;
-    case 0:
-        close(pipe_fds[1]);
-#if defined(__linux__)
-        prctl(PR_SET_DUMPABLE, 0, 0, 0, 0);
-        prctl(PR_SET_PDEATHSIG, SIGTERM);
-#elif defined(__FreeBSD__)
-        int dumpable = PROC_TRACE_CTL_DISABLE;
-        procctl(P_PID, 0, PROC_TRACE_CTL, &dumpable);
-#elif defined(__sun)
-        setpflags(__PROC_PROTECT, 1);
-#elif defined(__APPLE__)
-        ptrace(PT_DENY_ATTACH, 0, 0, 0);
-#endif
-        set_signal_handler(SIGTERM, SIG_IGN);
-        if (neverbleed_post_fork_cb != NULL)
-            neverbleed_post_fork_cb();
-        daemon_vars.nb = nb;
-        daemon_main(listen_fd, pipe_fds[0], tempdir);
-        break;
-    default:
-        break;
+    for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+        struct sockaddr_un *sun_ = &nb->daemons[daemon].sun_;
+        sun_->sun_family = AF_UNIX;
+        if (daemon == 0) {
+            snprintf(sun_->sun_path, sizeof(sun_->sun_path), "%s/_", tempdir);
+        } else {
+            snprintf(sun_->sun_path, sizeof(sun_->sun_path), "%s/_%zu", tempdir, daemon);
+        }
+        if ((listen_fd = socket(PF_UNIX, SOCK_STREAM, 0)) == -1) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "socket(2) failed:%s", strerror(errno));
+            goto Fail;
+        }
+        if (bind(listen_fd, (void *)sun_, sizeof(*sun_)) != 0) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to bind to %s:%s", sun_->sun_path, strerror(errno));
+            goto Fail;
+        }
+        if (listen(listen_fd, SOMAXCONN) != 0) {
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "listen(2) failed:%s", strerror(errno));
+            goto Fail;
+        }
+        if (neverbleed_use_socketpairs) {
+            /* datagrams, so that each request for channels is answered by one message even if the socket is shared after fork */
+            if (socketpair(AF_UNIX, SOCK_DGRAM, 0, channel_fds) != 0) {
+                snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "socketpair(2) failed:%s", strerror(errno));
+                goto Fail;
+            }
+            set_cloexec(channel_fds[0]);
+        }
+        nb->daemons[daemon].pid = fork();
+        switch (nb->daemons[daemon].pid) {
+        case -1:
+            snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "fork(2) failed:%s", strerror(errno));
+            goto Fail;
+        case 0: {
+            /* the ends of the channel sockets held by the application are not to be kept open by the daemons */
+            size_t i;
+            for (i = 0; i != daemon; ++i) {
+                if (nb->daemons[i].channels.control_fd != -1) {
+                    close(nb->daemons[i].channels.control_fd);
+                    nb->daemons[i].channels.control_fd = -1;
+                }
+            }
+            if (channel_fds[0] != -1) {
+                close(channel_fds[0]);
+                channel_fds[0] = -1;
+            }
+            /* within the daemon, `sun_` and `daemon_pid` refer to the daemon itself */
+            nb->sun_ = *sun_;
+            nb->daemon_pid = getpid();
+            daemon_spawned(nb, daemon, listen_fd, channel_fds[1], pipe_fds, tempdir);
+        } break;
+        default:
+            break;
+        }
+        close(listen_fd);
+        listen_fd = -1;
+        if (channel_fds[1] != -1) {
+            close(channel_fds[1]);
+            nb->daemons[daemon].channels.control_fd = channel_fds[0];
+            channel_fds[0] = channel_fds[1] = -1;
+        }
     }
-    close(listen_fd);
-    listen_fd = -1;
+    nb->daemon_pid = nb->daemons[0].pid;
+    nb->sun_ = nb->daemons[0].sun_;
     close(pipe_fds[0]);
     pipe_fds[0] = -1;
 
+    /* setup the shared connections, which are opened on first use */
+    if (neverbleed_num_shared_conns != 0) {
+        for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+            struct st_neverbleed_daemon_t *d = &nb->daemons[daemon];
+            size_t i;
+            if ((d->shared_conns = malloc(sizeof(d->shared_conns[0]) * neverbleed_num_shared_conns)) == NULL) {
+                snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "no memory");
+                goto Fail;
+            }
+            d->num_shared_conns = neverbleed_num_shared_conns;
+            for (i = 0; i != d->num_shared_conns; ++i) {
+                struct st_neverbleed_shared_conn_t *shared = &d->shared_conns[i];
+                pthread_mutex_init(&shared->mutex, NULL);
+                pthread_mutex_init(&shared->write_mutex, NULL);
+                pthread_cond_init(&shared->cond, NULL);
+                shared->reading = 0;
+                conn_init(&shared->conn);
+            }
+        }
+    }
+
     /* setup engine */
     if ((nb->engine = ENGINE_new()) == NULL || !ENGINE_set_id(nb->engine, "neverbleed") ||
         !ENGINE_set_name(nb->engine, "privilege separation software engine") || !ENGINE_set_RSA(nb->engine, rsa_method)
 #ifdef NEVERBLEED_ECDSA
         || !ENGINE_set_EC(nb->engine, ecdsa_method)
+#endif
+#ifdef NEVERBLEED_EDDSA
+        || !ENGINE_set_pkey_meths(nb->engine, eddsa_pkey_meths)
 #endif
             ) {
         snprintf(errbuf, NEVERBLEED_ERRBUF_SIZE, "failed to initialize the OpenSSL engine");
@@ -1584,6 +6710,15 @@ int neverbleed_init(neverbleed_t *nb, char *errbuf)
     /* setup thread key */
     pthread_key_create(&nb->thread_key, dispose_thread_data);
 
+    /* register the instance to the fork handlers */
+    pthread_once(&fork_handlers_once, client_register_fork_handlers);
+    pthread_mutex_lock(&client_vars.lock);
+    client_vars.instances = realloc(client_vars.instances, sizeof(client_vars.instances[0]) * (client_vars.num_instances + 1));
+    if (client_vars.instances == NULL)
+        dief("no memory");
+    client_vars.instances[client_vars.num_instances++] = nb;
+    pthread_mutex_unlock(&client_vars.lock);
+
     free(tempdir);
     return 0;
 Fail:
@@ -1597,11 +6732,32 @@ Fail:
     }
     if (listen_fd != -1)
         close(listen_fd);
+    if (channel_fds[0] != -1) {
+        close(channel_fds[0]);
+        close(channel_fds[1]);
+    }
     if (nb->engine != NULL) {
         ENGINE_free(nb->engine);
         nb->engine = NULL;
     }
+    if (nb->daemons != NULL) {
+        for (daemon = 0; daemon != nb->num_daemons; ++daemon) {
+            free(nb->daemons[daemon].shared_conns);
+            if (nb->daemons[daemon].channels.control_fd != -1)
+                close(nb->daemons[daemon].channels.control_fd);
+        }
+        free(nb->daemons);
+        nb->daemons = NULL;
+    }
     return -1;
 }
 
 void (*neverbleed_post_fork_cb)(void) = NULL;
+size_t neverbleed_num_workers = 0;
+int neverbleed_use_shm_ring = 0;
+int neverbleed_load_keys_lazily = 0;
+size_t neverbleed_num_daemons = 1;
+int neverbleed_replicate_keys = 0;
+size_t neverbleed_num_shared_conns = 0;
+int neverbleed_key_affinity = 0;
+int neverbleed_use_socketpairs = 0;
@@ -23,6 +23,7 @@
 #define NEVERBLEED_H
 
 #include <pthread.h>
+#include <stdint.h>
 #include <sys/un.h>
 #include <openssl/engine.h>
 
@@ -39,8 +40,18 @@ typedef struct st_neverbleed_t {
     struct sockaddr_un sun_;
     pthread_key_t thread_key;
     unsigned char auth_token[NEVERBLEED_AUTH_TOKEN_SIZE];
+    /**
+     * the daemon processes (see `neverbleed_num_daemons`); `daemon_pid` and `sun_` are those of the first one
+     */
+    struct st_neverbleed_daemon_t *daemons;
+    size_t num_daemons;
 } neverbleed_t;
 
+/**
+ * handle of a private key operation that has been started but not yet finished
+ */
+typedef struct st_neverbleed_req_t neverbleed_req_t;
+
 /**
  * initializes the privilege separation engine (returns 0 if successful)
  */
@@ -49,6 +60,202 @@ int neverbleed_init(neverbleed_t *nb, char *errbuf);
  * loads a private key file (returns 1 if successful)
  */
 int neverbleed_load_private_key_file(neverbleed_t *nb, SSL_CTX *ctx, const char *fn, char *errbuf);
+/**
+ * outcome of loading a private key by `neverbleed_load_private_key_files`
+ */
+typedef struct st_neverbleed_load_result_t {
+    /**
+     * the key, which the application should assign to the SSL context by calling SSL_CTX_use_PrivateKey(3) and then release by
+     * calling EVP_PKEY_free(3), or NULL if failed
+     */
+    EVP_PKEY *pkey;
+    /**
+     * reason of the failure
+     */
+    char errbuf[NEVERBLEED_ERRBUF_SIZE];
+} neverbleed_load_result_t;
+/**
+ * loads the private keys stored in `num_fns` files, storing the outcome of each to the corresponding element of `results`. The
+ * files are sent to the daemon in a few round trips, and are parsed concurrently by the threads of the daemon.
+ */
+void neverbleed_load_private_key_files(neverbleed_t *nb, const char **fns, size_t num_fns, neverbleed_load_result_t *results);
+/**
+ * loads the private key stored in file `fn` as the replacement of `pkey` (a key loaded by neverbleed), returning the new key, or NULL
+ * with `errbuf` being set. The new key must be of the same type and size (the same modulus size and public exponent for RSA, the same
+ * curve for ECDSA, the same algorithm for EdDSA), and is loaded into the daemons holding `pkey`. `pkey` is left unchanged, so that
+ * the handshakes using it complete with the old key; the SSL contexts need not be rebuilt, as the new certificate and then the new key
+ * can be assigned to them by calling `SSL_CTX_use_certificate` and `SSL_CTX_use_PrivateKey`. The daemons release the old key once
+ * `pkey` is freed.
+ */
+EVP_PKEY *neverbleed_replace_private_key(EVP_PKEY *pkey, const char *fn, char *errbuf);
+/**
+ * a signing operation to be submitted by `neverbleed_sign_batch`
+ */
+typedef struct st_neverbleed_sign_op_t {
+    /**
+     * key loaded by `neverbleed_load_private_key_file`
+     */
+    EVP_PKEY *pkey;
+    /**
+     * NID of the digest algorithm, as given to RSA_sign(3) or ECDSA_sign(3); ignored for EdDSA keys, for which `m` is the message
+     * itself
+     */
+    int type;
+    const unsigned char *m;
+    size_t m_len;
+    /**
+     * buffer of at least EVP_PKEY_size(3) bytes that receives the signature
+     */
+    unsigned char *sig;
+    /**
+     * set to the length of the signature
+     */
+    size_t siglen;
+    /**
+     * set to 1 if the signature has been stored, or to 0 if the operation failed
+     */
+    int ok;
+} neverbleed_sign_op_t;
+/**
+ * signs the digests of `num_ops` operations in one round trip, letting the threads of the daemon process them concurrently. Returns
+ * 0 if the daemon has processed the operations, in which case the outcome of each is stored in the `ok` field, or -1 if the request
+ * could not be built (e.g., one of the keys has not been loaded by neverbleed).
+ */
+int neverbleed_sign_batch(neverbleed_t *nb, neverbleed_sign_op_t *ops, size_t num_ops, char *errbuf);
+/**
+ * starts signing the digest `m` using a key loaded by `neverbleed_load_private_key_file`, without waiting for the result. `type` is
+ * the NID of the digest algorithm as given to RSA_sign(3) or ECDSA_sign(3) (for EdDSA keys, `type` is ignored and `m` is the
+ * message itself), and `data` is an opaque pointer that can be retrieved by `neverbleed_get_data`. Returns a handle, or NULL if
+ * failed. `*fd` is set to a descriptor that becomes readable when responses arrive; it is shared by all the operations started by
+ * the calling thread that are sent to the same daemon (there is one descriptor per daemon; see `neverbleed_num_daemons`).
+ */
+neverbleed_req_t *neverbleed_start_sign(EVP_PKEY *pkey, int type, const unsigned char *m, size_t m_len, void *data, int *fd,
+                                        char *errbuf);
+/**
+ * starts RSA_private_decrypt(3) using a key loaded by `neverbleed_load_private_key_file`, without waiting for the result. Semantics
+ * of the arguments and the return value are the same as `neverbleed_start_sign`.
+ */
+neverbleed_req_t *neverbleed_start_decrypt(EVP_PKEY *pkey, const unsigned char *from, size_t flen, int padding, void *data,
+                                           int *fd, char *errbuf);
+/**
+ * returns one of the operations started by the calling thread that have completed, or NULL if there are none. The application
+ * should call this function until NULL is returned whenever the descriptor obtained from `neverbleed_start_*` becomes readable, and
+ * pass each handle to `neverbleed_finish_*`.
+ */
+neverbleed_req_t *neverbleed_get_completed(neverbleed_t *nb);
+/**
+ * returns the opaque pointer given to `neverbleed_start_*`
+ */
+void *neverbleed_get_data(neverbleed_req_t *req);
+/**
+ * obtains the result of `neverbleed_start_sign`. `sig` should have room for EVP_PKEY_size(3) bytes. Returns 1 if the signature has
+ * been stored, 0 if the operation is still in flight, or -1 if the operation failed. The handle is released unless 0 is returned.
+ * Must be called from the thread that started the operation. In a child process, the operations started before fork(2) fail, as
+ * their responses are destined to the parent.
+ */
+int neverbleed_finish_sign(neverbleed_req_t *req, unsigned char *sig, size_t *siglen);
+/**
+ * obtains the result of `neverbleed_start_decrypt`. `to` should have room for RSA_size(3) bytes. Semantics of the return value are
+ * the same as `neverbleed_finish_sign`.
+ */
+int neverbleed_finish_decrypt(neverbleed_req_t *req, unsigned char *to, size_t *tolen);
+/**
+ * discards an operation that has been started; the response is dropped when it arrives. Must be called from the thread that
+ * started the operation. In a child process, the operations started before fork(2) are to be released by either this function or
+ * `neverbleed_finish_*`.
+ */
+void neverbleed_cancel(neverbleed_req_t *req);
+
+#define NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS 3
+#define NEVERBLEED_HISTOGRAM_NUM_BUCKETS 256
+
+/**
+ * log-linear histogram of durations in nanoseconds. Each power of two is divided into 2^NEVERBLEED_HISTOGRAM_SUB_BUCKET_BITS
+ * buckets, so the values are recorded with a precision of 12.5%; durations longer than the last bucket are counted in it.
+ */
+typedef struct st_neverbleed_histogram_t {
+    uint64_t buckets[NEVERBLEED_HISTOGRAM_NUM_BUCKETS];
+} neverbleed_histogram_t;
+
+/**
+ * operations of the daemon, as used for indexing `neverbleed_stats_t::ops`
+ */
+enum {
+    NEVERBLEED_STATS_OP_PRIV_ENC,
+    NEVERBLEED_STATS_OP_PRIV_DEC,
+    NEVERBLEED_STATS_OP_SIGN,
+    NEVERBLEED_STATS_OP_ECDSA_SIGN,
+    NEVERBLEED_STATS_OP_LOAD_KEY,
+    NEVERBLEED_STATS_OP_DEL_RSA_KEY,
+    NEVERBLEED_STATS_OP_DEL_ECDSA_KEY,
+    NEVERBLEED_STATS_OP_SETUIDGID,
+    NEVERBLEED_STATS_OP_SIGN_BATCH,
+    NEVERBLEED_STATS_OP_STATS,
+    NEVERBLEED_STATS_OP_LOAD_KEYS,
+    NEVERBLEED_STATS_OP_REGISTER_KEY,
+    NEVERBLEED_STATS_OP_REPLACE_KEY,
+    NEVERBLEED_STATS_OP_EDDSA_SIGN,
+    NEVERBLEED_STATS_OP_DEL_EDDSA_KEY,
+    NEVERBLEED_STATS_NUM_OPS
+};
+
+enum { NEVERBLEED_STATS_KEY_RSA, NEVERBLEED_STATS_KEY_ECDSA, NEVERBLEED_STATS_KEY_EDDSA, NEVERBLEED_STATS_NUM_KEY_TYPES };
+
+/**
+ * counters of the daemon, accumulated since it has been spawned
+ */
+typedef struct st_neverbleed_stats_t {
+    struct {
+        uint64_t requests;
+        /**
+         * requests that were rejected, in which case the daemon closes the connection
+         */
+        uint64_t errors;
+        uint64_t bytes_received;
+        uint64_t bytes_sent;
+        /**
+         * time between the arrival of the request and the start of its processing
+         */
+        neverbleed_histogram_t queue_time;
+        /**
+         * time spent running the operation
+         */
+        neverbleed_histogram_t crypto_time;
+    } ops[NEVERBLEED_STATS_NUM_OPS];
+    /**
+     * private key operations by type of the key, counting each item of a batch
+     */
+    struct {
+        uint64_t operations;
+        uint64_t failures;
+    } key_types[NEVERBLEED_STATS_NUM_KEY_TYPES];
+    /**
+     * RSA operations that had to create blinding factors inline
+     */
+    uint64_t rsa_blinding_inline;
+    /**
+     * ECDSA signatures that used a precomputed nonce, and those that did not
+     */
+    uint64_t ecdsa_nonces_precomputed;
+    uint64_t ecdsa_nonces_inline;
+    /**
+     * private key operations handed to the home worker of the key, and those processed by another worker because the home worker
+     * was busy or stuck (see `neverbleed_key_affinity`)
+     */
+    uint64_t affinity_routed;
+    uint64_t affinity_spilled;
+} neverbleed_stats_t;
+
+/**
+ * obtains the counters of the daemons, summed up (returns 0 if successful)
+ */
+int neverbleed_get_stats(neverbleed_t *nb, neverbleed_stats_t *stats);
+/**
+ * returns the upper bound of the bucket that contains the given percentile (0 to 100) of the recorded durations, in nanoseconds, or
+ * 0 if the histogram is empty
+ */
+uint64_t neverbleed_histogram_percentile(const neverbleed_histogram_t *hist, double percentile);
+
 /**
  * setuidgid (also changes the file permissions so that `user` can connect to the daemon, if change_socket_ownership is non-zero)
  */
@@ -58,6 +265,56 @@ int neverbleed_setuidgid(neverbleed_t *nb, const char *user, int change_socket_o
  * spawned
  */
 extern void (*neverbleed_post_fork_cb)(void);
+/**
+ * number of threads that each daemon uses for processing the requests, to be set before calling `neverbleed_init`. When zero (the
+ * default), the number of CPUs that the daemon may run on is used. On Linux, the threads multiplex all the connections using epoll.
+ */
+extern size_t neverbleed_num_workers;
+/**
+ * number of daemon processes spawned by `neverbleed_init` (default: 1). On Linux, each daemon is bound to an equal share of the
+ * CPUs that the process is allowed to run on, so that its threads and memory stay close to those CPUs. Each key is loaded into
+ * the daemon holding the fewest keys, unless `neverbleed_replicate_keys` is set.
+ */
+extern size_t neverbleed_num_daemons;
+/**
+ * if set to non-zero when a key is being loaded, the key is loaded into all the daemons, and each operation using the key is sent
+ * to the daemon with the fewest operations in flight
+ */
+extern int neverbleed_replicate_keys;
+/**
+ * if set to non-zero before calling `neverbleed_init`, the operations that block the calling thread are sent through a pool of
+ * that many connections per daemon, shared by all the threads, instead of through a connection per thread. The requests sent
+ * through each connection are processed concurrently by the daemon. The connections used by the non-blocking operations and by
+ * the paused ASYNC jobs are not affected, nor do the shared connections use the rings of `neverbleed_use_shm_ring`.
+ */
+extern size_t neverbleed_num_shared_conns;
+/**
+ * if set to non-zero before calling `neverbleed_init`, each key is assigned a home worker thread of the daemon (the one that has
+ * run the fewest operations recently), and the private key operations using the key are run by that worker, so that the values
+ * of the key stay in the caches of one CPU. The operations are run by other workers when the home worker is busy or stuck.
+ * On Linux, the workers are also bound to a CPU each.
+ */
+extern int neverbleed_key_affinity;
+/**
+ * if set to non-zero before calling `neverbleed_init`, the connections to the daemon are socketpairs created by the daemon and
+ * handed to the application through a socket set up before forking, several at a time, instead of being established by connecting
+ * to the socket file. Threads connecting for the first time thereby skip the lookup of the path and the accept(2) by the daemon.
+ */
+extern int neverbleed_use_socketpairs;
+/**
+ * if set to non-zero before calling `neverbleed_init`, the requests and responses of private key operations are exchanged through
+ * rings placed in memory shared with the daemon, avoiding a round of system calls per operation (Linux only; ignored elsewhere)
+ */
+extern int neverbleed_use_shm_ring;
+/**
+ * if set to non-zero, `neverbleed_load_private_key_file` only registers the file name along with the public key taken from the
+ * certificate that has been assigned to the SSL context, and the daemon loads the private key when it is used for the first time.
+ * The daemon reads the file when the key is registered and retains its contents until the key is loaded, so that keys readable only
+ * by a privileged user can be used after `neverbleed_setuidgid` is called. If the private key cannot be parsed at that point (or
+ * does not match the certificate), the operations using the key fail, and the file is read again by its name after a delay that
+ * grows with the number of failures (up to a minute).
+ */
+extern int neverbleed_load_keys_lazily;
 
 #ifdef __cplusplus
 }